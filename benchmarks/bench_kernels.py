@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+"""
+Rows per second and memory traffic of the MI kernels over synthetic matrices,
+for every combination of rows, samples, bins and so given. Each kernel is
+timed best of REPEATS on the same seeded data, so runs are comparable across
+changes.
+
+    prepare       weights, marginal entropies and self MI of every row (PreparedMI)
+    prepared      one vector against the prepared rows (PreparedMI.all_mi)
+    prepared_f32  the same with float32 weights
+    all_mi        one vector against every row from the raw data (all_mi)
+
+MB is the data a kernel has to stream from memory: the matrix, and the
+prepared bins (4 bytes) and weights (so values) per sample. With -p the
+per-phase counters of the C module (see profile_counters) follow each row.
+
+usage: bench_kernels.py [-m ROWS,..] [-n SAMPLES,..] [-b BINS,..] [-o SO,..] [-r REPEATS] [-t THREADS] [-p]
+"""
+import sys, time
+import numpy as np
+from optparse import OptionParser
+from pymi.bspline import all_mi, PreparedMI, simd_level, set_profiling, profile_counters
+from pymi.LabeledMat import LabeledMat
+
+PHASES = ['weights', 'marginals', 'joint', 'normalize', 'sign']
+
+def ints(option, opt, value, parser):
+    setattr(parser.values, option.dest, [int(v) for v in value.split(',')])
+
+parser = OptionParser(usage="bench_kernels.py [options]")
+parser.add_option("-m", "--rows", dest="rows", type="string", action="callback", callback=ints, default=[2000],
+        help="comma separated row counts")
+parser.add_option("-n", "--samples", dest="samples", type="string", action="callback", callback=ints, default=[200, 1000],
+        help="comma separated sample counts")
+parser.add_option("-b", "--bins", dest="bins", type="string", action="callback", callback=ints, default=[6, 10],
+        help="comma separated numbers of bins")
+parser.add_option("-o", "--spline-order", dest="so", type="string", action="callback", callback=ints, default=[3],
+        help="comma separated spline orders")
+parser.add_option("-r", "--repeats", dest="repeats", type="int", default=3,
+        help="best of this many runs")
+parser.add_option("-t", "--threads", dest="nthreads", type="int", default=1,
+        help="number of threads")
+parser.add_option("-p", "--profile", dest="profile", action="store_true", default=False,
+        help="print the per-phase counters of every kernel")
+(options, args) = parser.parse_args()
+
+def best_time(f):
+    best = None
+    for r in range(options.repeats):
+        t = time.time()
+        f()
+        t = time.time() - t
+        best = t if best is None or t < best else best
+    return best
+
+def report(kernel, rows, samples, bins, so, seconds, nbytes):
+    print "%s\t%d\t%d\t%d\t%d\t%.4f\t%.0f\t%.1f" % (kernel, rows, samples, bins, so, seconds,
+            rows / seconds, nbytes / seconds / 1e6)
+    if options.profile:
+        # averaged over the repeats
+        counters = profile_counters(reset=True)
+        print "#\t" + "\t".join("%s %d calls %.4fs" % (p, counters[p][0] / options.repeats, counters[p][2] / options.repeats)
+                for p in PHASES)
+
+print "# simd level %d, %d thread(s), best of %d" % (simd_level(), options.nthreads, options.repeats)
+print "kernel\trows\tsamples\tbins\tso\tseconds\trows_per_s\tMB_per_s"
+set_profiling(options.profile)
+for rows in options.rows:
+    for samples in options.samples:
+        rng = np.random.RandomState(0)
+        X = LabeledMat(rng.rand(rows, samples), [str(i) for i in range(rows)], [str(i) for i in range(samples)])
+        vec = rng.rand(samples)
+        cells = rows * samples
+        for bins in options.bins:
+            for so in options.so:
+                profile_counters(reset=True)
+                t = best_time(lambda: PreparedMI(X, bins, so, options.nthreads))
+                report('prepare', rows, samples, bins, so, t, cells * (8 + 4 + so * 8))
+
+                p = PreparedMI(X, bins, so, options.nthreads)
+                profile_counters(reset=True)
+                t = best_time(lambda: p.all_mi(vec, nthreads=options.nthreads))
+                report('prepared', rows, samples, bins, so, t, cells * (4 + so * 8 + 8))
+
+                p = PreparedMI(X, bins, so, options.nthreads, float32=True)
+                profile_counters(reset=True)
+                t = best_time(lambda: p.all_mi(vec, nthreads=options.nthreads))
+                report('prepared_f32', rows, samples, bins, so, t, cells * (4 + so * 4 + 4))
+                del p
+
+                profile_counters(reset=True)
+                t = best_time(lambda: all_mi(X, vec, bins, so, nthreads=options.nthreads))
+                report('all_mi', rows, samples, bins, so, t, cells * 8 * 2)
@@ -0,0 +1,37 @@
+#!/usr/bin/env python
+"""
+Time all_mi with the kernels specialized for bins 6-12 / so 2-4 against the
+generic path, per (bins, so) configuration.
+
+usage: bench_specialized.py [ROWS] [SAMPLES] [REPEATS]
+"""
+import sys, time
+import numpy as np
+from pymi.bspline import all_mi, set_specialized_kernels
+from pymi.LabeledMat import LabeledMat
+
+rows = int(sys.argv[1]) if len(sys.argv) > 1 else 2000
+samples = int(sys.argv[2]) if len(sys.argv) > 2 else 1000
+repeats = int(sys.argv[3]) if len(sys.argv) > 3 else 3
+
+rng = np.random.RandomState(0)
+X = LabeledMat(rng.rand(rows, samples), [str(i) for i in range(rows)], [str(i) for i in range(samples)])
+vec = rng.rand(samples)
+
+def best_time(bins, so):
+    best = None
+    for r in range(repeats):
+        t = time.time()
+        all_mi(X, vec, bins, so)
+        t = time.time() - t
+        best = t if best is None or t < best else best
+    return best
+
+print "bins\tso\tgeneric_s\tspecialized_s\tspeedup"
+for bins in range(6, 13, 2) + [14]:
+    for so in [2, 3, 4]:
+        set_specialized_kernels(False)
+        generic = best_time(bins, so)
+        set_specialized_kernels(True)
+        fast = best_time(bins, so)
+        print "%d\t%d\t%.4f\t%.4f\t%.2f" % (bins, so, generic, fast, generic / fast)
@@ -3,6 +3,15 @@ import sys
 import numpy as np
 import copy
 import time
+import struct
+
+# binary format: fixed header, row / column name tables, then the row-major
+# payload starting at dataOffset (aligned to BINARY_ALIGN bytes)
+BINARY_MAGIC = b'PYMILMAT'
+BINARY_VERSION = 1
+BINARY_HEADER = '<8sIIQQQQQ'    # magic, version, dtype, nrow, ncol, row / col name bytes, dataOffset
+BINARY_ALIGN = 64
+BINARY_DTYPES = [np.dtype('<f8'), np.dtype('<f4')]
 
 class LabeledMat:
     """
@@ -14,6 +23,11 @@ class LabeledMat:
     the `dt` argument stands for data type. `a4` means 4-char strings. You can set them to 
     float, int as well.
 
+    Numeric matrices can be saved in a binary format that is memory-mapped back
+    without parsing:
+        >>> x.save_binary('matrix.lmat')
+        >>> x = LabeledMat.open_binary('matrix.lmat')
+
     """
     def __init__(self, X, rownames, colnames, verbose=False, log=sys.stderr):
         self.data = X
@@ -177,7 +191,118 @@ class LabeledMat:
             fo.write(self.rownames[rcnt] + sep + sep.join([str(x) for x in l]) + eol)
             rcnt += 1
         fo.close()
-        
 
+    def save_binary(self, filename, dt=np.float64):
+        """
+        Write the matrix as a header, the row / column names and a row-major
+        float64 (default) or float32 payload, see open_binary.
+        """
+        dt = np.dtype(dt).newbyteorder('<')
+        if dt not in BINARY_DTYPES:
+            raise ValueError("binary matrices must be float64 or float32")
+        rnames = _encode_names(self.rownames)
+        cnames = _encode_names(self.colnames)
+        offset = struct.calcsize(BINARY_HEADER) + len(rnames) + len(cnames)
+        offset += -offset % BINARY_ALIGN
+        fo = open(filename, 'wb')
+        fo.write(struct.pack(BINARY_HEADER, BINARY_MAGIC, BINARY_VERSION, BINARY_DTYPES.index(dt),
+            self.nrow, self.ncol, len(rnames), len(cnames), offset))
+        fo.write(rnames)
+        fo.write(cnames)
+        fo.write(b'\0' * (offset - fo.tell()))
+        np.ascontiguousarray(self.data, dtype=dt).tofile(fo)
+        fo.close()
 
-        
+    @staticmethod
+    def open_binary(filename, mode='r', verbose=False, log=sys.stderr):
+        """
+        Memory-map a matrix written by save_binary. Only the names are read,
+        the data is paged in on use; float64 matrices go to all_mi without a copy.
+        `mode` is passed to np.memmap ('r' read-only, 'r+' writable, 'c' copy-on-write).
+        """
+        fo = open(filename, 'rb')
+        header = fo.read(struct.calcsize(BINARY_HEADER))
+        if len(header) < struct.calcsize(BINARY_HEADER) or header[:8] != BINARY_MAGIC:
+            fo.close()
+            raise ValueError(filename + " is not a binary LabeledMat file")
+        (magic, version, dtcode, nrow, ncol, rbytes, cbytes, offset) = struct.unpack(BINARY_HEADER, header)
+        if version != BINARY_VERSION or dtcode >= len(BINARY_DTYPES):
+            fo.close()
+            raise ValueError(filename + ": unsupported binary LabeledMat version or data type")
+        rownames = _decode_names(fo.read(rbytes), nrow)
+        colnames = _decode_names(fo.read(cbytes), ncol)
+        fo.close()
+        if verbose:
+            print >> log, "Number of rows: \t%s\nNumber of columns: \t%s" % (nrow, ncol)
+        if nrow * ncol == 0:
+            X = np.zeros((nrow, ncol), dtype=BINARY_DTYPES[dtcode])
+        else:
+            X = np.memmap(filename, dtype=BINARY_DTYPES[dtcode], mode=mode, offset=offset, shape=(nrow, ncol))
+        return LabeledMat(X, rownames, colnames, verbose=verbose, log=log)
+
+    @staticmethod
+    def iter_chunks(filename, chunk_rows=4096, sep='\t', verbose=False, log=sys.stderr):
+        """
+        Yield a binary or text matrix file as LabeledMat blocks of at most
+        chunk_rows float64 rows, reading the file once and holding one block
+        at a time.
+        """
+        if LabeledMat.is_binary(filename):
+            X = LabeledMat.open_binary(filename)
+            for i in range(0, X.nrow, chunk_rows):
+                yield LabeledMat(np.array(X.data[i:i + chunk_rows], dtype=float),
+                        X.rownames[i:i + chunk_rows], X.colnames, verbose=verbose, log=log)
+            return
+
+        fo = open(filename, 'r')
+        try:
+            colnames = fo.readline().strip().split(sep)
+            ncols = len(colnames)
+            firstLine = True
+            rows = []
+            for line in fo:
+                tokens = line.strip().split(sep)
+                if firstLine:
+                    firstLine = False
+                    if len(tokens) == ncols:
+                        ncols -= 1
+                        colnames = colnames[1:]
+                assert( (len(tokens) - 1 ) == ncols)
+                rows.append(tokens)
+                if len(rows) == chunk_rows:
+                    yield LabeledMat._chunk_from_tokens(rows, colnames, verbose, log)
+                    rows = []
+        finally:
+            # also when the consumer stops early and closes the generator
+            fo.close()
+        if len(rows) > 0:
+            yield LabeledMat._chunk_from_tokens(rows, colnames, verbose, log)
+
+    @staticmethod
+    def _chunk_from_tokens(rows, colnames, verbose, log):
+        X = np.ndarray(shape=(len(rows), len(colnames)), dtype=float)
+        for (i, tokens) in enumerate(rows):
+            X[i,:] = tokens[1:]
+        return LabeledMat(X, [tokens[0] for tokens in rows], colnames, verbose=verbose, log=log)
+
+    @staticmethod
+    def is_binary(filename):
+        fo = open(filename, 'rb')
+        magic = fo.read(8)
+        fo.close()
+        return magic == BINARY_MAGIC
+
+def _encode_names(names):
+    # names are newline separated, so they cannot contain newlines themselves
+    s = '\n'.join(names)
+    if not isinstance(s, bytes):
+        s = s.encode('utf-8')
+    return s
+
+def _decode_names(s, n):
+    if bytes is not str:
+        s = s.decode('utf-8')
+    names = s.split('\n') if n > 0 else []
+    if len(names) != n:
+        raise ValueError("corrupt name table in binary LabeledMat file")
+    return names
@@ -1,11 +1,97 @@
 import sys
+import os
+import struct
+import hashlib
+import tempfile
 import numpy as np
 import itertools
 import math
 import collections
+import threading
+import Queue
 import _c_bsplinemi
 from LabeledMat import LabeledMat
 
+def _matrix(X, float32=False):
+    # C-contiguous data of the requested type (including open_binary memmaps) is passed as is
+    return np.ascontiguousarray(X.data, dtype=np.float32 if float32 else float)
+
+def _row_configs(X, bins, so):
+    # None when every row uses the same bins / so, else per-row int vectors
+    if np.isscalar(bins) and np.isscalar(so):
+        return None
+    return (np.zeros(X.nrow, dtype=np.intc) + np.asarray(bins, dtype=np.intc),
+            np.zeros(X.nrow, dtype=np.intc) + np.asarray(so, dtype=np.intc))
+
+def _subsets(X, subsets):
+    # {label: columns} -> (labels, concatenated column indices, offsets), columns
+    # given as indices, column names or a boolean mask over the columns
+    labels = list(subsets.keys())
+    idx = []
+    offsets = [0]
+    for label in labels:
+        cols = np.asarray(subsets[label])
+        if cols.dtype == bool:
+            cols = np.nonzero(cols)[0]
+        elif cols.dtype.kind in 'SU':
+            cols = [X.colmap[c] for c in cols]
+        idx.extend(int(c) for c in cols)
+        offsets.append(len(idx))
+    return (labels, np.array(idx, dtype=np.intc), np.array(offsets, dtype=np.intc))
+
+def _select(rownames, mis, top_k, min_abs_mi):
+    # the selection of the C all_mi: highest first, ties by row
+    hits = sorted([(i, s) for (i, s) in enumerate(mis) if abs(s) >= min_abs_mi], key=lambda a: (-a[1], a[0]))
+    if top_k > 0:
+        hits = hits[:top_k]
+    return [(rownames[i], s) for (i, s) in hits]
+
+def _subset_dicts(rownames, labels, mis):
+    return dict((label, dict(zip(rownames, mis[:, g]))) for (g, label) in enumerate(labels))
+
+def set_specialized_kernels(on=True):
+    """
+    Use (default) or bypass the C kernels specialized for bins 6-12 and
+    so 2-4; results are identical either way. The specialized joint entropies
+    follow set_simd_level too. Returns the previous setting.
+    """
+    return bool(_c_bsplinemi.set_specialized(int(on)))
+
+def simd_level():
+    """
+    SIMD level of the C kernels: 0 scalar, 1 AVX2, 2 AVX-512. Detected from
+    the CPU at import.
+    """
+    return _c_bsplinemi.simd_level()
+
+def set_simd_level(level):
+    """
+    Lower (or restore) the SIMD level, clamped to what the CPU supports;
+    this applies to the specialized kernels as well. Returns the previous level.
+    """
+    return _c_bsplinemi.set_simd_level(level)
+
+def set_profiling(on=True):
+    """
+    Turn on (or off) the per-phase timers and counters of the C kernels,
+    read with profile_counters. Off by default; returns the previous setting.
+    """
+    return bool(_c_bsplinemi.set_profiling(int(on)))
+
+def profile_counters(reset=False):
+    """
+    {phase: (calls, samples, seconds)} accumulated while profiling, over every
+    thread, for the phases 'weights' (B-spline weights), 'marginals' (single
+    entropies), 'joint' (joint histograms and entropies of two vectors),
+    'normalize' (the self terms H(x, x) of the self MI that scores are divided
+    by) and 'sign' (the product moments that sign scores). With reset the
+    counters are zeroed after reading.
+    """
+    counters = _c_bsplinemi.profile_counters()
+    if reset:
+        _c_bsplinemi.reset_profile()
+    return counters
+
 def knot_vector(bins, spline_order):
     internal_points = bins - spline_order + 1
     v = [[0]*spline_order , range(1, internal_points)  , [internal_points]*spline_order]
@@ -49,7 +135,7 @@ def find_weights(x, bins = 6, so = 3, x_min = -1, x_max = -1):
         print >> sys.stderr, "ERROR: input vector is not iterable!"
         raise
     n = len(x)
-    w = _c_bsplinemi.find_weights(x, bins, spline_order)
+    w = _c_bsplinemi.find_weights(x, bins, so)
     return w.reshape((bins, n))
 
 def entropy(x, bins=6, so=3):
@@ -70,6 +156,11 @@ def joint_entropy(x, y, bins=6, so=3):
     return _c_bsplinemi.joint_entropy(x, y, bins, so)
 
 def mi(x, y, bins=6, so = 3, norm = True, negateMI = False):
+    """
+    MI of x and y. NaNs mark missing values: only the samples observed in both
+    vectors are used (pairwise complete), each vector scaled by the min and max
+    of its own observed values. MI is 0 when no sample is observed in both.
+    """
     if not isinstance(x, collections.Iterable) or not isinstance(y, collections.Iterable):
         print >> sys.stderr, "ERROR: input vectors are not both iterable!"
         raise
@@ -80,7 +171,148 @@ def mi(x, y, bins=6, so = 3, norm = True, negateMI = False):
 
     return _c_bsplinemi.mi(x, y, bins, so, norm, negateMI)
 
-def all_mi(X, vec, bins=6, so = 3, norm=True, negateMI=True):
+def mi_permutation_test(x, y, n_perm=1000, seed=0, bins=6, so=3, norm=True, negateMI=False, alpha=0, nthreads=1):
+    """
+    (MI, p-value) of x and y, where the p-value is the share of n_perm sample
+    permutations of y with an MI at least as large in magnitude, (1 + hits) / (1 + n_perm).
+
+    The weights are computed once and only the joint entropy is redone per
+    permutation. With alpha > 0, permutations stop early once the p-value is
+    certain to exceed alpha. Results depend only on seed, not on nthreads.
+
+    NaNs are treated as in mi: only the samples observed in both x and y are
+    scored and permuted.
+    """
+    if not isinstance(x, collections.Iterable) or not isinstance(y, collections.Iterable):
+        print >> sys.stderr, "ERROR: input vectors are not both iterable!"
+        raise
+
+    if len(x) != len(y):
+        print >> sys.stderr, "ERROR: two vectors must be of same length!"
+        raise
+
+    (m, p, done) = _c_bsplinemi.mi_permutation_test(x, y, n_perm, seed, bins, so, norm, negateMI, alpha, nthreads)
+    return (m, p)
+
+def all_mi_pvalues(X, vec, n_perm=1000, seed=0, bins=6, so=3, norm=True, negateMI=True, alpha=0, nthreads=1):
+    """
+    all_mi with a permutation p-value for every row, as a dict of
+    rowname -> (MI, p-value); see mi_permutation_test. The same permutations
+    of vec are used for every row, and with alpha > 0 each row stops on its own.
+    Missing values (NaN) in X or vec raise a ValueError.
+    """
+    if X.__class__.__name__ != 'LabeledMat':
+        print >> sys.stderr, "ERROR: input matrix must be LabeledMat!"
+        raise
+
+    if X.ncol != len(vec):
+        print >> sys.stderr, "ERROR: two vectors must be of same length!"
+        raise
+
+    (mis, ps, done) = _c_bsplinemi.all_mi_permutation(_matrix(X), vec, n_perm, seed, bins, so, norm, negateMI, alpha, nthreads)
+    return dict(zip(X.rownames, zip(mis, ps)))
+
+def mi3(x, y, z, bins=6, so=3):
+    """
+    Interaction information I(x;y;z) = I(x;z) + I(y;z) - I(x,y;z), positive
+    when x and y are redundant about z and negative when they are synergistic.
+    NaNs raise a ValueError, as in mi2vs1, all_triplets_mi, cmi and all_cmi.
+    """
+    if len(x) != len(y) or len(x) != len(z):
+        print >> sys.stderr, "ERROR: three vectors must be of same length!"
+        raise
+
+    return _c_bsplinemi.mi3(x, y, z, bins, so)
+
+def mi2vs1(x, y, z, bins=6, so=3, norm=True):
+    """
+    MI between the pair (x, y) taken as one variable and z.
+    """
+    if len(x) != len(y) or len(x) != len(z):
+        print >> sys.stderr, "ERROR: three vectors must be of same length!"
+        raise
+
+    return _c_bsplinemi.mi2vs1(x, y, z, bins, so, norm)
+
+def all_triplets_mi(X, x, y, bins=6, so=3, norm=True, nthreads=1):
+    """
+    mi3 and mi2vs1 of the fixed pair (x, y) with every row of X as z, as a dict
+    of rowname -> (interaction information, MI of (x, y) with the row).
+    """
+    if X.__class__.__name__ != 'LabeledMat':
+        print >> sys.stderr, "ERROR: input matrix must be LabeledMat!"
+        raise
+
+    if X.ncol != len(x) or X.ncol != len(y):
+        print >> sys.stderr, "ERROR: two vectors must be of same length!"
+        raise
+
+    (ii, mis) = _c_bsplinemi.all_triplets(_matrix(X), x, y, bins, so, norm, nthreads)
+    return dict(zip(X.rownames, zip(ii, mis)))
+
+def cmi(x, y, z, bins=6, so=3):
+    """
+    Conditional MI I(x;y|z).
+    """
+    if len(x) != len(y) or len(x) != len(z):
+        print >> sys.stderr, "ERROR: three vectors must be of same length!"
+        raise
+
+    return _c_bsplinemi.cmi(x, y, z, bins, so)
+
+def all_cmi(X, vec, z, bins=6, so=3, nthreads=1):
+    """
+    I(vec;row|z) for every row of X, as a dict of rowname -> CMI. The weights,
+    entropies and joint histogram of vec and z are computed once.
+    """
+    if X.__class__.__name__ != 'LabeledMat':
+        print >> sys.stderr, "ERROR: input matrix must be LabeledMat!"
+        raise
+
+    if X.ncol != len(vec) or X.ncol != len(z):
+        print >> sys.stderr, "ERROR: two vectors must be of same length!"
+        raise
+
+    mis = _c_bsplinemi.all_cmi(_matrix(X), vec, z, bins, so, nthreads)
+    return dict(zip(X.rownames, mis))
+
+def mi_diff_bins(x, y, binx=6, biny=6, sox=3, soy=3, norm=True, negateMI=False):
+    if len(x) != len(y):
+        print >> sys.stderr, "ERROR: two vectors must be of same length!"
+        raise
+
+    return _c_bsplinemi.mi_diff_bins(x, y, binx, biny, sox, soy, norm, negateMI)
+
+def all_mi(X, vec, bins=6, so = 3, norm=True, negateMI=True, nthreads=1, top_k=0, min_abs_mi=0, vec_bins=None, vec_so=None, float32=False, subsets=None):
+    """
+    MI between vec and every row of X, as a dict of rowname -> MI.
+
+    With top_k and/or min_abs_mi, only the top_k highest scores whose absolute
+    value is at least min_abs_mi are kept while scanning, and a list of
+    (rowname, MI) pairs is returned, highest first.
+
+    bins and so may also be sequences with one entry per row. vec then uses
+    vec_bins / vec_so, by default the largest of the rows'.
+
+    With float32, X is read as float32 (in place when it already is). The
+    B-spline weights are still evaluated in double and then rounded to float32,
+    and histograms are still summed in double, so the kernels are no faster.
+    float32 saves memory only for PreparedMI, which keeps the weights; here
+    the one saving is reading a float32 matrix. MI then differs from the
+    float64 result on the same data by at most 2^-23 * (4*log2(bins) + 4.33)
+    bits, about 2e-6, before normalization.
+    float32 with per-row bins / so, or with NaNs in X or vec, raises a ValueError.
+
+    NaNs in X or vec are treated as in mi, per pair of vec and a row; rows and
+    a vec without NaNs take the unmasked path. all_pairs_mi, all_mi_batch and
+    PreparedMI score NaNs the same way; with per-row bins they raise a ValueError.
+
+    subsets is a dict of label -> columns (indices, column names or a boolean
+    mask) to score within each subgroup of samples instead, in one pass over X
+    without copying it; a dict of label -> {rowname: MI} is returned. Each row
+    keeps the scaling of all its samples, so this differs slightly from all_mi on
+    the sliced matrix. Not with top_k / min_abs_mi, float32 or per-row bins.
+    """
     if X.__class__.__name__ != 'LabeledMat':
         print >> sys.stderr, "ERROR: input matrix must be LabeledMat!"
         raise
@@ -93,8 +325,445 @@ def all_mi(X, vec, bins=6, so = 3, norm=True, negateMI=True):
         print >> sys.stderr, "ERROR: two vectors must be of same length!"
         raise
 
-    mis = _c_bsplinemi.all_mi(X.data, vec, bins, so, norm, negateMI)
+    configs = _row_configs(X, bins, so)
+    if subsets is not None:
+        if configs is not None or float32 or top_k > 0 or min_abs_mi > 0:
+            print >> sys.stderr, "ERROR: subsets cannot be combined with per-row bins, float32, top_k or min_abs_mi!"
+            raise
+        (labels, idx, offsets) = _subsets(X, subsets)
+        mis = _c_bsplinemi.all_mi_subsets(_matrix(X), vec, idx, offsets, bins, so, norm, negateMI, nthreads)
+        return _subset_dicts(X.rownames, labels, mis)
+
+    if configs is not None:
+        if float32:
+            raise ValueError("float32 cannot be combined with per-row bins / so")
+        (rbins, rso) = configs
+        vec_bins = int(rbins.max()) if vec_bins is None else vec_bins
+        vec_so = int(rso.max()) if vec_so is None else vec_so
+        mis = _c_bsplinemi.all_mi_mixed(_matrix(X), vec, rbins, rso, vec_bins, vec_so, norm, negateMI, nthreads)
+        if top_k > 0 or min_abs_mi > 0:
+            return _select(X.rownames, mis, top_k, min_abs_mi)
+        return dict(zip(X.rownames, mis))
+
+    if top_k > 0 or min_abs_mi > 0:
+        idx, mis = _c_bsplinemi.all_mi(_matrix(X, float32), vec, bins, so, norm, negateMI, nthreads, top_k, min_abs_mi)
+        return [(X.rownames[i], s) for (i, s) in zip(idx, mis)]
+
+    mis = _c_bsplinemi.all_mi(_matrix(X, float32), vec, bins, so, norm, negateMI, nthreads)
     return dict(zip(X.rownames, mis))
 
+def _prefetch(chunks, depth=1):
+    # read the next chunks in a thread; the C scoring releases the GIL, so
+    # reading and scoring overlap. When the consumer stops early (an error or
+    # close()), the reader sees stop within a put timeout, closes chunks and exits.
+    q = Queue.Queue(maxsize=depth)
+    stop = threading.Event()
+    done = object()
+    def put(item):
+        while not stop.is_set():
+            try:
+                q.put(item, timeout=0.1)
+                return True
+            except Queue.Full:
+                pass
+        return False
+    def reader():
+        try:
+            for c in chunks:
+                if not put((c, None)):
+                    return
+        except Exception:
+            put((None, sys.exc_info()[1]))
+            return
+        finally:
+            if stop.is_set() and hasattr(chunks, 'close'):
+                chunks.close()
+        put((done, None))
+    t = threading.Thread(target=reader)
+    t.daemon = True
+    t.start()
+    try:
+        while True:
+            (c, err) = q.get()
+            if err is not None:
+                raise err
+            if c is done:
+                return
+            yield c
+    finally:
+        stop.set()
+        t.join()
+
+def all_mi_chunked(source, vec, bins=6, so=3, norm=True, negateMI=True, nthreads=1, top_k=0, min_abs_mi=0, chunk_rows=4096, float32=False):
+    """
+    all_mi over a matrix that is not held in memory as a whole.
+
+    source is a matrix file name (binary or text, read chunk_rows rows at a time
+    by LabeledMat.iter_chunks) or any iterable of LabeledMat row blocks with the
+    columns of vec. The next block is read while the current one is scored, so at
+    most three blocks are in memory. Results are the same as all_mi on the whole
+    matrix; with top_k / min_abs_mi only the current selection is kept between blocks.
+    float32 is as in all_mi.
+    """
+    if isinstance(source, basestring):
+        source = LabeledMat.iter_chunks(source, chunk_rows)
+
+    select = top_k > 0 or min_abs_mi > 0
+    out = [] if select else {}
+    offset = 0
+    chunks = _prefetch(source)
+    try:
+        for X in chunks:
+            if X.ncol != len(vec):
+                print >> sys.stderr, "ERROR: two vectors must be of same length!"
+                raise
+            if select:
+                idx, mis = _c_bsplinemi.all_mi(_matrix(X, float32), vec, bins, so, norm, negateMI, nthreads, top_k, min_abs_mi)
+                out.extend((offset + i, X.rownames[i], s) for (i, s) in zip(idx, mis))
+                # same order as all_mi: highest first, ties by row
+                out.sort(key=lambda a: (-a[2], a[0]))
+                if top_k > 0:
+                    del out[top_k:]
+            else:
+                out.update(zip(X.rownames, _c_bsplinemi.all_mi(_matrix(X, float32), vec, bins, so, norm, negateMI, nthreads)))
+            offset += X.nrow
+    finally:
+        # stops the reader thread when a block fails
+        chunks.close()
+
+    if select:
+        return [(r, s) for (i, r, s) in out]
+    return out
+
+def all_pairs_mi(X, bins=6, so = 3, norm=True, negateMI=True, nthreads=1):
+    """
+    MI between every pair of rows of X, as a LabeledMat. bins and so may be
+    sequences with one entry per row.
+    """
+    if X.__class__.__name__ != 'LabeledMat':
+        print >> sys.stderr, "ERROR: input matrix must be LabeledMat!"
+        raise
+
+    configs = _row_configs(X, bins, so)
+    if configs is not None:
+        mis = _c_bsplinemi.all_pairs_mi_mixed(_matrix(X), configs[0], configs[1], norm, negateMI, nthreads)
+        return LabeledMat(mis, X.rownames, X.rownames)
+
+    mis = _c_bsplinemi.all_pairs_mi(_matrix(X), bins, so, norm, negateMI, nthreads)
+    return LabeledMat(mis, X.rownames, X.rownames)
+
+def all_mi_batch(X, Q, bins=6, so = 3, norm=True, negateMI=True, nthreads=1):
+    if X.__class__.__name__ != 'LabeledMat':
+        print >> sys.stderr, "ERROR: input matrix must be LabeledMat!"
+        raise
+
+    if Q.__class__.__name__ == 'LabeledMat':
+        qnames = Q.rownames
+        Q = _matrix(Q)
+    else:
+        Q = np.array(Q, dtype=float, ndmin=2)
+        qnames = [str(i) for i in range(Q.shape[0])]
+
+    if X.ncol != Q.shape[1]:
+        print >> sys.stderr, "ERROR: queries and matrix must have the same number of columns!"
+        raise
+
+    mis = _c_bsplinemi.all_mi_batch(_matrix(X), Q, bins, so, norm, negateMI, nthreads)
+    return LabeledMat(mis, qnames, X.rownames)
+
+# weight cache file: fixed header, then the bins, weights, marginal entropies
+# and self MI of every row (see prepared_arrays), each section aligned to
+# WEIGHTS_ALIGN bytes. Files are named by _weights_key and only ever replaced
+# whole, so any number of processes can map one read-only.
+WEIGHTS_MAGIC = b'PYMIWGTS'
+WEIGHTS_VERSION = 1
+WEIGHTS_HEADER = '<8sIIIIIQQ20s'   # magic, version, dtype, bins, so, range mode, nrow, ncol, sha1 of the data
+WEIGHTS_ALIGN = 64
+WEIGHTS_DTYPES = [np.dtype('<f8'), np.dtype('<f4')]
+RANGE_PER_ROW = 0   # each row scaled to its own min / max, the only mode of PreparedMI
+
+def _checksum(M):
+    h = hashlib.sha1()
+    for i in range(0, M.shape[0], 4096):
+        h.update(np.ascontiguousarray(M[i:i + 4096]))
+    return h
+
+def _weights_key(checksum, M, bins, so, range_mode):
+    return '%s-b%d-o%d-r%d-%s.pmw' % (checksum.hexdigest(), bins, so, range_mode, M.dtype.str[1:])
+
+def _weights_layout(nrow, ncol, so, dt):
+    # (offset, dtype, shape) of the bins, weights, e1 and selfMI sections
+    sections = []
+    offset = struct.calcsize(WEIGHTS_HEADER)
+    for (sdt, shape) in [(np.dtype('<i4'), (nrow, ncol)), (dt, (nrow, ncol, so)), (np.dtype('<f8'), (nrow,)), (np.dtype('<f8'), (nrow,))]:
+        offset += -offset % WEIGHTS_ALIGN
+        sections.append((offset, sdt, shape))
+        offset += sdt.itemsize * int(np.prod(shape))
+    return (sections, offset)
+
+def _save_weights(filename, checksum, M, prepared, bins, so, range_mode):
+    # written to a temporary file renamed into place, readers never see a partial
+    # file; the cache is only an optimization, so failing to write it is a warning
+    (nrow, ncol) = M.shape
+    (sections, size) = _weights_layout(nrow, ncol, so, M.dtype)
+    tmp = fo = None
+    try:
+        (fd, tmp) = tempfile.mkstemp(dir=os.path.dirname(os.path.abspath(filename)), suffix='.tmp')
+        fo = os.fdopen(fd, 'wb')
+        fo.write(struct.pack(WEIGHTS_HEADER, WEIGHTS_MAGIC, WEIGHTS_VERSION, WEIGHTS_DTYPES.index(M.dtype),
+            bins, so, range_mode, nrow, ncol, checksum.digest()))
+        for ((offset, sdt, shape), a) in zip(sections, _c_bsplinemi.prepared_arrays(prepared)):
+            fo.write(b'\0' * (offset - fo.tell()))
+            np.ascontiguousarray(a, dtype=sdt).tofile(fo)
+        fo.close()
+        os.rename(tmp, filename)
+    except Exception:
+        print >> sys.stderr, "WARNING: could not write weight cache %s: %s" % (filename, sys.exc_info()[1])
+        try:
+            if fo is not None and not fo.closed:
+                fo.close()
+        except Exception:
+            pass
+        if tmp is not None and os.path.exists(tmp):
+            try:
+                os.remove(tmp)
+            except OSError:
+                pass
+        return False
+    return True
+
+def _load_weights(filename, checksum, M, bins, so, range_mode):
+    # prepared rows mapped read-only from a _save_weights file, None when it
+    # is missing, unreadable, truncated or was made for other data or settings
+    try:
+        fo = open(filename, 'rb')
+        header = fo.read(struct.calcsize(WEIGHTS_HEADER))
+        fo.close()
+    except (IOError, OSError):
+        return None
+    if len(header) < struct.calcsize(WEIGHTS_HEADER):
+        return None
+    (magic, version, dtcode, fbins, fso, frange, nrow, ncol, digest) = struct.unpack(WEIGHTS_HEADER, header)
+    if magic != WEIGHTS_MAGIC or version != WEIGHTS_VERSION or dtcode >= len(WEIGHTS_DTYPES) or \
+            WEIGHTS_DTYPES[dtcode] != M.dtype or (fbins, fso, frange) != (bins, so, range_mode) or \
+            (nrow, ncol) != M.shape or digest != checksum.digest():
+        return None
+    (sections, size) = _weights_layout(nrow, ncol, so, M.dtype)
+    if os.path.getsize(filename) < size:
+        return None
+    (b, w, e1, selfmi) = [np.memmap(filename, dtype=sdt, mode='r', offset=offset, shape=shape) for (offset, sdt, shape) in sections]
+    return _c_bsplinemi.prepare_from_arrays(M, b, w, e1, selfmi, bins, so)
+
+# rows of the network whose edges mi_network writes at a time
+NETWORK_ROW_BLOCK = 1024
+
+class PreparedMI:
+    """
+    Per-row B-spline weights and marginal entropies of a LabeledMat, computed once
+    so that repeated queries against the same matrix only pay for the joint entropy.
+
+    Usage:
+        >>> p = PreparedMI(X, bins=6, so=3)
+        >>> mis = p.all_mi(X.data[X.rowmap['GENE'], :])
+
+    The matrix data is read in place and must not be modified while in use.
+    NaNs are treated as in all_mi, by all_mi and mi_network; find_attractor(s)
+    raise a ValueError on them. With float32 the weights take half the memory,
+    see all_mi; NaNs then raise a ValueError. all_mi takes
+    subsets as all_mi does, reusing the prepared weights (not with float32).
+
+    With cache, a directory, the weights are saved there under a name made of
+    the data checksum, bins, so, range mode and weight type, and later
+    PreparedMI of the same data memory-map them instead of recomputing them,
+    so the processes on a host share one copy in the page cache.
+    """
+    def __init__(self, X, bins=6, so=3, nthreads=1, float32=False, cache=None):
+        if X.__class__.__name__ != 'LabeledMat':
+            print >> sys.stderr, "ERROR: input matrix must be LabeledMat!"
+            raise
+        self.X = X
+        self.bins = bins
+        self.so = so
+        M = _matrix(X, float32)
+        if cache is None or M.size == 0:
+            self._prepared = _c_bsplinemi.prepare(M, bins, so, nthreads)
+            return
+        checksum = _checksum(M)
+        fn = os.path.join(cache, _weights_key(checksum, M, bins, so, RANGE_PER_ROW))
+        self._prepared = _load_weights(fn, checksum, M, bins, so, RANGE_PER_ROW)
+        if self._prepared is None:
+            self._prepared = _c_bsplinemi.prepare(M, bins, so, nthreads)
+            # on failure the rows just prepared are used uncached
+            _save_weights(fn, checksum, M, self._prepared, bins, so, RANGE_PER_ROW)
+
+    def all_mi(self, vec, norm=True, negateMI=True, nthreads=1, subsets=None, top_k=0, min_abs_mi=0):
+        """
+        all_mi of vec against the prepared rows, with subsets, top_k and
+        min_abs_mi as in all_mi.
+        """
+        if not isinstance(vec, collections.Iterable):
+            print >> sys.stderr, "ERROR: input vector must be iterable!"
+            raise
+
+        if self.X.ncol != len(vec):
+            print >> sys.stderr, "ERROR: two vectors must be of same length!"
+            raise
+
+        if subsets is not None:
+            (labels, idx, offsets) = _subsets(self.X, subsets)
+            mis = _c_bsplinemi.prepared_all_mi_subsets(self._prepared, vec, idx, offsets, norm, negateMI, nthreads)
+            return _subset_dicts(self.X.rownames, labels, mis)
+
+        if top_k > 0 or min_abs_mi > 0:
+            idx, mis = _c_bsplinemi.prepared_all_mi(self._prepared, vec, norm, negateMI, nthreads, top_k, min_abs_mi)
+            return [(self.X.rownames[i], s) for (i, s) in zip(idx, mis)]
+        mis = _c_bsplinemi.prepared_all_mi(self._prepared, vec, norm, negateMI, nthreads)
+        return dict(zip(self.X.rownames, mis))
+
+    def _top(self, top, topmi):
+        return [(self.X.rownames[i], s) for (i, s) in zip(top, topmi) if i >= 0]
+
+    def find_attractor(self, seed, top_k=10, exponent=1.0, tol=1e-6, max_iter=100, prune_margin=0.1, norm=True, negateMI=True, nthreads=1):
+        """
+        Attractor metagene from seed, a rowname or a vector: every row is scored
+        against the metagene, which is then replaced by the average of the top_k
+        rows weighted by MI ** exponent, until it moves by less than tol (relative).
+
+        Once an iteration keeps the top rows, the next one only rescores rows within
+        prune_margin of the top_k-th score. This pruning is a heuristic, not an
+        exact bound: a row further below can still move into the top set while
+        it is not rescored. Convergence is only accepted after a full scan, which
+        catches such rows, so pruning costs at most extra iterations; 0 turns it
+        off.
+
+        Returns (metagene, [(rowname, MI), ...] top rows highest first, converged).
+        """
+        if isinstance(seed, basestring):
+            seed = self.X.data[self.X.rowmap[seed], :]
+        if self.X.ncol != len(seed):
+            print >> sys.stderr, "ERROR: two vectors must be of same length!"
+            raise
+        (metagene, mis, top, topmi, converged, iterations) = _c_bsplinemi.find_attractor(self._prepared, seed, top_k, exponent,
+            tol, max_iter, prune_margin, norm, negateMI, nthreads)
+        return (metagene, self._top(top, topmi), bool(converged))
+
+    def find_attractors(self, seeds=None, top_k=10, exponent=1.0, tol=1e-6, max_iter=100, prune_margin=0.1, norm=True, negateMI=True, nthreads=1):
+        """
+        find_attractor from several seeds in parallel: seeds is a list of rownames
+        (by default every row) or a LabeledMat of seed vectors. Returns a dict of
+        seed name -> (metagene, top rows, converged).
+        """
+        if seeds is None:
+            seeds = self.X.rownames
+        if seeds.__class__.__name__ == 'LabeledMat':
+            names = seeds.rownames
+            S = _matrix(seeds)
+        else:
+            names = list(seeds)
+            S = np.ascontiguousarray(self.X.data[[self.X.rowmap[r] for r in names], :], dtype=float)
+        (metagenes, top, topmi, converged, iterations) = _c_bsplinemi.find_attractors(self._prepared, S, top_k, exponent,
+            tol, max_iter, prune_margin, norm, negateMI, nthreads)
+        return dict((r, (metagenes[i], self._top(top[i], topmi[i]), bool(converged[i]))) for (i, r) in enumerate(names))
+
+    def mi_network(self, threshold=0.1, dpi=True, dpi_tolerance=0.0, norm=True, negateMI=True, nthreads=1, output=None, sep='\t'):
+        """
+        ARACNE-style network of the rows: pairs with |MI| >= threshold are linked,
+        and with dpi each edge is dropped when some row linked to both ends has a
+        larger |MI| with each of them, beyond dpi_tolerance (relative). Only the
+        edges are kept, so memory grows with their number rather than nrow^2.
+
+        Returns a list of (row1, row2, MI) with row1 before row2 in X, or, with
+        output a file name or file object, writes them as row1<sep>row2<sep>MI
+        lines and returns their number. Edges are written as they are read
+        from the network, NETWORK_ROW_BLOCK rows at a time.
+        """
+        net = _c_bsplinemi.mi_network(self._prepared, threshold, dpi, dpi_tolerance, norm, negateMI, nthreads)
+        names = self.X.rownames
+        blocks = (_c_bsplinemi.network_edges(net, start, start + NETWORK_ROW_BLOCK)
+                  for start in xrange(0, self.X.nrow, NETWORK_ROW_BLOCK))
+        if output is None:
+            return [(names[i], names[j], s) for (src, dst, mis) in blocks for (i, j, s) in zip(src, dst, mis)]
+
+        fo = open(output, 'w') if isinstance(output, basestring) else output
+        num = 0
+        for (src, dst, mis) in blocks:
+            fo.write(''.join(names[i] + sep + names[j] + sep + str(s) + '\n' for (i, j, s) in zip(src, dst, mis)))
+            num += len(src)
+        if fo is not output:
+            fo.close()
+        return num
+
+def find_attractor(X, seed, bins=6, so=3, nthreads=1, **kwargs):
+    """
+    PreparedMI(X, bins, so).find_attractor(seed, ...); reuse a PreparedMI to
+    search from several seeds.
+    """
+    return PreparedMI(X, bins, so, nthreads).find_attractor(seed, nthreads=nthreads, **kwargs)
+
+def find_attractors(X, seeds=None, bins=6, so=3, nthreads=1, **kwargs):
+    """
+    PreparedMI(X, bins, so).find_attractors(seeds, ...)
+    """
+    return PreparedMI(X, bins, so, nthreads).find_attractors(seeds, nthreads=nthreads, **kwargs)
+
+def mi_network(X, threshold=0.1, bins=6, so=3, nthreads=1, **kwargs):
+    """
+    PreparedMI(X, bins, so).mi_network(threshold, ...)
+    """
+    return PreparedMI(X, bins, so, nthreads).mi_network(threshold, nthreads=nthreads, **kwargs)
+
+
+class IncrementalMI:
+    """
+    all_mi between a query vector and every row of a LabeledMat, kept up to date
+    as new samples (columns) arrive. Each row and the query are scaled to a fixed
+    range instead of their own min / max, so new samples only add to the stored
+    histogram sums: append costs O(k) per row for k samples, and all_mi only reads
+    the sums. Values outside a range are clamped to its ends; the sign used by
+    negateMI still comes from the unclamped values.
+
+    Usage:
+        >>> inc = IncrementalMI(X, vec, bins=6, so=3, ranges=(0, 16))
+        >>> inc.append(Xnew, vecnew)
+        >>> mis = inc.all_mi()
+
+    ranges is a (low, high) pair for every row or a pair of per-row sequences,
+    by default each row's min and max in X; vec_range likewise defaults to those
+    of vec. With ranges equal to the min and max of all samples the scores match
+    all_mi on the whole matrix.
+    """
+    def __init__(self, X, vec, bins=6, so=3, ranges=None, vec_range=None, nthreads=1):
+        if X.__class__.__name__ != 'LabeledMat':
+            print >> sys.stderr, "ERROR: input matrix must be LabeledMat!"
+            raise
+        data = _matrix(X)
+        if ranges is None:
+            ranges = (data.min(axis=1), data.max(axis=1))
+        if vec_range is None:
+            vec_range = (min(vec), max(vec))
+        lo = np.zeros(X.nrow) + np.asarray(ranges[0], dtype=float)
+        hi = np.zeros(X.nrow) + np.asarray(ranges[1], dtype=float)
+        self.rownames = X.rownames
+        self.bins = bins
+        self.so = so
+        self.nsamples = 0
+        self._inc = _c_bsplinemi.incremental_new(lo, hi, vec_range[0], vec_range[1], bins, so)
+        self.append(X, vec, nthreads)
 
+    def append(self, X, vec, nthreads=1):
+        """
+        Add samples: X holds the same rows as the initial matrix, in the same
+        order, with the new samples as columns; vec has the query's new values.
+        """
+        if X.__class__.__name__ != 'LabeledMat':
+            print >> sys.stderr, "ERROR: input matrix must be LabeledMat!"
+            raise
+        if X.ncol != len(vec):
+            print >> sys.stderr, "ERROR: two vectors must be of same length!"
+            raise
+        _c_bsplinemi.incremental_append(self._inc, _matrix(X), vec, nthreads)
+        self.nsamples += X.ncol
 
+    def all_mi(self, norm=True, negateMI=True):
+        mis = _c_bsplinemi.incremental_all_mi(self._inc, norm, negateMI)
+        return dict(zip(self.rownames, mis))
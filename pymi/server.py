@@ -0,0 +1,206 @@
+"""
+Resident MI query server. Matrices and their prepared B-spline weights are
+loaded once, and "MI of row R against every row" queries are answered over a
+Unix socket, concurrently from a pool of threads (the scoring itself releases
+the GIL).
+
+    python -m pymi.server [-p POOL] [-t THREADS] [-c CACHE] SOCKET [MATRIX ...]
+
+Requests and replies are one JSON object per line:
+
+    {"matrix": "/path/to/file", "row": "GENE", "top_k": 0, "min_abs_mi": 0}
+    {"hits": [["ROW", MI], ...]}    or    {"error": "..."}
+
+Hits come highest first, with the scores all_mi gives on the same matrix,
+NaNs (missing values) included. Matrices not named at startup are loaded on their
+first query and kept, and loaded again once their file is rewritten; with a cache directory their weights are saved there
+and mapped back on the next start, see PreparedMI.
+"""
+import sys
+import os
+import socket
+import threading
+import json
+import Queue
+from optparse import OptionParser
+
+from pymi.bspline import PreparedMI
+from pymi.LabeledMat import LabeledMat
+
+def load_matrix(filename):
+    # binary matrices (LabeledMat.save_binary) are memory-mapped, text is parsed
+    if LabeledMat.is_binary(filename):
+        return LabeledMat.open_binary(filename)
+    return LabeledMat.loadFile(filename, dt=float, verbose=False)
+
+class MIServer:
+    def __init__(self, path, bins=6, so=3, pool=4, nthreads=1, cache=None):
+        self.path = path
+        self.bins = bins
+        self.so = so
+        self.pool = pool
+        self.nthreads = nthreads
+        self.cache = cache
+        self._prepared = {}
+        self._locks = {}
+        self._lock = threading.Lock()
+        self._conns = Queue.Queue()
+        self._stop = threading.Event()
+        self._sock = None
+
+    def prepare(self, filename):
+        """
+        The PreparedMI of a matrix file, loaded on first use and loaded again
+        when the file's modification time or size changes. Loads of different
+        files run concurrently, queries on a file wait for its load.
+        """
+        key = os.path.abspath(filename)
+        st = os.stat(key)
+        stamp = (st.st_mtime, st.st_size)
+        with self._lock:
+            entry = self._prepared.get(key)
+            if entry is not None and entry[0] == stamp:
+                return entry[1]
+            lock = self._locks.setdefault(key, threading.Lock())
+        with lock:
+            with self._lock:
+                entry = self._prepared.get(key)
+            if entry is None or entry[0] != stamp:
+                # queries already running keep the old PreparedMI until they finish
+                entry = (stamp, PreparedMI(load_matrix(key), self.bins, self.so, self.nthreads, cache=self.cache))
+                with self._lock:
+                    self._prepared[key] = entry
+        return entry[1]
+
+    def query(self, request):
+        p = self.prepare(request['matrix'])
+        row = request['row']
+        if row not in p.X.rowmap:
+            raise ValueError("row " + row + " not found in " + request['matrix'])
+        vec = p.X.data[p.X.rowmap[row], :]
+        top_k = int(request.get('top_k', 0))
+        min_abs_mi = float(request.get('min_abs_mi', 0))
+        if top_k <= 0 and min_abs_mi <= 0:
+            # every row, still sorted by the C selection
+            top_k = max(p.X.nrow, 1)
+        return p.all_mi(vec, nthreads=self.nthreads, top_k=top_k, min_abs_mi=min_abs_mi)
+
+    def _handle(self, conn):
+        f = conn.makefile('rb')
+        try:
+            for line in f:
+                try:
+                    reply = {'hits': self.query(json.loads(line.decode('utf-8')))}
+                except Exception:
+                    reply = {'error': str(sys.exc_info()[1])}
+                conn.sendall((json.dumps(reply) + '\n').encode('utf-8'))
+        except socket.error:
+            pass
+        finally:
+            f.close()
+            conn.close()
+
+    def _worker(self):
+        while True:
+            conn = self._conns.get()
+            if conn is None:
+                return
+            self._handle(conn)
+
+    def serve_forever(self):
+        if os.path.exists(self.path):
+            # only replace a socket nobody is listening on
+            try:
+                query_socket(self.path).close()
+            except socket.error:
+                os.unlink(self.path)
+            else:
+                raise RuntimeError("a server is already listening on " + self.path)
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        umask = os.umask(0o077)
+        try:
+            self._sock.bind(self.path)
+        finally:
+            os.umask(umask)
+        self._sock.listen(64)
+        self._sock.settimeout(0.5)
+        workers = [threading.Thread(target=self._worker) for i in range(self.pool)]
+        for t in workers:
+            t.daemon = True
+            t.start()
+        try:
+            while not self._stop.is_set():
+                try:
+                    (conn, addr) = self._sock.accept()
+                except socket.timeout:
+                    continue
+                conn.settimeout(None)
+                self._conns.put(conn)
+        finally:
+            for t in workers:
+                self._conns.put(None)
+            self._sock.close()
+            if os.path.exists(self.path):
+                os.unlink(self.path)
+
+    def shutdown(self):
+        self._stop.set()
+
+def query_socket(path, timeout=None):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.settimeout(timeout)
+    try:
+        sock.connect(path)
+    except socket.error:
+        sock.close()
+        raise
+    return sock
+
+def query(path, matrix, row, top_k=0, min_abs_mi=0):
+    """
+    Ask the server on path for the MI of row against every row of the matrix
+    file, as a list of (rowname, MI), highest first. Raises socket.error when no
+    server is listening and ValueError for a failed query.
+    """
+    sock = query_socket(path)
+    try:
+        request = {'matrix': os.path.abspath(matrix), 'row': row, 'top_k': top_k, 'min_abs_mi': min_abs_mi}
+        sock.sendall((json.dumps(request) + '\n').encode('utf-8'))
+        f = sock.makefile('rb')
+        reply = json.loads(f.readline().decode('utf-8'))
+        f.close()
+    finally:
+        sock.close()
+    if 'error' in reply:
+        raise ValueError(reply['error'])
+    return [(r, v) for (r, v) in reply['hits']]
+
+def main():
+    parser = OptionParser(usage="python -m pymi.server [options] SOCKET [MATRIX ...]")
+    parser.add_option("-p", "--pool", dest="pool", type="int", default=4,
+            help="number of queries answered at the same time")
+    parser.add_option("-t", "--threads", dest="nthreads", type="int", default=1,
+            help="number of threads used to score the rows of one query")
+    parser.add_option("-b", "--bins", dest="bins", type="int", default=6,
+            help="number of bins")
+    parser.add_option("-o", "--spline-order", dest="so", type="int", default=3,
+            help="spline order")
+    parser.add_option("-c", "--cache", dest="cache", default=None,
+            help="directory of cached weights, shared with other processes")
+    (options, args) = parser.parse_args()
+
+    if len(args) < 1:
+        parser.print_usage(sys.stderr)
+        sys.exit(1)
+
+    server = MIServer(args[0], options.bins, options.so, options.pool, options.nthreads, options.cache)
+    for f in args[1:]:
+        server.prepare(f)
+        print >> sys.stderr, "[MIServer] loaded " + f
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == '__main__':
+    main()
@@ -1,7 +1,20 @@
 import unittest 
 import itertools
-from bsplinemi import *
-from pymibspline.bspline import *
+import os
+import sys
+import shutil
+import tempfile
+import threading
+import time
+from StringIO import StringIO
+import numpy as np
+import _c_bsplinemi
+from _c_bsplinemi import basis_function
+import pymi.bspline
+from pymi.bspline import *
+from pymi.bspline import _prefetch
+from pymi.LabeledMat import LabeledMat
+from pymi import server
 
 class TestUtils(unittest.TestCase):
     def setUp(self):
@@ -10,6 +23,14 @@ class TestUtils(unittest.TestCase):
         self.bs = 5
         self.so = 3
 
+    def labeled(self, data, rownames='%d', colnames='%d'):
+        # names given as a format are numbered
+        if isinstance(rownames, str):
+            rownames = [rownames % i for i in range(data.shape[0])]
+        if isinstance(colnames, str):
+            colnames = [colnames % j for j in range(data.shape[1])]
+        return LabeledMat(data, rownames, colnames)
+
     def test_basis_function(self):
         z = x2z(self.x)
         knots = knot_vector(self.bs, self.so)
@@ -19,6 +40,593 @@ class TestUtils(unittest.TestCase):
     def test_find_weights(self):
         w = find_weights(self.x, 5, 3)
 
+    def test_find_weights_exact(self):
+        x = self.x + [0, 1.5, 2.5, 7, 4.5, 5.5]
+        for (bs, so) in [(5, 3), (6, 1), (10, 4), (12, 2)]:
+            z = x2z(x)
+            knots = knot_vector(bs, so)
+            w = find_weights(x, bs, so)
+            for (b, n) in itertools.product(range(bs), range(len(z))):
+                self.assertEqual(w[b, n], basis_function(b, so, z[n], knots, bs))
+
+    def test_all_pairs_mi(self):
+        X = self.labeled(np.array([self.x, self.y, [v * 2 for v in self.x]], dtype=float), ['x', 'y', 'x2'])
+        pairs = all_pairs_mi(X, self.bs, self.so)
+        for r in X.rownames:
+            mis = all_mi(X, X.data[X.rowmap[r], :], self.bs, self.so)
+            for c in X.rownames:
+                self.assertTrue(abs(pairs[r, c].data[0, 0] - mis[c]) < 1E-10)
+                self.assertTrue(abs(pairs[r, c].data[0, 0] - pairs[c, r].data[0, 0]) < 1E-10)
+        # enough rows for several tiles, which the threads share
+        X = self.labeled(np.random.RandomState(14).rand(300, 400))
+        self.assertTrue((all_pairs_mi(X, nthreads=4).data == all_pairs_mi(X).data).all())
+
+    def test_all_mi_threads(self):
+        X = self.labeled(np.random.RandomState(0).rand(50, len(self.x)))
+        single = all_mi(X, self.x, self.bs, self.so)
+        for t in [2, 3, 8]:
+            self.assertEqual(all_mi(X, self.x, self.bs, self.so, nthreads=t), single)
+
+    def test_prepared_mi(self):
+        X = self.labeled(np.random.RandomState(0).rand(20, len(self.x)))
+        p = PreparedMI(X, self.bs, self.so)
+        for vec in [self.x, self.y, X.data[3, :]]:
+            for (norm, negateMI) in [(True, True), (False, False)]:
+                self.assertEqual(p.all_mi(vec, norm, negateMI), all_mi(X, vec, self.bs, self.so, norm, negateMI))
+                # selected in C, as all_mi selects
+                for (k, t) in [(5, 0), (0, 0.1), (3, 0.2), (20, 0)]:
+                    self.assertEqual(p.all_mi(vec, norm, negateMI, top_k=k, min_abs_mi=t),
+                                     all_mi(X, vec, self.bs, self.so, norm, negateMI, top_k=k, min_abs_mi=t))
+
+    def test_all_mi_batch(self):
+        rng = np.random.RandomState(1)
+        X = self.labeled(rng.rand(30, len(self.x)))
+        Q = self.labeled(np.array([self.x, self.y] + [list(rng.rand(len(self.x))) for i in range(5)], dtype=float))
+        batch = all_mi_batch(X, Q, self.bs, self.so, nthreads=2)
+        for q in Q.rownames:
+            mis = all_mi(X, Q.data[Q.rowmap[q], :], self.bs, self.so)
+            for r in X.rownames:
+                self.assertTrue(abs(batch[q, r].data[0, 0] - mis[r]) < 1E-10)
+
+    def test_all_mi_top_k(self):
+        X = self.labeled(np.random.RandomState(2).rand(200, len(self.x)))
+        full = all_mi(X, self.x, self.bs, self.so)
+        ranked = sorted(full.items(), key=lambda a: (-a[1], int(a[0])))
+        for t in [1, 2, 5]:
+            self.assertEqual(all_mi(X, self.x, self.bs, self.so, nthreads=t, top_k=10), ranked[:10])
+            self.assertEqual(all_mi(X, self.x, self.bs, self.so, nthreads=t, min_abs_mi=0.2),
+                    [a for a in ranked if abs(a[1]) >= 0.2])
+            self.assertEqual(all_mi(X, self.x, self.bs, self.so, nthreads=t, top_k=5, min_abs_mi=0.2),
+                    [a for a in ranked if abs(a[1]) >= 0.2][:5])
+
+    def test_array_inputs(self):
+        x = np.array(self.x, dtype=float)
+        ref = mi(self.x, self.y, self.bs, self.so)
+        wide = np.zeros((2, 2 * len(self.x)))
+        wide[0, ::2] = self.x
+        for v in [x, x.astype(np.float32), x.astype(np.int32), x.astype(np.int64), wide[0, ::2]]:
+            self.assertEqual(mi(v, self.y, self.bs, self.so), ref)
+            self.assertEqual(entropy(v, self.bs, self.so), entropy(self.x, self.bs, self.so))
+            self.assertTrue((find_weights(v, self.bs, self.so) == find_weights(self.x, self.bs, self.so)).all())
+        self.assertEqual(all_mi(self.labeled(wide[:, ::2], ['a', 'b']), self.x),
+                all_mi(self.labeled(wide[:, ::2].copy(), ['a', 'b']), self.x))
+
+    def test_binary_matrix(self):
+        X = self.labeled(np.random.RandomState(3).rand(20, len(self.x)), 'r%d', 'c%d')
+        fd, fn = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            for dt in [np.float64, np.float32]:
+                X.save_binary(fn, dt)
+                self.assertTrue(LabeledMat.is_binary(fn))
+                Y = LabeledMat.open_binary(fn)
+                self.assertEqual(Y.rownames, X.rownames)
+                self.assertEqual(Y.colnames, X.colnames)
+                self.assertTrue((Y.data == X.data.astype(dt)).all())
+                self.assertEqual(all_mi(Y, self.x, self.bs, self.so),
+                        all_mi(LabeledMat(X.data.astype(dt).astype(float), X.rownames, X.colnames), self.x, self.bs, self.so))
+                del Y
+        finally:
+            os.remove(fn)
+
+    def test_all_mi_chunked(self):
+        X = self.labeled(np.random.RandomState(4).rand(50, len(self.x)), 'r%d', 'c%d')
+        fd, fn = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            for (save, load) in [(X.write2file, LabeledMat.loadFile), (X.save_binary, LabeledMat.open_binary)]:
+                save(fn)
+                Y = load(fn)
+                self.assertEqual(all_mi_chunked(fn, self.x, self.bs, self.so, chunk_rows=7), all_mi(Y, self.x, self.bs, self.so))
+                self.assertEqual(all_mi_chunked(fn, self.x, self.bs, self.so, top_k=6, min_abs_mi=0.1, chunk_rows=7),
+                        all_mi(Y, self.x, self.bs, self.so, top_k=6, min_abs_mi=0.1))
+                del Y
+        finally:
+            os.remove(fn)
+        chunks = (X[range(i, min(i + 9, 50)), :] for i in range(0, 50, 9))
+        self.assertEqual(all_mi_chunked(chunks, self.x, self.bs, self.so, top_k=10),
+                all_mi(X, self.x, self.bs, self.so, top_k=10))
+
+    def test_permutation_test(self):
+        rng = np.random.RandomState(5)
+        x = rng.rand(40)
+        y = x + 0.3 * rng.rand(40)
+        (m, p) = mi_permutation_test(x, y, 200, 7, self.bs, self.so)
+        self.assertEqual(m, mi(x, y, self.bs, self.so))
+        self.assertEqual(p, 1 / 201.0)
+        (m, p) = mi_permutation_test(x, rng.rand(40), 200, 7, self.bs, self.so)
+        self.assertTrue(p > 0.05)
+        for t in [1, 3]:
+            self.assertEqual(mi_permutation_test(x, y[::-1], 150, 3, self.bs, self.so, nthreads=t),
+                    mi_permutation_test(x, y[::-1], 150, 3, self.bs, self.so))
+
+        X = self.labeled(np.array([y, rng.rand(40), rng.rand(40), x], dtype=float), ['y', 'a', 'b', 'x'])
+        full = all_mi_pvalues(X, x, 300, 11, self.bs, self.so)
+        self.assertEqual(dict((r, v[0]) for (r, v) in full.items()), all_mi(X, x, self.bs, self.so))
+        self.assertEqual(full['x'][1], 1 / 301.0)
+        for t in [1, 2]:
+            early = all_mi_pvalues(X, x, 300, 11, self.bs, self.so, alpha=0.05, nthreads=t)
+            for r in ['x', 'y']:
+                self.assertEqual(early[r], full[r])
+            for r in ['a', 'b']:
+                self.assertTrue(early[r][1] > 0.05)
+
+    def test_triplets(self):
+        rng = np.random.RandomState(6)
+        (x, y) = (rng.rand(60), rng.rand(60))
+        X = self.labeled(np.array([x + y, x * y, rng.rand(60), x], dtype=float), ['s', 'p', 'r', 'x'])
+        trip = all_triplets_mi(X, x, y, self.bs, self.so, nthreads=2)
+        raw = all_triplets_mi(X, x, y, self.bs, self.so, norm=False)
+        for r in X.rownames:
+            z = X.data[X.rowmap[r], :]
+            ii = mi3(x, y, z, self.bs, self.so)
+            self.assertTrue(abs(trip[r][0] - ii) < 1E-10)
+            self.assertTrue(abs(trip[r][1] - mi2vs1(x, y, z, self.bs, self.so)) < 1E-10)
+            self.assertTrue(abs(raw[r][1] - mi2vs1(x, y, z, self.bs, self.so, False)) < 1E-10)
+            self.assertTrue(abs(mi3(z, x, y, self.bs, self.so) - ii) < 1E-10)
+            self.assertTrue(abs(ii - (mi(x, z, self.bs, self.so, False) + mi(y, z, self.bs, self.so, False) - raw[r][1])) < 1E-10)
+        # x and y tell more about x + y together than apart: synergy
+        self.assertTrue(trip['s'][0] < 0)
+
+    def test_cmi(self):
+        rng = np.random.RandomState(7)
+        (v, z) = (rng.rand(60), rng.rand(60))
+        X = self.labeled(np.array([v + z, z, rng.rand(60), v], dtype=float), ['s', 'z', 'r', 'v'])
+        c = all_cmi(X, v, z, self.bs, self.so, nthreads=2)
+        for r in X.rownames:
+            y = X.data[X.rowmap[r], :]
+            self.assertTrue(abs(c[r] - cmi(v, y, z, self.bs, self.so)) < 1E-10)
+            self.assertTrue(abs(c[r] - cmi(y, v, z, self.bs, self.so)) < 1E-10)
+            # chain rule: I(v;y|z) = I(v;y,z) - I(v;z)
+            self.assertTrue(abs(c[r] - (mi2vs1(y, z, v, self.bs, self.so, False) - mi(v, z, self.bs, self.so, False))) < 1E-10)
+
+    def test_per_row_bins(self):
+        rng = np.random.RandomState(8)
+        X = self.labeled(rng.rand(12, 50))
+        v = rng.rand(50)
+        bins = [4, 6, 10, 6, 4, 8, 6, 10, 4, 6, 8, 6]
+        so = [2, 3, 3, 3, 2, 4, 2, 3, 2, 3, 4, 3]
+        self.assertEqual(all_mi(X, v, [6] * 12, [3] * 12), all_mi(X, v, 6, 3))
+        mixed = all_mi(X, v, bins, so, vec_bins=7, vec_so=3, nthreads=2)
+        pairs = all_pairs_mi(X, bins, so, nthreads=3)
+        for (i, r) in enumerate(X.rownames):
+            x = X.data[i, :]
+            self.assertTrue(abs(mixed[r] - mi_diff_bins(v, x, 7, bins[i], 3, so[i], True, True)) < 1E-10)
+            for (j, c) in enumerate(X.rownames):
+                self.assertTrue(abs(pairs[r, c].data[0, 0] - mi_diff_bins(x, X.data[j, :], bins[i], bins[j], so[i], so[j], True, True)) < 1E-10)
+        self.assertEqual(mi_diff_bins(v, X.data[0, :], 6, 6, 3, 3), mi(v, X.data[0, :], 6, 3))
+        self.assertEqual(all_mi(X, v, bins, so, top_k=4), sorted(all_mi(X, v, bins, so).items(), key=lambda a: (-a[1], int(a[0])))[:4])
+        # spline order above the bins, or below 1, is refused everywhere
+        for (b, o) in [(3, 4), (6, 0)]:
+            self.assertRaises(ValueError, mi, v, v, b, o)
+            self.assertRaises(ValueError, entropy, v, b, o)
+            self.assertRaises(ValueError, all_mi, X, v, b, o)
+            self.assertRaises(ValueError, all_pairs_mi, X, b, o)
+            self.assertRaises(ValueError, PreparedMI, X, b, o)
+            self.assertRaises(ValueError, cmi, v, v, v, b, o)
+            self.assertRaises(ValueError, mi_diff_bins, v, v, 6, b, 3, o)
+
+    def test_specialized_kernels(self):
+        rng = np.random.RandomState(9)
+        X = self.labeled(rng.rand(10, 70))
+        v = rng.rand(70)
+        # bit for bit on the scalar path; SIMD sums are compared in test_simd_levels
+        level = set_simd_level(0)
+        try:
+            for (bs, so) in [(6, 2), (8, 3), (12, 4), (5, 3), (13, 3), (10, 1)]:
+                set_specialized_kernels(True)
+                fast = (all_mi(X, v, bs, so), all_pairs_mi(X, bs, so).data, find_weights(v, bs, so))
+                self.assertTrue(set_specialized_kernels(False))
+                generic = (all_mi(X, v, bs, so), all_pairs_mi(X, bs, so).data, find_weights(v, bs, so))
+                self.assertEqual(fast[0], generic[0])
+                self.assertTrue((fast[1] == generic[1]).all())
+                self.assertTrue((fast[2] == generic[2]).all())
+        finally:
+            set_specialized_kernels(True)
+            set_simd_level(level)
+
+    def test_simd_levels(self):
+        rng = np.random.RandomState(10)
+        X = self.labeled(rng.rand(10, 203))
+        v = rng.rand(203)
+        level = simd_level()
+        try:
+            for (bs, so) in [(6, 3), (8, 2), (12, 4), (13, 2), (14, 3), (15, 4), (20, 5), (16, 8)]:
+                results = []
+                for l in range(level + 1):
+                    set_simd_level(l)
+                    self.assertEqual(simd_level(), l)
+                    results.append((all_mi(X, v, bs, so), entropy(v, bs, so), all_pairs_mi(X, bs, so).data))
+                for r in results[1:]:
+                    for k in r[0]:
+                        self.assertTrue(abs(r[0][k] - results[0][0][k]) < 1E-12)
+                    self.assertTrue(abs(r[1] - results[0][1]) < 1E-12)
+                    self.assertTrue(abs(r[2] - results[0][2]).max() < 1E-12)
+        finally:
+            set_simd_level(level)
+        self.assertEqual(set_simd_level(level + 5), level)
+        self.assertEqual(simd_level(), level)
+
+    def test_float32(self):
+        rng = np.random.RandomState(11)
+        # float32-exact data, so only the weight rounding differs
+        data = rng.rand(12, 150).astype(np.float32)
+        X = self.labeled(data.astype(float))
+        X32 = self.labeled(data)
+        names = X.rownames
+        v = X.data[3, :]
+        for (bs, so) in [(6, 3), (12, 4), (10, 2), (20, 3)]:
+            bound = 2.0**-23 * (4 * np.log2(bs) + 4.33)
+            ref = all_mi(X, v, bs, so, norm=False, negateMI=False)
+            single = all_mi(X32, v, bs, so, norm=False, negateMI=False, float32=True)
+            for r in names:
+                self.assertTrue(abs(ref[r] - single[r]) <= bound)
+            ref = all_mi(X, v, bs, so)
+            single = all_mi(X, v, bs, so, float32=True)
+            prepared = PreparedMI(X32, bs, so, float32=True).all_mi(v)
+            for r in names:
+                self.assertAlmostEqual(ref[r], single[r], places=5)
+                self.assertEqual(single[r], prepared[r])
+            self.assertEqual(all_mi(X32, v, bs, so, top_k=3, float32=True),
+                             sorted(single.items(), key=lambda a: (-a[1], int(a[0])))[:3])
+        # no masked float32 path, and no float32 per-row bins
+        self.assertRaises(ValueError, all_mi, X, v, [6] * 12, 3, float32=True)
+        w = v.copy()
+        w[4] = np.nan
+        self.assertRaises(ValueError, all_mi, X, w, float32=True)
+        self.assertRaises(ValueError, PreparedMI(X32, float32=True).all_mi, w)
+        data[2, 5] = np.nan
+        self.assertRaises(ValueError, all_mi, X32, v, float32=True)
+        self.assertRaises(ValueError, PreparedMI, X32, float32=True)
+
+    def test_incremental(self):
+        rng = np.random.RandomState(12)
+        data = rng.rand(9, 200)
+        v = rng.rand(200)
+        X = self.labeled(data)
+        (names, cols) = (X.rownames, X.colnames)
+        ranges = (data.min(axis=1), data.max(axis=1))
+        vrange = (v.min(), v.max())
+        inc = IncrementalMI(LabeledMat(data[:, :120], names, cols[:120]), v[:120], 8, 3, ranges, vrange)
+        inc.append(LabeledMat(data[:, 120:190], names, cols[120:190]), v[120:190])
+        inc.append(LabeledMat(data[:, 190:], names, cols[190:]), v[190:])
+        self.assertEqual(inc.nsamples, 200)
+        # same ranges as the min / max of all samples, so same as all_mi
+        for (norm, negate) in [(True, True), (False, False)]:
+            ref = all_mi(X, v, 8, 3, norm=norm, negateMI=negate)
+            mis = inc.all_mi(norm, negate)
+            for r in names:
+                self.assertAlmostEqual(ref[r], mis[r], places=10)
+        # out of range samples are clamped to the range ends; the sign still
+        # comes from the unclamped values
+        inc = IncrementalMI(X, v, 8, 3, ranges=(0.25, 0.75), vec_range=(0.25, 0.75))
+        clamped = LabeledMat(np.clip(data, 0.25, 0.75), names, cols)
+        ref = IncrementalMI(clamped, np.clip(v, 0.25, 0.75), 8, 3, ranges=(0.25, 0.75), vec_range=(0.25, 0.75)).all_mi(negateMI=False)
+        mis = inc.all_mi(negateMI=False)
+        for r in names:
+            self.assertAlmostEqual(ref[r], mis[r], places=12)
+
+    def test_missing_values(self):
+        rng = np.random.RandomState(13)
+        data = rng.rand(6, 120)
+        v = rng.rand(120)
+        data[1, [3, 50, 51]] = np.nan
+        data[2, :] = np.nan
+        data[4, 100:] = np.nan
+        v_nan = v.copy()
+        v_nan[[7, 64]] = np.nan
+        X = self.labeled(data)
+        names = X.rownames
+        for vec in [v, v_nan]:
+            for (norm, negate) in [(True, True), (False, False)]:
+                mis = all_mi(X, vec, 7, 3, norm=norm, negateMI=negate)
+                for i in range(6):
+                    ok = ~np.isnan(data[i]) & ~np.isnan(vec)
+                    # pairwise complete: same as mi on the common samples, unless
+                    # a dropped sample held a row's min or max
+                    x = np.where(ok, data[i], np.nan)
+                    ref = mi(data[i][ok], vec[ok], 7, 3, norm, negate) if ok.any() else 0
+                    self.assertAlmostEqual(mi(x, np.where(ok, vec, np.nan), 7, 3, norm, negate), ref, places=10)
+                    self.assertAlmostEqual(mis[names[i]], mi(data[i], vec, 7, 3, norm, negate), places=12)
+        # fully observed rows are untouched
+        self.assertEqual(all_mi(X, v)['0'], all_mi(LabeledMat(data[:1], names[:1], X.colnames), v)['0'])
+        self.assertEqual(mi(data[2], v), 0)
+
+    def test_subsets(self):
+        rng = np.random.RandomState(14)
+        data = rng.rand(7, 90)
+        v = rng.rand(90)
+        X = self.labeled(data, '%d', 'c%d')
+        (names, cols) = (X.rownames, X.colnames)
+        mask = np.arange(90) % 3 == 0
+        subsets = {'all': range(90), 'odd': range(1, 90, 2), 'mask': mask, 'named': cols[10:40], 'none': []}
+        for (norm, negate) in [(True, True), (False, False)]:
+            ref = all_mi(X, v, 6, 3, norm=norm, negateMI=negate)
+            for res in [all_mi(X, v, 6, 3, norm, negate, subsets=subsets),
+                        PreparedMI(X, 6, 3).all_mi(v, norm, negate, subsets=subsets)]:
+                self.assertEqual(sorted(res.keys()), sorted(subsets.keys()))
+                for r in names:
+                    self.assertAlmostEqual(res['all'][r], ref[r], places=12)
+                    self.assertEqual(res['none'][r], 0)
+        # a subset whose samples hold every row's min and max scales like the slice
+        data[:, 0] = 0
+        data[:, 1] = 1
+        v[0] = 0
+        v[1] = 1
+        group = [0, 1] + list(range(20, 70))
+        sliced = all_mi(LabeledMat(data[:, group], names, [cols[j] for j in group]), v[group])
+        res = all_mi(LabeledMat(data, names, cols), v, subsets={'g': group})['g']
+        for r in names:
+            self.assertAlmostEqual(res[r], sliced[r], places=12)
+
+    def test_attractor(self):
+        rng = np.random.RandomState(15)
+        latent = rng.rand(80)
+        data = np.vstack([latent + 0.15 * rng.rand(6, 80), rng.rand(30, 80)])
+        names = ['m%d' % i for i in range(6)] + ['r%d' % i for i in range(30)]
+        X = self.labeled(data, names)
+        p = PreparedMI(X)
+        (meta, top, converged) = p.find_attractor('m0', top_k=6)
+        self.assertTrue(converged)
+        self.assertEqual(sorted(r for (r, s) in top), names[:6])
+        # one step by hand: MI-weighted average of the top rows
+        (meta1, top1, c1) = p.find_attractor('m0', top_k=5, exponent=2.0, max_iter=1)
+        mis = all_mi(X, X.data[0, :])
+        ref = sorted(mis.items(), key=lambda a: (-a[1], a[0]))[:5]
+        self.assertEqual([r for (r, s) in top1], [r for (r, s) in ref])
+        w = np.array([s ** 2 for (r, s) in ref])
+        expect = np.dot(w, data[[X.rowmap[r] for (r, s) in ref], :]) / w.sum()
+        self.assertTrue(np.allclose(meta1, expect, rtol=1e-12, atol=0))
+        # pruning only moves the result within tol, batching not at all
+        (meta0, top0, c0) = p.find_attractor('r3', top_k=4, prune_margin=0)
+        batch = p.find_attractors(['m0', 'r3'], top_k=4, nthreads=2)
+        (metab, topb, cb) = batch['r3']
+        self.assertTrue(np.allclose(meta0, metab, rtol=1e-5, atol=0))
+        self.assertEqual([r for (r, s) in top0], [r for (r, s) in topb])
+        self.assertTrue((p.find_attractor('r3', top_k=4)[0] == metab).all())
+        self.assertEqual(p.find_attractor('m0', top_k=4)[1], batch['m0'][1])
+
+    def test_mi_network(self):
+        rng = np.random.RandomState(16)
+        # a chain a -> b -> c plus noise rows
+        a = rng.rand(150)
+        b = a + 0.2 * rng.rand(150)
+        c = b + 0.2 * rng.rand(150)
+        data = np.vstack([a, b, c, rng.rand(5, 150)])
+        names = ['a', 'b', 'c'] + ['n%d' % i for i in range(5)]
+        X = self.labeled(data, names)
+        pairs = all_pairs_mi(X)
+        edges = mi_network(X, 0.15, dpi=False)
+        expect = [(names[i], names[j], pairs.data[i, j]) for i in range(8) for j in range(i + 1, 8) if abs(pairs.data[i, j]) >= 0.15]
+        self.assertEqual(edges, expect)
+        # the weakest side of each triangle goes
+        pruned = mi_network(X, 0.15, nthreads=2)
+        links = set((r1, r2) for (r1, r2, s) in pruned)
+        self.assertTrue(('a', 'b') in links and ('b', 'c') in links)
+        self.assertFalse(('a', 'c') in links)
+        self.assertTrue(set(pruned) <= set(edges))
+        out = StringIO()
+        self.assertEqual(PreparedMI(X).mi_network(0.15, output=out), len(pruned))
+        self.assertEqual(out.getvalue().splitlines()[0].split('\t')[:2], list(pruned[0][:2]))
+        # written a few rows at a time, same edges in the same order
+        block = pymi.bspline.NETWORK_ROW_BLOCK
+        pymi.bspline.NETWORK_ROW_BLOCK = 3
+        try:
+            out = StringIO()
+            self.assertEqual(PreparedMI(X).mi_network(0.15, dpi=False, output=out), len(edges))
+            self.assertEqual(mi_network(X, 0.15, dpi=False), edges)
+        finally:
+            pymi.bspline.NETWORK_ROW_BLOCK = block
+        self.assertEqual([tuple(l.split('\t')[:2]) for l in out.getvalue().splitlines()], [e[:2] for e in edges])
+
+    def test_server(self):
+        X = self.labeled(np.random.RandomState(11).rand(30, len(self.x)), 'r%d', 'c%d')
+        d = tempfile.mkdtemp()
+        try:
+            fn = os.path.join(d, 'mat.txt')
+            X.write2file(fn)
+            Y = server.load_matrix(fn)
+            path = os.path.join(d, 'sock')
+            srv = server.MIServer(path, pool=2)
+            t = threading.Thread(target=srv.serve_forever)
+            t.daemon = True
+            t.start()
+            for i in range(100):
+                if os.path.exists(path):
+                    break
+                time.sleep(0.05)
+            try:
+                vec = Y.data[Y.rowmap['r3'], :]
+                self.assertEqual(server.query(path, fn, 'r3', top_k=3), all_mi(Y, vec, top_k=3))
+                hits = server.query(path, fn, 'r5')
+                self.assertEqual(len(hits), 30)
+                self.assertEqual(sorted(r for (r, v) in hits), sorted(Y.rownames))
+                self.assertEqual([v for (r, v) in hits], sorted([v for (r, v) in hits], reverse=True))
+                self.assertRaises(ValueError, server.query, path, fn, 'nope')
+                # rows with NaNs are scored as all_mi scores them locally
+                Z = LabeledMat(X.data.copy(), X.rownames, X.colnames)
+                Z.data[2, [1, 4]] = np.nan
+                Z.data[7, :3] = np.nan
+                fz = os.path.join(d, 'nan.txt')
+                Z.write2file(fz)
+                Z = server.load_matrix(fz)
+                for r in ['r2', 'r3']:
+                    ref = all_mi(Z, Z.data[Z.rowmap[r], :])
+                    hits = server.query(path, fz, r)
+                    self.assertEqual(sorted(h for (h, v) in hits), sorted(Z.rownames))
+                    for (h, v) in hits:
+                        self.assertAlmostEqual(v, ref[h], places=12)
+                    self.assertEqual(server.query(path, fz, r, top_k=4), all_mi(Z, Z.data[Z.rowmap[r], :], top_k=4))
+                # a rewritten file is loaded again, same size or not
+                W = LabeledMat(X.data[::-1].copy(), X.rownames, X.colnames)
+                W.write2file(fn)
+                st = os.stat(fn)
+                os.utime(fn, (st.st_atime, st.st_mtime + 10))
+                W = server.load_matrix(fn)
+                self.assertEqual(server.query(path, fn, 'r3', top_k=3), all_mi(W, W.data[W.rowmap['r3'], :], top_k=3))
+            finally:
+                srv.shutdown()
+                t.join()
+            self.assertFalse(os.path.exists(path))
+        finally:
+            shutil.rmtree(d)
+
+    def test_weight_cache(self):
+        X = self.labeled(np.random.RandomState(12).rand(25, len(self.x)), 'r%d', 'c%d')
+        d = tempfile.mkdtemp()
+        try:
+            for float32 in [False, True]:
+                ref = PreparedMI(X, self.bs, self.so, float32=float32).all_mi(self.x)
+                PreparedMI(X, self.bs, self.so, float32=float32, cache=d)
+                self.assertEqual(len(os.listdir(d)), 1 + float32)
+                p = PreparedMI(X, self.bs, self.so, float32=float32, cache=d)
+                self.assertEqual(p.all_mi(self.x), ref)
+                self.assertEqual(len(os.listdir(d)), 1 + float32)
+            # other settings or data get their own file
+            PreparedMI(X, self.bs + 1, self.so, cache=d)
+            self.assertEqual(len(os.listdir(d)), 3)
+            Y = LabeledMat(X.data * 2, X.rownames, X.colnames)
+            PreparedMI(Y, self.bs, self.so, cache=d)
+            self.assertEqual(len(os.listdir(d)), 4)
+            # a damaged file is recomputed and replaced
+            for fn in os.listdir(d):
+                f = open(os.path.join(d, fn), 'r+b')
+                f.truncate(200)
+                f.close()
+            self.assertEqual(PreparedMI(X, self.bs, self.so, cache=d).all_mi(self.x), PreparedMI(X, self.bs, self.so).all_mi(self.x))
+            self.assertRaises(ValueError, _c_bsplinemi.prepare_from_arrays, X.data,
+                    -np.ones((25, len(self.x)), dtype=np.intc), np.zeros((25, len(self.x), self.so)), np.zeros(25), np.zeros(25), self.bs, self.so)
+            # a cache that cannot be written leaves the weights uncached
+            err = sys.stderr
+            sys.stderr = StringIO()
+            try:
+                p = PreparedMI(X, self.bs, self.so, cache=os.path.join(d, 'missing'))
+                self.assertTrue('WARNING' in sys.stderr.getvalue())
+            finally:
+                sys.stderr = err
+            self.assertEqual(p.all_mi(self.x), PreparedMI(X, self.bs, self.so).all_mi(self.x))
+            self.assertFalse(os.path.exists(os.path.join(d, 'missing')))
+        finally:
+            shutil.rmtree(d)
+
+    def test_profiling(self):
+        X = self.labeled(np.random.RandomState(13).rand(20, len(self.x)), 'r%d', 'c%d')
+        ref = all_mi(X, self.x, self.bs, self.so)
+        self.assertFalse(set_profiling(True))
+        try:
+            profile_counters(reset=True)
+            self.assertEqual(all_mi(X, self.x, self.bs, self.so, nthreads=2), ref)
+            counters = profile_counters(reset=True)
+        finally:
+            self.assertTrue(set_profiling(False))
+        # vec and every row: weights, marginal and self term; every row: cross joint and sign
+        self.assertEqual(counters['weights'][:2], (21, 21 * len(self.x)))
+        self.assertEqual(counters['marginals'][0], 21)
+        self.assertEqual(counters['joint'][0], 20)
+        self.assertEqual(counters['normalize'][0], 21)
+        self.assertEqual(counters['sign'][0], 20)
+        self.assertTrue(all(c[2] >= 0 for c in counters.values()))
+        all_mi(X, self.x, self.bs, self.so)
+        self.assertEqual(profile_counters()['weights'][0], 0)
+
+    def test_prefetch_early_stop(self):
+        closed = []
+        def blocks():
+            try:
+                for i in range(100):
+                    yield i
+            finally:
+                closed.append(True)
+        threads = threading.active_count()
+        chunks = _prefetch(blocks())
+        self.assertEqual(next(chunks), 0)
+        chunks.close()
+        self.assertEqual(closed, [True])
+        self.assertEqual(threading.active_count(), threads)
+        # an error while scoring a block stops the reader too
+        self.assertRaises(Exception, all_mi_chunked, [LabeledMat(np.zeros((2, 3)), ['a', 'b'], ['1', '2', '3'])] * 5,
+                ['x', 'y', 'z'])
+        self.assertEqual(threading.active_count(), threads)
+
+    def test_permutation_missing_values(self):
+        rng = np.random.RandomState(15)
+        x = rng.rand(200)
+        y = rng.rand(200)
+        # keep each vector's range on the samples observed in both
+        x[[0, 1]] = [0, 1]
+        y[[0, 1]] = [1, 0]
+        x[5] = np.nan
+        y[[7, 9]] = np.nan
+        keep = ~(np.isnan(x) | np.isnan(y))
+        (m, p) = mi_permutation_test(x, y, 200, 1)
+        (mc, pc) = mi_permutation_test(x[keep], y[keep], 200, 1)
+        self.assertAlmostEqual(m, mi(x, y), 12)
+        self.assertAlmostEqual(m, mc, 12)
+        self.assertEqual(p, pc)
+        X = self.labeled(np.array([x, y]), ['x', 'y'])
+        self.assertRaises(ValueError, all_mi_pvalues, X, rng.rand(200), 10)
+
+    def test_prepared_missing_values(self):
+        rng = np.random.RandomState(21)
+        data = rng.rand(7, 110)
+        data[1, [4, 60]] = np.nan
+        data[3, 90:] = np.nan
+        data[5, :] = np.nan
+        X = self.labeled(data)
+        names = X.rownames
+        v = rng.rand(110)
+        v_nan = v.copy()
+        v_nan[[2, 33]] = np.nan
+        d = tempfile.mkdtemp()
+        try:
+            PreparedMI(X, self.bs, self.so, cache=d)
+            for p in [PreparedMI(X, self.bs, self.so), PreparedMI(X, self.bs, self.so, cache=d)]:
+                for vec in [v, v_nan]:
+                    ref = all_mi(X, vec, self.bs, self.so)
+                    got = p.all_mi(vec)
+                    sub = p.all_mi(vec, subsets={'all': range(110)})['all']
+                    for r in names:
+                        self.assertAlmostEqual(got[r], ref[r], places=12)
+                        self.assertAlmostEqual(sub[r], ref[r], places=12)
+        finally:
+            shutil.rmtree(d)
+        pairs = all_pairs_mi(X, self.bs, self.so, nthreads=2)
+        batch = all_mi_batch(X, LabeledMat(data[:4], names[:4], X.colnames), self.bs, self.so)
+        for i in range(7):
+            ref = all_mi(X, data[i], self.bs, self.so)
+            for j in range(7):
+                self.assertAlmostEqual(pairs.data[i, j], ref[names[j]], places=12)
+                if i < 4:
+                    self.assertAlmostEqual(batch.data[i, j], ref[names[j]], places=12)
+        edges = mi_network(X, 0.05, self.bs, self.so, dpi=False)
+        expect = [(names[i], names[j]) for i in range(7) for j in range(i + 1, 7) if abs(pairs.data[i, j]) >= 0.05]
+        self.assertEqual([(r1, r2) for (r1, r2, s) in edges], expect)
+        # entry points without a masked path refuse NaNs
+        self.assertRaises(ValueError, all_cmi, X, v, v)
+        self.assertRaises(ValueError, mi3, v_nan, v, v)
+        self.assertRaises(ValueError, all_mi, X, v, [self.bs] * 7, self.so)
+        self.assertRaises(ValueError, find_attractor, X, v)
+
 
 if __name__ == '__main__':
     suite = unittest.TestLoader().loadTestsFromTestCase(TestUtils)
@@ -18,18 +18,77 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <float.h>
+#include <time.h>
+#include <pthread.h>
 #include <Python.h>
 #include <numpy/arrayobject.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PYMI_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /* ================= C functions ================= */
 
+#define LN2 0.693147180559945309417232121458
+
 float log2f(float x) {
-  return log(x)/log(2);
+  return log(x)/LN2;
 }
 
 double log2d(double x) {
-  return log(x)/log(2);
+  return log(x)/LN2;
+}
+
+/* Opt-in instrumentation: with profiling on, every call of the kernels of a
+ * phase adds its wall time and sample count to the phase's counters, from
+ * any thread. Phases are exclusive: weights is findWeightsSparse (and its
+ * float / masked forms), marginals entropy1, joint entropy2 of two vectors,
+ * normalize the self terms H(x, x) that MI is divided by (selfEntropy2; the
+ * division itself is one flop and not timed), and sign the product moments
+ * that sign the scores. The masked and subset kernels are not split into
+ * phases. Off, a call costs one test of profiling. */
+enum { PHASE_WEIGHTS, PHASE_MARGINALS, PHASE_JOINT, PHASE_NORMALIZE, PHASE_SIGN, NUM_PHASES };
+static const char *phaseNames[NUM_PHASES] = {"weights", "marginals", "joint", "normalize", "sign"};
+
+static int profiling = 0;
+static long long phaseCalls[NUM_PHASES], phaseSamples[NUM_PHASES], phaseNanos[NUM_PHASES];
+
+static long long nowNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* start of a timed call, 0 when profiling is off */
+static inline long long phaseStart(void) {
+  return profiling ? nowNanos() : 0;
+}
+
+static inline void phaseEnd(int phase, long long start, int numSamples) {
+  if (start == 0) return;
+  __atomic_fetch_add(&phaseNanos[phase], nowNanos() - start, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&phaseSamples[phase], (long long) numSamples, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&phaseCalls[phase], 1LL, __ATOMIC_RELAXED);
+}
+
+/* returns the previous setting */
+int setProfiling(int on) {
+  int old = profiling;
+  profiling = on;
+  return old;
+}
+
+void resetProfile(void) {
+  int k;
+  for (k = 0; k < NUM_PHASES; k++) {
+    __atomic_store_n(&phaseCalls[k], 0LL, __ATOMIC_RELAXED);
+    __atomic_store_n(&phaseSamples[k], 0LL, __ATOMIC_RELAXED);
+    __atomic_store_n(&phaseNanos[k], 0LL, __ATOMIC_RELAXED);
+  }
 }
 
 
@@ -152,8 +211,9 @@ double max_d(const double *data, int numSamples) {
   int curSample;
   double curMax = data[0];
 	
+  /* NaNs are skipped, the result is NaN only when every sample is */
   for (curSample = 1; curSample < numSamples; curSample++) {
-    if (data[curSample] > curMax) {
+    if (data[curSample] > curMax || curMax != curMax) {
       curMax = data[curSample];
     }
   }
@@ -164,8 +224,9 @@ double min_d(const double *data, int numSamples) {
   int curSample;
   double curMin = data[0];
 	
+  /* NaNs are skipped, see max_d */
   for (curSample = 1; curSample < numSamples; curSample++) {
-    if (data[curSample] < curMin) {
+    if (data[curSample] < curMin || curMin != curMin) {
       curMin = data[curSample];
     }
   }
@@ -197,33 +258,184 @@ int mini(const int *data, int numSamples) {
 }
 
 void xToZ(const double *fromData, double *toData, int numSamples, int splineOrder, int numBins, double xMin, double xMax) {
-  int curSample;
+  int curSample, fixed = 1;
   
   if (xMin == -1 && xMax == -1) { /*then compute on the fly */
 	  xMin = min_d(fromData, numSamples);
 	  xMax = max_d(fromData, numSamples);
+	  fixed = 0;
   } /*else use provided values */
   if(xMax == xMin) xMax = xMin + 1; // prevent "flat vector"
   for (curSample = 0; curSample < numSamples; curSample++) {
     /* toData[curSample] = (fromData[curSample] - xMin) * (numBins - splineOrder + 1) / (double) (xMax - xMin); */
     /* normalize to [0, 1] */
     toData[curSample] = (fromData[curSample] - xMin) / (double) (xMax - xMin);
+    /* samples outside a provided range go to its ends */
+    if (fixed && toData[curSample] < 0) toData[curSample] = 0;
+    if (fixed && toData[curSample] > 1) toData[curSample] = 1;
   }
 }
 
-void findWeights(const double *x, const double *knots, double *weights, int numSamples, int splineOrder, int numBins, double rangeLeft, double rangeRight) {
-  int curSample, curBin;
+/* Compact weights: sample curSample only has nonzero basis values in bins
+ * bins[curSample] .. bins[curSample] + splineOrder - 1, stored contiguously
+ * in weights[curSample * splineOrder ...] */
+int firstBin(double z, const double *knots, int splineOrder, int numBins) {
+  int mu;
+
+  if (!(z >= 0)) return 0;
+  if (z >= 1) return numBins - splineOrder;
+  /* knots are uniform between the clamped ends, guess then settle the span */
+  mu = splineOrder - 1 + (int) (z * (numBins - splineOrder + 1));
+  if (mu > numBins - 1) mu = numBins - 1;
+  while (mu > splineOrder - 1 && z < knots[mu]) mu--;
+  while (mu < numBins - 1 && z >= knots[mu + 1]) mu++;
+  return mu - splineOrder + 1;
+}
+
+/* samples evaluated together by deBoorBlock */
+#define BASIS_BLOCK 64
+
+/* Iterative version of basisFunction: for every sample of the block, the
+ * splineOrder basis values starting at bins[s] are built level by level
+ * from the order-1 indicator, with the same arithmetic as the recursion, so
+ * the results are identical. The knots a sample needs are gathered first so
+ * that the triangle itself runs over samples without branches and
+ * vectorizes. weights is laid out as in findWeightsSparse. Inlined into
+ * deBoorBlock and into copies with a constant splineOrder, see below. */
+static inline void deBoorBlockBody(const double *z, const int *bins, double *weights, int numSamples, const double *knots, int splineOrder, int numBins,
+                                   double *kw, double *N) {
+  int s, j, p, q, i;
+  double t, d1, n1, d2, n2, e1, e2, e;
+  double *Nj, *Nj1;
+  const double *kj, *kj1, *kjp, *kjp1;
+
+  /* kw[q][s] = knots[bins[s] + q], N[j][s] = basis value of bin bins[s] + j */
+  for (q = 0; q < 2 * splineOrder; q++) {
+    for (s = 0; s < numSamples; s++) kw[q * BASIS_BLOCK + s] = knots[bins[s] + q];
+  }
+  for (j = 0; j <= splineOrder; j++) {
+    for (s = 0; s < numSamples; s++) N[j * BASIS_BLOCK + s] = 0;
+  }
+  i = splineOrder - 1; /* span of the sample, relative to bins[s] */
+  for (s = 0; s < numSamples; s++) {
+    t = z[s];
+    N[i * BASIS_BLOCK + s] = ((t >= kw[i * BASIS_BLOCK + s] && t < kw[(i + 1) * BASIS_BLOCK + s] &&
+                              kw[i * BASIS_BLOCK + s] < kw[(i + 1) * BASIS_BLOCK + s]) ||
+                             (fabs(t - kw[(i + 1) * BASIS_BLOCK + s]) < 1e-10 && bins[s] + i + 1 == numBins)) ? 1 : 0;
+  }
+
+  for (p = 2; p <= splineOrder; p++) {
+    /* ascending j reads N[j], N[j+1] of order p-1 before N[j] is overwritten */
+    for (j = splineOrder - p; j < splineOrder; j++) {
+      Nj = N + j * BASIS_BLOCK;
+      Nj1 = N + (j + 1) * BASIS_BLOCK;
+      kj = kw + j * BASIS_BLOCK;
+      kj1 = kw + (j + 1) * BASIS_BLOCK;
+      kjp1 = kw + (j + p - 1) * BASIS_BLOCK;
+      kjp = kw + (j + p) * BASIS_BLOCK;
+      for (s = 0; s < numSamples; s++) {
+        t = z[s];
+        d1 = kjp1[s] - kj[s];
+        n1 = t - kj[s];
+        d2 = kjp[s] - kj1[s];
+        n2 = kjp[s] - t;
+        /* a vanishing denominator drops its term, as in basisFunction */
+        e1 = n1/(d1 < 1e-10 ? 1 : d1)*Nj[s];
+        e2 = n2/(d2 < 1e-10 ? 1 : d2)*Nj1[s];
+        e1 = d1 < 1e-10 ? 0 : e1;
+        e2 = d2 < 1e-10 ? 0 : e2;
+        e = e1 + e2;
+        Nj[s] = e < 0 ? 0 : e;
+      }
+    }
+  }
+
+  for (s = 0; s < numSamples; s++) {
+    for (j = 0; j < splineOrder; j++) weights[s * splineOrder + j] = N[j * BASIS_BLOCK + s];
+  }
+}
+
+void deBoorBlock(const double *z, const int *bins, double *weights, int numSamples, const double *knots, int splineOrder, int numBins,
+                 double *kw, double *N) {
+  deBoorBlockBody(z, bins, weights, numSamples, knots, splineOrder, numBins, kw, N);
+}
+
+/* Kernels specialized for the common bins 6-12 and spline orders 2-4: the
+ * same bodies inlined with constant sizes, so loops unroll fully and joint
+ * histograms live on the stack. The joint entropies come in a scalar and an
+ * AVX2 form, picked by simdLevel like the generic ones. Results are identical
+ * to the generic path at the same simdLevel, which is used for every other
+ * size or when specializedKernels is 0. */
+#define SPEC_MIN_BINS 6
+#define SPEC_MAX_BINS 12
+#define SPEC_MIN_SO 2
+#define SPEC_MAX_SO 4
+
+static int specializedKernels = 1;
+
+/* returns the previous setting */
+int setSpecializedKernels(int on) {
+  int old = specializedKernels;
+  specializedKernels = on;
+  return old;
+}
+
+#define DEBOOR_FIXED(SO) \
+static void deBoorBlock##SO(const double *z, const int *bins, double *weights, int numSamples, const double *knots, int numBins, double *kw, double *N) { \
+  deBoorBlockBody(z, bins, weights, numSamples, knots, SO, numBins, kw, N); \
+}
+DEBOOR_FIXED(2)
+DEBOOR_FIXED(3)
+DEBOOR_FIXED(4)
+
+static void deBoorBlockDispatch(const double *z, const int *bins, double *weights, int numSamples, const double *knots, int splineOrder, int numBins,
+                                double *kw, double *N) {
+  if (specializedKernels) {
+    switch (splineOrder) {
+      case 2: deBoorBlock2(z, bins, weights, numSamples, knots, numBins, kw, N); return;
+      case 3: deBoorBlock3(z, bins, weights, numSamples, knots, numBins, kw, N); return;
+      case 4: deBoorBlock4(z, bins, weights, numSamples, knots, numBins, kw, N); return;
+    }
+  }
+  deBoorBlock(z, bins, weights, numSamples, knots, splineOrder, numBins, kw, N);
+}
+
+void findWeightsSparse(const double *x, const double *knots, int *bins, double *weights, int numSamples, int splineOrder, int numBins, double rangeLeft, double rangeRight) {
+  int curSample, blockSize;
+  long long t = phaseStart();
   double *z = (double*) calloc(numSamples, sizeof(double));
+  double *kw = (double*) calloc(2 * splineOrder * BASIS_BLOCK, sizeof(double));
+  double *N = (double*) calloc((splineOrder + 1) * BASIS_BLOCK, sizeof(double));
 
   xToZ(x, z, numSamples, splineOrder, numBins, rangeLeft, rangeRight);
-  
+
   for (curSample = 0; curSample < numSamples; curSample++) {
-    for (curBin = 0; curBin < numBins; curBin++) {
-      weights[curBin * numSamples + curSample] = basisFunction(curBin, splineOrder, z[curSample], knots, numBins);
-      //printf("%d|%f(%f)\t", curBin, weights[curBin * numSamples + curSample],z[curSample]);
-    }
+    bins[curSample] = firstBin(z[curSample], knots, splineOrder, numBins);
+  }
+  for (curSample = 0; curSample < numSamples; curSample += BASIS_BLOCK) {
+    blockSize = numSamples - curSample < BASIS_BLOCK ? numSamples - curSample : BASIS_BLOCK;
+    deBoorBlockDispatch(z + curSample, bins + curSample, weights + curSample * splineOrder, blockSize, knots, splineOrder, numBins, kw, N);
   }
   free(z);
+  free(kw);
+  free(N);
+  phaseEnd(PHASE_WEIGHTS, t, numSamples);
+}
+
+void findWeights(const double *x, const double *knots, double *weights, int numSamples, int splineOrder, int numBins, double rangeLeft, double rangeRight) {
+  int curSample, k;
+  int *bins = (int*) calloc(numSamples, sizeof(int));
+  double *w = (double*) calloc(numSamples * splineOrder, sizeof(double));
+
+  findWeightsSparse(x, knots, bins, w, numSamples, splineOrder, numBins, rangeLeft, rangeRight);
+  for (k = 0; k < numBins * numSamples; k++) weights[k] = 0;
+  for (curSample = 0; curSample < numSamples; curSample++) {
+    for (k = 0; k < splineOrder; k++) {
+      weights[(bins[curSample] + k) * numSamples + curSample] = w[curSample * splineOrder + k];
+    }
+  }
+  free(bins);
+  free(w);
 }
 
 void combineWeights(const double *wx, const double *wy, double *w, int numSamples, int numBins){
@@ -237,14 +449,175 @@ void combineWeights(const double *wx, const double *wy, double *w, int numSample
 	}
 }
 
-double entropy1(const double *weights, int numSamples, int numBins) {
-  int curBin, curSample;
+/* SIMD kernels. simdLevel is set once at import from cpuid (detectSimd) and
+ * can be lowered from Python; the histogram accumulation, the h*log2(h)
+ * reduction over histogram cells and productMoment then run 4 (AVX2) or 8
+ * (AVX-512) doubles at a time. Sums are reassociated and use FMA, so results
+ * agree with the scalar path to rounding, not bit for bit. */
+#define SIMD_SCALAR 0
+#define SIMD_AVX2 1
+#define SIMD_AVX512 2
+
+static int simdLevel = SIMD_SCALAR, simdMaxLevel = SIMD_SCALAR;
+
+void detectSimd(void) {
+#ifdef PYMI_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) simdMaxLevel = SIMD_AVX2;
+  if (simdMaxLevel == SIMD_AVX2 && __builtin_cpu_supports("avx512f")) simdMaxLevel = SIMD_AVX512;
+#endif
+  simdLevel = simdMaxLevel;
+}
+
+/* clamped to what the CPU supports; returns the previous level */
+int setSimdLevel(int level) {
+  int old = simdLevel;
+  if (level < SIMD_SCALAR) level = SIMD_SCALAR;
+  simdLevel = level < simdMaxLevel ? level : simdMaxLevel;
+  return old;
+}
+
+#ifdef PYMI_X86_SIMD
+/* log2 of positive normal doubles: x = 2^e m with m in [sqrt(1/2), sqrt(2)),
+ * log(m) = 2 atanh(t), t = (m-1)/(m+1), |t| < 0.172, summed to t^19 (~1 ulp) */
+#define LOG2_SERIES(MADD, SET1, t2, p) \
+  p = MADD(SET1(1.0/19), t2, SET1(1.0/17)); \
+  p = MADD(p, t2, SET1(1.0/15)); \
+  p = MADD(p, t2, SET1(1.0/13)); \
+  p = MADD(p, t2, SET1(1.0/11)); \
+  p = MADD(p, t2, SET1(1.0/9)); \
+  p = MADD(p, t2, SET1(1.0/7)); \
+  p = MADD(p, t2, SET1(1.0/5)); \
+  p = MADD(p, t2, SET1(1.0/3)); \
+  p = MADD(p, t2, SET1(1.0))
+
+__attribute__((target("avx2,fma")))
+static inline __m256d log2AVX2(__m256d x) {
+  const __m256d magic = _mm256_set1_pd(6755399441055744.0); /* 1.5 * 2^52, int64 -> double */
+  __m256i bits = _mm256_castpd_si256(x);
+  __m256i e = _mm256_sub_epi64(_mm256_srli_epi64(bits, 52), _mm256_set1_epi64x(1023));
+  __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000fffffffffffffLL)),
+                                                  _mm256_set1_epi64x(0x3ff0000000000000LL)));
+  __m256d ed = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(e, _mm256_castpd_si256(magic))), magic);
+  __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(1.4142135623730951), _CMP_GT_OQ);
+  __m256d t, t2, p;
+
+  m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+  ed = _mm256_add_pd(ed, _mm256_and_pd(big, _mm256_set1_pd(1.0)));
+  t = _mm256_div_pd(_mm256_sub_pd(m, _mm256_set1_pd(1.0)), _mm256_add_pd(m, _mm256_set1_pd(1.0)));
+  t2 = _mm256_mul_pd(t, t);
+  LOG2_SERIES(_mm256_fmadd_pd, _mm256_set1_pd, t2, p);
+  return _mm256_fmadd_pd(_mm256_mul_pd(t, p), _mm256_set1_pd(2.0 / LN2), ed);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d log2AVX512(__m512d x) {
+  __m512d m = _mm512_getmant_pd(x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_zero);
+  __m512d ed = _mm512_getexp_pd(x);
+  __mmask8 big = _mm512_cmp_pd_mask(m, _mm512_set1_pd(1.4142135623730951), _CMP_GT_OQ);
+  __m512d t, t2, p;
+
+  m = _mm512_mask_mul_pd(m, big, m, _mm512_set1_pd(0.5));
+  ed = _mm512_mask_add_pd(ed, big, ed, _mm512_set1_pd(1.0));
+  t = _mm512_div_pd(_mm512_sub_pd(m, _mm512_set1_pd(1.0)), _mm512_add_pd(m, _mm512_set1_pd(1.0)));
+  t2 = _mm512_mul_pd(t, t);
+  LOG2_SERIES(_mm512_fmadd_pd, _mm512_set1_pd, t2, p);
+  return _mm512_fmadd_pd(_mm512_mul_pd(t, p), _mm512_set1_pd(2.0 / LN2), ed);
+}
+
+/* -sum h log2 h over h = hist / numSamples; cells below DBL_MIN count as 0 */
+__attribute__((target("avx2,fma")))
+static double histEntropyAVX2(const double *hist, int numCells, int numSamples) {
+  __m256d acc = _mm256_setzero_pd(), n = _mm256_set1_pd((double) numSamples), h, pos;
+  double lanes[4], H = 0, hs;
+  int c;
+
+  for (c = 0; c + 4 <= numCells; c += 4) {
+    h = _mm256_div_pd(_mm256_loadu_pd(hist + c), n);
+    pos = _mm256_cmp_pd(h, _mm256_set1_pd(DBL_MIN), _CMP_GE_OQ);
+    h = _mm256_blendv_pd(_mm256_set1_pd(1.0), h, pos); /* log2(1) = 0 for empty cells */
+    acc = _mm256_fmadd_pd(h, log2AVX2(h), acc);
+  }
+  _mm256_storeu_pd(lanes, acc);
+  H = -(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+  for (; c < numCells; c++) {
+    hs = hist[c] / numSamples;
+    if (hs > 0) H -= hs * log2d(hs);
+  }
+  return H;
+}
+
+__attribute__((target("avx512f")))
+static double histEntropyAVX512(const double *hist, int numCells, int numSamples) {
+  __m512d acc = _mm512_setzero_pd(), n = _mm512_set1_pd((double) numSamples), h;
+  __mmask8 k, pos;
+  int c;
+
+  for (c = 0; c < numCells; c += 8) {
+    k = numCells - c >= 8 ? 0xff : (__mmask8) ((1u << (numCells - c)) - 1);
+    h = _mm512_div_pd(_mm512_maskz_loadu_pd(k, hist + c), n);
+    pos = _mm512_mask_cmp_pd_mask(k, h, _mm512_set1_pd(DBL_MIN), _CMP_GE_OQ);
+    h = _mm512_mask_blend_pd(pos, _mm512_set1_pd(1.0), h);
+    acc = _mm512_fmadd_pd(h, log2AVX512(h), acc);
+  }
+  return -_mm512_reduce_add_pd(acc);
+}
+
+__attribute__((target("avx2,fma")))
+static double productMomentAVX2(const double *x, const double *y, int n) {
+  __m256d sx = _mm256_setzero_pd(), sy = _mm256_setzero_pd(), sxy = _mm256_setzero_pd(), a, b;
+  double l[4], sumX, sumY, sumXY;
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    a = _mm256_loadu_pd(x + i);
+    b = _mm256_loadu_pd(y + i);
+    sx = _mm256_add_pd(sx, a);
+    sy = _mm256_add_pd(sy, b);
+    sxy = _mm256_fmadd_pd(a, b, sxy);
+  }
+  _mm256_storeu_pd(l, sx);
+  sumX = l[0] + l[1] + l[2] + l[3];
+  _mm256_storeu_pd(l, sy);
+  sumY = l[0] + l[1] + l[2] + l[3];
+  _mm256_storeu_pd(l, sxy);
+  sumXY = l[0] + l[1] + l[2] + l[3];
+  for (; i < n; i++) {
+    sumX += x[i];
+    sumY += y[i];
+    sumXY += x[i] * y[i];
+  }
+  return sumXY * n - sumX * sumY;
+}
+
+__attribute__((target("avx512f")))
+static double productMomentAVX512(const double *x, const double *y, int n) {
+  __m512d sx = _mm512_setzero_pd(), sy = _mm512_setzero_pd(), sxy = _mm512_setzero_pd(), a, b;
+  __mmask8 k;
+  int i;
+
+  for (i = 0; i < n; i += 8) {
+    k = n - i >= 8 ? 0xff : (__mmask8) ((1u << (n - i)) - 1);
+    a = _mm512_maskz_loadu_pd(k, x + i);
+    b = _mm512_maskz_loadu_pd(k, y + i);
+    sx = _mm512_add_pd(sx, a);
+    sy = _mm512_add_pd(sy, b);
+    sxy = _mm512_fmadd_pd(a, b, sxy);
+  }
+  return _mm512_reduce_add_pd(sxy) * n - _mm512_reduce_add_pd(sx) * _mm512_reduce_add_pd(sy);
+}
+#endif
+
+double entropyFromHist(const double *hist, int numCells, int numSamples) {
+  int curCell;
   double H = 0, h;
 
-  for (curBin = 0; curBin < numBins; curBin++) {
-    h = 0;
-    for(curSample = 0; curSample < numSamples; curSample++) h += weights[curBin * numSamples + curSample];
-    h /= numSamples;
+#ifdef PYMI_X86_SIMD
+  if (simdLevel == SIMD_AVX512) return histEntropyAVX512(hist, numCells, numSamples);
+  if (simdLevel == SIMD_AVX2) return histEntropyAVX2(hist, numCells, numSamples);
+#endif
+  for (curCell = 0; curCell < numCells; curCell++) {
+    h = hist[curCell] / numSamples;
     if (h > 0) {
       H -= h * log2d(h);
     }
@@ -252,69 +625,313 @@ double entropy1(const double *weights, int numSamples, int numBins) {
   return H;
 }
 
-double entropy2(const double *wx, const double *wy, int numSamples, int numBins) {
-  int curBinX, curBinY, curSample;
-  double H = 0, h;
+double entropy1(const int *bins, const double *weights, int numSamples, int numBins, int splineOrder) {
+  int curSample, k;
+  double H;
+  long long t = phaseStart();
+  double *hist = (double*) calloc(numBins, sizeof(double));
+
+  for (curSample = 0; curSample < numSamples; curSample++) {
+    for (k = 0; k < splineOrder; k++) {
+      hist[bins[curSample] + k] += weights[curSample * splineOrder + k];
+    }
+  }
+  H = entropyFromHist(hist, numBins, numSamples);
+  free(hist);
+  phaseEnd(PHASE_MARGINALS, t, numSamples);
+  return H;
+}
+
+/* adds the joint histogram of two compactly weighted vectors to hist (numBins x numBins) */
+static inline void jointHistBody(const int *bx, const double *wx, const int *by, const double *wy, double *hist, int numSamples, int numBins, int splineOrder) {
+  int curSample, kx, ky;
+  double *row;
+  const double *wxs, *wys;
 
-  for (curBinX = 0; curBinX < numBins; curBinX++) {
-    for (curBinY = 0; curBinY < numBins; curBinY++) {
-      h = 0;
-      for(curSample = 0; curSample < numSamples; curSample++){
-        h += wx[curBinX * numSamples + curSample] * wy[curBinY * numSamples + curSample];
+  /* only the splineOrder x splineOrder block of nonzero products is scattered */
+  for (curSample = 0; curSample < numSamples; curSample++) {
+    wxs = wx + curSample * splineOrder;
+    wys = wy + curSample * splineOrder;
+    for (kx = 0; kx < splineOrder; kx++) {
+      row = hist + (bx[curSample] + kx) * numBins + by[curSample];
+      for (ky = 0; ky < splineOrder; ky++) {
+        row[ky] += wxs[kx] * wys[ky];
       }
-      h /= numSamples;
-      if (h > 0) {
-	H -= h * log2d(h);
+    }
+  }
+}
+
+void jointHist(const int *bx, const double *wx, const int *by, const double *wy, double *hist, int numSamples, int numBins, int splineOrder) {
+  jointHistBody(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
+}
+
+#ifdef PYMI_X86_SIMD
+/* jointHist with one vector FMA per row of the so x so block. hist needs 4
+ * doubles of padding: for so = 3 a fourth lane adds 0 past the block. */
+__attribute__((target("avx2,fma")))
+static inline void jointHistAVX2(const int *bx, const double *wx, const int *by, const double *wy, double *hist, int numSamples, int numBins, int splineOrder) {
+  const __m256i mask3 = _mm256_set_epi64x(0, -1, -1, -1);
+  __m256d b;
+  __m128d b2;
+  double *row;
+  int s, kx;
+
+  if (splineOrder == 4 || splineOrder == 3) {
+    for (s = 0; s < numSamples; s++) {
+      b = splineOrder == 4 ? _mm256_loadu_pd(wy + s * 4) : _mm256_maskload_pd(wy + s * 3, mask3);
+      row = hist + bx[s] * numBins + by[s];
+      for (kx = 0; kx < splineOrder; kx++, row += numBins)
+        _mm256_storeu_pd(row, _mm256_fmadd_pd(_mm256_set1_pd(wx[s * splineOrder + kx]), b, _mm256_loadu_pd(row)));
+    }
+  } else if (splineOrder == 2) {
+    for (s = 0; s < numSamples; s++) {
+      b2 = _mm_loadu_pd(wy + s * 2);
+      row = hist + bx[s] * numBins + by[s];
+      _mm_storeu_pd(row, _mm_fmadd_pd(_mm_set1_pd(wx[s * 2]), b2, _mm_loadu_pd(row)));
+      _mm_storeu_pd(row + numBins, _mm_fmadd_pd(_mm_set1_pd(wx[s * 2 + 1]), b2, _mm_loadu_pd(row + numBins)));
+    }
+  } else {
+    jointHistBody(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
+  }
+}
+
+/* masked rows, any spline order up to 8 */
+__attribute__((target("avx512f")))
+static void jointHistAVX512(const int *bx, const double *wx, const int *by, const double *wy, double *hist, int numSamples, int numBins, int splineOrder) {
+  __mmask8 k = (__mmask8) ((1u << splineOrder) - 1);
+  __m512d b;
+  double *row;
+  int s, kx;
+
+  if (splineOrder > 8) {
+    jointHistBody(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
+    return;
+  }
+  for (s = 0; s < numSamples; s++) {
+    b = _mm512_maskz_loadu_pd(k, wy + s * splineOrder);
+    row = hist + bx[s] * numBins + by[s];
+    for (kx = 0; kx < splineOrder; kx++, row += numBins)
+      _mm512_mask_storeu_pd(row, k, _mm512_fmadd_pd(_mm512_set1_pd(wx[s * splineOrder + kx]), b, _mm512_maskz_loadu_pd(k, row)));
+  }
+}
+
+#endif
+
+/* entropy2 on the SIMD path, histogram on the stack for up to 15 bins */
+#define SIMD_STACK_CELLS 240
+static double entropy2Simd(const int *bx, const double *wx, const int *by, const double *wy, int numSamples, int numBins, int splineOrder) {
+  double stackHist[SIMD_STACK_CELLS], *hist = stackHist, H;
+  int c, cells = numBins * numBins;
+
+  if (cells + 4 > SIMD_STACK_CELLS) hist = (double*) malloc((cells + 4) * sizeof(double));
+  for (c = 0; c < cells + 4; c++) hist[c] = 0;
+#ifdef PYMI_X86_SIMD
+  /* masked 512-bit stores do not forward to the next sample's loads, so
+   * they only pay off for rows wider than the 256-bit kernel handles */
+  if (simdLevel == SIMD_AVX512 && splineOrder > 4) jointHistAVX512(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
+  else jointHistAVX2(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
+#endif
+  H = entropyFromHist(hist, cells, numSamples);
+  if (hist != stackHist) free(hist);
+  return H;
+}
+
+/* entropy2 with constant sizes and the histogram on the stack */
+#define ENTROPY2_FIXED(BINS, SO) \
+static double entropy2_##BINS##_##SO(const int *bx, const double *wx, const int *by, const double *wy, int numSamples) { \
+  double hist[BINS * BINS]; \
+  int c; \
+  for (c = 0; c < BINS * BINS; c++) hist[c] = 0; \
+  jointHistBody(bx, wx, by, wy, hist, numSamples, BINS, SO); \
+  return entropyFromHist(hist, BINS * BINS, numSamples); \
+}
+#define ENTROPY2_FIXED_SO(BINS) ENTROPY2_FIXED(BINS, 2) ENTROPY2_FIXED(BINS, 3) ENTROPY2_FIXED(BINS, 4)
+ENTROPY2_FIXED_SO(6)
+ENTROPY2_FIXED_SO(7)
+ENTROPY2_FIXED_SO(8)
+ENTROPY2_FIXED_SO(9)
+ENTROPY2_FIXED_SO(10)
+ENTROPY2_FIXED_SO(11)
+ENTROPY2_FIXED_SO(12)
+
+typedef double (*entropy2Fixed)(const int *bx, const double *wx, const int *by, const double *wy, int numSamples);
+
+#define ENTROPY2_ROW(BINS) {entropy2_##BINS##_2, entropy2_##BINS##_3, entropy2_##BINS##_4}
+static const entropy2Fixed entropy2Table[SPEC_MAX_BINS - SPEC_MIN_BINS + 1][SPEC_MAX_SO - SPEC_MIN_SO + 1] = {
+  ENTROPY2_ROW(6), ENTROPY2_ROW(7), ENTROPY2_ROW(8), ENTROPY2_ROW(9), ENTROPY2_ROW(10), ENTROPY2_ROW(11), ENTROPY2_ROW(12)
+};
+
+#ifdef PYMI_X86_SIMD
+/* the specialized sizes with the vector rows of jointHistAVX2, used when
+ * simdLevel allows; 4 cells of padding take the last row's store */
+#define ENTROPY2_FIXED_AVX2(BINS, SO) \
+__attribute__((target("avx2,fma"))) \
+static double entropy2AVX2_##BINS##_##SO(const int *bx, const double *wx, const int *by, const double *wy, int numSamples) { \
+  double hist[BINS * BINS + 4]; \
+  int c; \
+  for (c = 0; c < BINS * BINS + 4; c++) hist[c] = 0; \
+  jointHistAVX2(bx, wx, by, wy, hist, numSamples, BINS, SO); \
+  return entropyFromHist(hist, BINS * BINS, numSamples); \
+}
+#define ENTROPY2_FIXED_AVX2_SO(BINS) ENTROPY2_FIXED_AVX2(BINS, 2) ENTROPY2_FIXED_AVX2(BINS, 3) ENTROPY2_FIXED_AVX2(BINS, 4)
+ENTROPY2_FIXED_AVX2_SO(6)
+ENTROPY2_FIXED_AVX2_SO(7)
+ENTROPY2_FIXED_AVX2_SO(8)
+ENTROPY2_FIXED_AVX2_SO(9)
+ENTROPY2_FIXED_AVX2_SO(10)
+ENTROPY2_FIXED_AVX2_SO(11)
+ENTROPY2_FIXED_AVX2_SO(12)
+
+#define ENTROPY2_AVX2_ROW(BINS) {entropy2AVX2_##BINS##_2, entropy2AVX2_##BINS##_3, entropy2AVX2_##BINS##_4}
+static const entropy2Fixed entropy2AVX2Table[SPEC_MAX_BINS - SPEC_MIN_BINS + 1][SPEC_MAX_SO - SPEC_MIN_SO + 1] = {
+  ENTROPY2_AVX2_ROW(6), ENTROPY2_AVX2_ROW(7), ENTROPY2_AVX2_ROW(8), ENTROPY2_AVX2_ROW(9), ENTROPY2_AVX2_ROW(10), ENTROPY2_AVX2_ROW(11), ENTROPY2_AVX2_ROW(12)
+};
+#endif
+
+static double entropy2Dispatch(const int *bx, const double *wx, const int *by, const double *wy, int numSamples, int numBins, int splineOrder) {
+  double H;
+  double *hist;
+
+  if (specializedKernels && numBins >= SPEC_MIN_BINS && numBins <= SPEC_MAX_BINS && splineOrder >= SPEC_MIN_SO && splineOrder <= SPEC_MAX_SO){
+#ifdef PYMI_X86_SIMD
+    if (simdLevel > SIMD_SCALAR)
+      return entropy2AVX2Table[numBins - SPEC_MIN_BINS][splineOrder - SPEC_MIN_SO](bx, wx, by, wy, numSamples);
+#endif
+    return entropy2Table[numBins - SPEC_MIN_BINS][splineOrder - SPEC_MIN_SO](bx, wx, by, wy, numSamples);
+  }
+  if (simdLevel > SIMD_SCALAR)
+    return entropy2Simd(bx, wx, by, wy, numSamples, numBins, splineOrder);
+
+  hist = (double*) calloc(numBins * numBins, sizeof(double));
+  jointHist(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
+  H = entropyFromHist(hist, numBins * numBins, numSamples);
+  free(hist);
+  return H;
+}
+
+double entropy2(const int *bx, const double *wx, const int *by, const double *wy, int numSamples, int numBins, int splineOrder) {
+  long long t = phaseStart();
+  double H = entropy2Dispatch(bx, wx, by, wy, numSamples, numBins, splineOrder);
+  phaseEnd(PHASE_JOINT, t, numSamples);
+  return H;
+}
+
+/* jointHist for two vectors with their own bin counts and spline orders; hist is binx x biny */
+void jointHistDiffBins(const int *bx, const double *wx, const int *by, const double *wy, double *hist, int numSamples, int biny, int sox, int soy) {
+  int curSample, kx, ky;
+  double *row;
+  const double *wxs, *wys;
+
+  for (curSample = 0; curSample < numSamples; curSample++) {
+    wxs = wx + curSample * sox;
+    wys = wy + curSample * soy;
+    for (kx = 0; kx < sox; kx++) {
+      row = hist + (bx[curSample] + kx) * biny + by[curSample];
+      for (ky = 0; ky < soy; ky++) {
+        row[ky] += wxs[kx] * wys[ky];
       }
     }
   }
+}
+
+double entropy2DiffBins(const int *bx, const double *wx, const int *by, const double *wy, int numSamples, int binx, int biny, int sox, int soy){
+  double H;
+  double *hist;
+
+  if(binx == biny && sox == soy) return entropy2(bx, wx, by, wy, numSamples, binx, sox);
+  hist = (double*) calloc(binx * biny, sizeof(double));
+  jointHistDiffBins(bx, wx, by, wy, hist, numSamples, biny, sox, soy);
+  H = entropyFromHist(hist, binx * biny, numSamples);
+  free(hist);
   return H;
 }
 
-double entropy2DiffBins(const double *wx, const double *wy, int numSamples, int binx, int biny){
-	int curBinX, curBinY, curSample;
-	double H = 0, h;
-
-	for(curBinX = 0; curBinX < binx; curBinX++){
-	  for(curBinY = 0; curBinY < biny; curBinY++){
-		h = 0;
-		for(curSample = 0; curSample < numSamples; curSample++){
-			h += wx[curBinX*numSamples + curSample] * wy[curBinY * numSamples + curSample];
-		}
-		h /= numSamples;
-		if(h > 0){
-			H -= h * log2d(h);
-		}
+/* adds the three-way histogram (numBins^3, x major) of compactly weighted vectors to hist */
+void tripleHist(const int *bx, const double *wx, const int *by, const double *wy, const int *bz, const double *wz, double *hist, int numSamples, int numBins, int splineOrder){
+	int curSample, kx, ky, kz;
+	double wxy, *row;
+
+	for(curSample = 0; curSample < numSamples; curSample++){
+	  for(kx = 0; kx < splineOrder; kx++){
+	    for(ky = 0; ky < splineOrder; ky++){
+	      wxy = wx[curSample*splineOrder + kx] * wy[curSample*splineOrder + ky];
+	      row = hist + ((bx[curSample] + kx)*numBins + by[curSample] + ky)*numBins + bz[curSample];
+	      for(kz = 0; kz < splineOrder; kz++){
+	        row[kz] += wxy * wz[curSample*splineOrder + kz];
+	      }
+	    }
 	  }
 	}
+}
+
+double entropy3(const int *bx, const double *wx, const int *by, const double *wy, const int *bz, const double *wz, int numSamples, int numBins, int splineOrder){
+	double H;
+	double *hist = (double*) calloc(numBins * numBins * numBins, sizeof(double));
+
+	tripleHist(bx, wx, by, wy, bz, wz, hist, numSamples, numBins, splineOrder);
+	H = entropyFromHist(hist, numBins * numBins * numBins, numSamples);
+	free(hist);
 	return H;
 }
 
-double entropy3(const double *wx, const double *wy, const double *wz, int numSamples, int numBins){
-	int curBinX, curBinY, curBinZ, curSample;
-	double H = 0, histVal = 0;
-	double wxyz;
-	for(curBinX = 0; curBinX < numBins; curBinX++){
-	  for(curBinY = 0; curBinY < numBins; curBinY++){
-	    for(curBinZ = 0; curBinZ < numBins; curBinZ++){
-	      histVal = 0;
-		for(curSample = 0; curSample < numSamples; curSample++){
-		  wxyz = wx[curBinX*numSamples + curSample] * wy[curBinY*numSamples + curSample] * wz[curBinZ*numSamples + curSample];
-		  histVal += wxyz;
-		}
-		histVal /= numSamples;
-		if(histVal > 0){
-			H -= histVal * log2d(histVal);
-		}
+/* H(x,y,z), H(x,z) and H(y,z) from a single pass over the samples: the two
+ * pairwise histograms are marginals of the three-way one. hist3 (numBins^3)
+ * and hist2 (numBins^2) are scratch space; hxz may be NULL when not needed. */
+void tripleEntropies(const int *bx, const double *wx, const int *by, const double *wy, const int *bz, const double *wz, int numSamples, int numBins, int splineOrder,
+                     double *hist3, double *hist2, double *hxyz, double *hxz, double *hyz){
+	int i, j, k, b2 = numBins * numBins, b3 = b2 * numBins;
+
+	for(i = 0; i < b3; i++) hist3[i] = 0;
+	tripleHist(bx, wx, by, wy, bz, wz, hist3, numSamples, numBins, splineOrder);
+	*hxyz = entropyFromHist(hist3, b3, numSamples);
+
+	if(hxz != NULL){
+	  for(i = 0; i < b2; i++) hist2[i] = 0;
+	  for(i = 0; i < numBins; i++)
+	    for(j = 0; j < numBins; j++)
+	      for(k = 0; k < numBins; k++) hist2[i*numBins + k] += hist3[(i*numBins + j)*numBins + k];
+	  *hxz = entropyFromHist(hist2, b2, numSamples);
+	}
+
+	for(i = 0; i < b2; i++) hist2[i] = 0;
+	for(i = 0; i < numBins; i++)
+	  for(j = 0; j < numBins; j++)
+	    for(k = 0; k < numBins; k++) hist2[j*numBins + k] += hist3[(i*numBins + j)*numBins + k];
+	*hyz = entropyFromHist(hist2, b2, numSamples);
+}
+
+/* H((x,y), (x,y)): joint entropy of the pair variable with itself, the
+ * counterpart of entropy2(bx, wx, bx, wx, ...) used to normalize mi2vs1 */
+double pairSelfEntropy(const int *bx, const double *wx, const int *by, const double *wy, int numSamples, int numBins, int splineOrder){
+	int curSample, kx, ky, lx, ly, b2 = numBins * numBins;
+	double H, a, *row;
+	double *hist = (double*) calloc(b2 * b2, sizeof(double));
+
+	for(curSample = 0; curSample < numSamples; curSample++){
+	  for(kx = 0; kx < splineOrder; kx++){
+	    for(ky = 0; ky < splineOrder; ky++){
+	      a = wx[curSample*splineOrder + kx] * wy[curSample*splineOrder + ky];
+	      row = hist + ((bx[curSample] + kx)*numBins + by[curSample] + ky)*b2;
+	      for(lx = 0; lx < splineOrder; lx++){
+	        for(ly = 0; ly < splineOrder; ly++){
+	          row[(bx[curSample] + lx)*numBins + by[curSample] + ly] += a * wx[curSample*splineOrder + lx] * wy[curSample*splineOrder + ly];
+	        }
+	      }
 	    }
 	  }
 	}
+	H = entropyFromHist(hist, b2 * b2, numSamples);
+	free(hist);
 	return H;
 }
 
-double productMoment(const double *x, const double *y, int n){
+static double productMomentDispatch(const double *x, const double *y, int n){
 	int i;
 	double sumX=0, sumY=0, sumXY=0;
+#ifdef PYMI_X86_SIMD
+	if(simdLevel == SIMD_AVX512) return productMomentAVX512(x, y, n);
+	if(simdLevel == SIMD_AVX2) return productMomentAVX2(x, y, n);
+#endif
 	for(i = 0; i < n; i++){
 		sumX += x[i];
 		sumY += y[i];
@@ -324,392 +941,3721 @@ double productMoment(const double *x, const double *y, int n){
 	return sumXY;
 }
 
-//========================= export python function ===================================
-
-double mi2(const double *x, const double *y, int n, int bin, int so, int norm, int negateMI){
-  double *u = (double*) calloc(bin + so, sizeof(double));
-  double *wx = (double*) calloc(bin * n, sizeof(double));
-  double *wy = (double*) calloc(bin * n, sizeof(double));
-  double e1x, e1y, mix, miy, largerMI, mi;
+double productMoment(const double *x, const double *y, int n){
+	long long t = phaseStart();
+	double r = productMomentDispatch(x, y, n);
+	phaseEnd(PHASE_SIGN, t, n);
+	return r;
+}
 
-  knotVector(u, bin, so);
-  findWeights(x, u, wx, n, so, bin, -1, -1);
-  findWeights(y, u, wy, n, so, bin, -1, -1);
-  e1x = entropy1(wx, n, bin);
-  e1y = entropy1(wy, n, bin);
-  mi = (e1x + e1y - entropy2(wx, wy, n, bin));
+/* float32 mode: compact weights are stored as float, which halves their
+ * memory and the bandwidth of the histogram loops, while products and
+ * histogram cells are still accumulated in double. Rounding a weight to float
+ * moves each histogram cell p by at most 2u p (u = 2^-24), so an entropy H
+ * moves by at most 2u (H + log2(e)) and MI = H(x) + H(y) - H(x,y) by at most
+ * 2u (4 log2(bins) + 3 log2(e)) bits, under 2.3e-6 for bins <= 12. Normalized
+ * MI carries the same error divided by the normalizer. */
+void narrowWeights(const double *w, float *wf, size_t num){
+  size_t i;
+  for(i = 0; i < num; i++) wf[i] = (float) w[i];
+}
 
-  if(norm == 1){
-    mix = 2*e1x - entropy2(wx, wx, n, bin);
-    miy = 2*e1y - entropy2(wy, wy, n, bin);
-    largerMI = mix > miy ? mix:miy;
-    if(largerMI == 0) largerMI = 1;
-    mi /= largerMI;
-  }
-  if(negateMI == 1 && productMoment(x, y, n) < 0) mi = -mi;
-  free(wx);
-  free(wy);
-  free(u);
-  return mi;
+/* findWeightsSparse of a float row; xd (n) and wd (n x so) are scratch */
+void findWeightsSparseF(const float *x, const double *knots, int *bins, float *weights, double *xd, double *wd, int numSamples, int splineOrder, int numBins){
+  int i;
+  for(i = 0; i < numSamples; i++) xd[i] = x[i];
+  findWeightsSparse(xd, knots, bins, wd, numSamples, splineOrder, numBins, -1, -1);
+  narrowWeights(wd, weights, (size_t) numSamples * splineOrder);
 }
-/*
-void mi2DiffBins(const double *x, const double *y, int *n, int *binx, int *biny, int *sox, int *soy, double *miOut, int *norm, int *negateMI){
-	double *ux = (double*) calloc(*binx + *sox, sizeof(double));
-	double *wx = (double*) calloc(*binx * *n, sizeof(double));
-	double *uy = (double*) calloc(*biny + *soy, sizeof(double));
-	double *wy = (double*) calloc(*biny * *n, sizeof(double));
-	double e1x, e1y, mix, miy, largermi, mi;
-	
-	knotVector(ux, *binx, *sox);
-	findWeights(x, ux, wx, *n, *sox, *binx, -1, -1);
-	free(ux);
-	knotVector(uy, *biny, *soy);
-	findWeights(y, uy, wy, *n, *soy, *biny, -1, -1);
-	free(uy);
-	e1x = entropy1(wx, *n, *binx);
-	e1y = entropy1(wy, *n, *biny);
-	mi = (e1x + e1y - entropy2DiffBins(wx, wy, *n, *binx, *biny));
-	
-	if(*norm == 1){
-		mix = 2*e1x - entropy2(wx, wx, *n, *binx);
-		miy = 2*e1y - entropy2(wy, wy, *n, *biny);
-		largermi = mix > miy? mix : miy;
-		if(largermi == 0) largermi = 1;
-		mi /= largermi;
-	}
-	if(*negateMI == 1 && productMoment(x, y, *n) < 0) mi = -mi;
-	free(wx);
-	free(wy);
-	*miOut = mi;
-}
-
-void mi2vs1(const double *x, const double *y, const double *z, int *n, int *bin, int *so, double *mi, int *norm){
-  double *u = (double*) calloc(*bin + *so, sizeof(double));
-  double *wx = (double*) calloc(*bin * *n, sizeof(double));
-  double *wy = (double*) calloc(*bin * *n, sizeof(double));
-  double *wz = (double*) calloc(*bin * *n, sizeof(double));
-  double *wxy = (double*) calloc(*bin * *bin * *n, sizeof(double));
-  double e1xy, e1z, e2xyz, mixy, miz, largermi;
-
-  knotVector(u, *bin, *so);
-  findWeights(x, u, wx, *n, *so, *bin, -1, -1);
-  findWeights(y, u, wy, *n, *so, *bin, -1, -1);
-  findWeights(z, u, wz, *n, *so, *bin, -1, -1);
-  combineWeights(wx, wy, wxy, *n, *bin);
-  free(wx);
-  free(wy);
 
-  e1xy = entropy1(wxy, *n, *bin * *bin);
-  e1z = entropy1(wz, *n, *bin);
-  *mi = (e1xy + e1z - entropy2DiffBins(wxy, wz, *n, *bin * *bin, *bin));
-  if(*norm == 1){
-    mixy = 2*e1xy - entropy2(wxy, wxy, *n, *bin * *bin);
-    miz = 2*e1z - entropy2(wz, wz, *n, *bin);
-    largermi = mixy > miz ? mixy : miz;
-    if(largermi == 0) largermi = 1;
-    *mi /= largermi;
-  }
+double entropy1F(const int *bins, const float *weights, int numSamples, int numBins, int splineOrder) {
+  int curSample, k;
+  double H;
+  long long t = phaseStart();
+  double *hist = (double*) calloc(numBins, sizeof(double));
 
-  free(wxy);
-  free(wz);
-  free(u);
+  for (curSample = 0; curSample < numSamples; curSample++) {
+    for (k = 0; k < splineOrder; k++) {
+      hist[bins[curSample] + k] += weights[curSample * splineOrder + k];
+    }
+  }
+  H = entropyFromHist(hist, numBins, numSamples);
+  free(hist);
+  phaseEnd(PHASE_MARGINALS, t, numSamples);
+  return H;
 }
-*/
-
-void getAllMIWz(double *data, const double* vec, double *mi, int m, int n, int bin, int so, int norm, int negateMI){
-  double *u = (double*) calloc(bin + so, sizeof(double));
-  double *y = (double*) calloc(n, sizeof(double));
-  double *wx = (double*) calloc(bin * n, sizeof(double));
-  double *wy = (double*) calloc(bin * n, sizeof(double));
-  int i, j;
-  double e1x, e1y, mix, miy, largerMI;
 
-  knotVector(u, bin, so);
-  findWeights(vec, u, wx, n, so, bin, -1, -1);
-  e1x = entropy1(wx, n, bin);
-  mix = 2*e1x - entropy2(wx, wx, n, bin);
+static inline void jointHistFBody(const int *bx, const float *wx, const int *by, const float *wy, double *hist, int numSamples, int numBins, int splineOrder) {
+  int curSample, kx, ky;
+  double a, *row;
+  const float *wxs, *wys;
 
-  for(i = 0; i < m; i++){
-    for(j = 0; j < n; j++) y[j] = data[j + i*n];
-    //y = data[i];
-    findWeights(y, u, wy, n, so, bin, -1, -1);
-    e1y = entropy1(wy, n, bin);
-    mi[i] = (e1x + e1y - entropy2(wx, wy, n, bin));
-    if(norm == 1){
-      largerMI = mix;
-      miy = 2*e1y - entropy2(wy, wy, n, bin);
-      if(miy > mix) largerMI = miy;
-      if(largerMI == 0) largerMI = 1;
-      mi[i] /= largerMI;
+  for (curSample = 0; curSample < numSamples; curSample++) {
+    wxs = wx + curSample * splineOrder;
+    wys = wy + curSample * splineOrder;
+    for (kx = 0; kx < splineOrder; kx++) {
+      a = wxs[kx];
+      row = hist + (bx[curSample] + kx) * numBins + by[curSample];
+      for (ky = 0; ky < splineOrder; ky++) {
+        row[ky] += a * wys[ky];
+      }
     }
-    if(negateMI==1 && productMoment(y, vec, n) < 0) mi[i] = -mi[i];
   }
+}
 
-  free(wx);
-  free(wy);
-  free(u);
-  free(y);
+void jointHistF(const int *bx, const float *wx, const int *by, const float *wy, double *hist, int numSamples, int numBins, int splineOrder) {
+  jointHistFBody(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
 }
-/*
-void mi3(const double *x, const double *y, const double *z, int *n, int *bin, int *so, double *miOut){
-  double *u = (double*) calloc(*bin + *so, sizeof(double));
-  double *wx = (double*) calloc(*bin * *n, sizeof(double));
-  double *wy = (double*) calloc(*bin * *n, sizeof(double));
-  double *wz = (double*) calloc(*bin * *n, sizeof(double));
-  double e1x, e1y, e1z, e2xy, e2yz, e2xz, mi;
-
-
-  knotVector(u, *bin, *so);
-  findWeights(x, u, wx, *n, *so, *bin, -1, -1);
-  findWeights(y, u, wy, *n, *so, *bin, -1, -1);
-  findWeights(z, u, wz, *n, *so, *bin, -1, -1);
-  e1x = entropy1(wx, *n, *bin);
-  e1y = entropy1(wy, *n, *bin);
-  e1z = entropy1(wz, *n, *bin);
-  e2xy = entropy2(wx, wy, *n, *bin);
-  e2yz = entropy2(wy, wz, *n, *bin);
-  e2xz = entropy2(wx, wz, *n, *bin);
-  mi = entropy3(wx, wy, wz, *n, *bin) - e2xy - e2yz - e2xz + e1x + e1y + e1z;
 
-  free(wx);
-  free(wy);
-  free(wz);
-  free(u);
-  *miOut = mi;
+#ifdef PYMI_X86_SIMD
+/* jointHistAVX2 for float weights, widened to double as they are loaded */
+__attribute__((target("avx2,fma")))
+static inline void jointHistFAVX2(const int *bx, const float *wx, const int *by, const float *wy, double *hist, int numSamples, int numBins, int splineOrder) {
+  const __m128i mask3 = _mm_set_epi32(0, -1, -1, -1);
+  __m256d b;
+  double *row;
+  int s, kx;
+
+  if (splineOrder != 4 && splineOrder != 3) {
+    jointHistFBody(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
+    return;
+  }
+  for (s = 0; s < numSamples; s++) {
+    b = _mm256_cvtps_pd(splineOrder == 4 ? _mm_loadu_ps(wy + s * 4) : _mm_maskload_ps(wy + s * 3, mask3));
+    row = hist + bx[s] * numBins + by[s];
+    for (kx = 0; kx < splineOrder; kx++, row += numBins)
+      _mm256_storeu_pd(row, _mm256_fmadd_pd(_mm256_set1_pd(wx[s * splineOrder + kx]), b, _mm256_loadu_pd(row)));
+  }
 }
+#endif
 
-*/
+#define ENTROPY2F_FIXED(BINS, SO) \
+static double entropy2F_##BINS##_##SO(const int *bx, const float *wx, const int *by, const float *wy, int numSamples) { \
+  double hist[BINS * BINS]; \
+  int c; \
+  for (c = 0; c < BINS * BINS; c++) hist[c] = 0; \
+  jointHistFBody(bx, wx, by, wy, hist, numSamples, BINS, SO); \
+  return entropyFromHist(hist, BINS * BINS, numSamples); \
+}
+#define ENTROPY2F_FIXED_SO(BINS) ENTROPY2F_FIXED(BINS, 2) ENTROPY2F_FIXED(BINS, 3) ENTROPY2F_FIXED(BINS, 4)
+ENTROPY2F_FIXED_SO(6)
+ENTROPY2F_FIXED_SO(7)
+ENTROPY2F_FIXED_SO(8)
+ENTROPY2F_FIXED_SO(9)
+ENTROPY2F_FIXED_SO(10)
+ENTROPY2F_FIXED_SO(11)
+ENTROPY2F_FIXED_SO(12)
 
+typedef double (*entropy2FFixed)(const int *bx, const float *wx, const int *by, const float *wy, int numSamples);
 
-/* =========== python interface ============== */
+#define ENTROPY2F_ROW(BINS) {entropy2F_##BINS##_2, entropy2F_##BINS##_3, entropy2F_##BINS##_4}
+static const entropy2FFixed entropy2FTable[SPEC_MAX_BINS - SPEC_MIN_BINS + 1][SPEC_MAX_SO - SPEC_MIN_SO + 1] = {
+  ENTROPY2F_ROW(6), ENTROPY2F_ROW(7), ENTROPY2F_ROW(8), ENTROPY2F_ROW(9), ENTROPY2F_ROW(10), ENTROPY2F_ROW(11), ENTROPY2F_ROW(12)
+};
 
-int not_doublematrix(PyArrayObject *mat){
-    if(mat->descr->type_num != NPY_DOUBLE || mat->nd != 2){
-        PyErr_SetString(PyExc_ValueError,
-                "In not_doublematrix: array must be of type Float and 2 dimensional (n x m).");
-        return 1;}
-    return 0;
+#ifdef PYMI_X86_SIMD
+/* entropy2AVX2_* for float weights */
+#define ENTROPY2F_FIXED_AVX2(BINS, SO) \
+__attribute__((target("avx2,fma"))) \
+static double entropy2FAVX2_##BINS##_##SO(const int *bx, const float *wx, const int *by, const float *wy, int numSamples) { \
+  double hist[BINS * BINS + 4]; \
+  int c; \
+  for (c = 0; c < BINS * BINS + 4; c++) hist[c] = 0; \
+  jointHistFAVX2(bx, wx, by, wy, hist, numSamples, BINS, SO); \
+  return entropyFromHist(hist, BINS * BINS, numSamples); \
 }
+#define ENTROPY2F_FIXED_AVX2_SO(BINS) ENTROPY2F_FIXED_AVX2(BINS, 2) ENTROPY2F_FIXED_AVX2(BINS, 3) ENTROPY2F_FIXED_AVX2(BINS, 4)
+ENTROPY2F_FIXED_AVX2_SO(6)
+ENTROPY2F_FIXED_AVX2_SO(7)
+ENTROPY2F_FIXED_AVX2_SO(8)
+ENTROPY2F_FIXED_AVX2_SO(9)
+ENTROPY2F_FIXED_AVX2_SO(10)
+ENTROPY2F_FIXED_AVX2_SO(11)
+ENTROPY2F_FIXED_AVX2_SO(12)
 
+#define ENTROPY2F_AVX2_ROW(BINS) {entropy2FAVX2_##BINS##_2, entropy2FAVX2_##BINS##_3, entropy2FAVX2_##BINS##_4}
+static const entropy2FFixed entropy2FAVX2Table[SPEC_MAX_BINS - SPEC_MIN_BINS + 1][SPEC_MAX_SO - SPEC_MIN_SO + 1] = {
+  ENTROPY2F_AVX2_ROW(6), ENTROPY2F_AVX2_ROW(7), ENTROPY2F_AVX2_ROW(8), ENTROPY2F_AVX2_ROW(9), ENTROPY2F_AVX2_ROW(10), ENTROPY2F_AVX2_ROW(11), ENTROPY2F_AVX2_ROW(12)
+};
+#endif
 
-static PyObject *
-basis_function(PyObject *self, PyObject* args){
-    int i,p,numBins, listSize, j;
-    double t;
-    double *kVec;
+static double entropy2FDispatch(const int *bx, const float *wx, const int *by, const float *wy, int numSamples, int numBins, int splineOrder) {
+  double H;
+  double *hist;
 
-    PyObject *listObj, *seq, *out;
+  if (specializedKernels && numBins >= SPEC_MIN_BINS && numBins <= SPEC_MAX_BINS && splineOrder >= SPEC_MIN_SO && splineOrder <= SPEC_MAX_SO){
+#ifdef PYMI_X86_SIMD
+    if (simdLevel > SIMD_SCALAR)
+      return entropy2FAVX2Table[numBins - SPEC_MIN_BINS][splineOrder - SPEC_MIN_SO](bx, wx, by, wy, numSamples);
+#endif
+    return entropy2FTable[numBins - SPEC_MIN_BINS][splineOrder - SPEC_MIN_SO](bx, wx, by, wy, numSamples);
+  }
 
-    if(! PyArg_ParseTuple( args, "iidOi", &i, &p, &t, &listObj, &numBins )) return NULL;
-    
-    seq = PySequence_Fast(listObj, "Expected a sequence");
-    listSize = PySequence_Size(listObj);
-    kVec = (double*) calloc(listSize, sizeof(double));
-    
-    for(j = 0; j < listSize; j++)
-        kVec[j] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, j));
-    
-    Py_DECREF(seq);
-    out = Py_BuildValue("d", basisFunction(i, p, t, kVec, numBins));
-    free(kVec);
-    return out;
+  /* 4 doubles of padding for the vector rows, as in entropy2Simd */
+  hist = (double*) calloc(numBins * numBins + 4, sizeof(double));
+#ifdef PYMI_X86_SIMD
+  if (simdLevel > SIMD_SCALAR) jointHistFAVX2(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
+  else
+#endif
+  jointHistF(bx, wx, by, wy, hist, numSamples, numBins, splineOrder);
+  H = entropyFromHist(hist, numBins * numBins, numSamples);
+  free(hist);
+  return H;
 }
-  
-static PyObject*
-find_weights(PyObject *self, PyObject* args){
-    double *x, *knots, *weights;
-    int numSamples, splineOrder=3, numBins=6, i;
-    npy_intp w_dim[1] = {0};
-    PyObject *xObj,  *seq;
-    PyArrayObject *wObj;
 
-    if(! PyArg_ParseTuple( args, "O|ii", &xObj, &numBins, &splineOrder )) return NULL;
-    
-    numSamples = PySequence_Size(xObj);
-    x = (double*) calloc(numSamples, sizeof(double));
+double entropy2F(const int *bx, const float *wx, const int *by, const float *wy, int numSamples, int numBins, int splineOrder) {
+  long long t = phaseStart();
+  double H = entropy2FDispatch(bx, wx, by, wy, numSamples, numBins, splineOrder);
+  phaseEnd(PHASE_JOINT, t, numSamples);
+  return H;
+}
+
+/* H(x, x) for the self MI 2*H(x) - H(x, x) that normalizes MI, timed as
+ * normalize rather than joint */
+double selfEntropy2(const int *b, const double *w, int numSamples, int numBins, int splineOrder) {
+  long long t = phaseStart();
+  double H = entropy2Dispatch(b, w, b, w, numSamples, numBins, splineOrder);
+  phaseEnd(PHASE_NORMALIZE, t, numSamples);
+  return H;
+}
+
+double selfEntropy2F(const int *b, const float *w, int numSamples, int numBins, int splineOrder) {
+  long long t = phaseStart();
+  double H = entropy2FDispatch(b, w, b, w, numSamples, numBins, splineOrder);
+  phaseEnd(PHASE_NORMALIZE, t, numSamples);
+  return H;
+}
+
+double productMomentF(const float *x, const double *y, int n){
+	int i;
+	long long t = phaseStart();
+	double sumX=0, sumY=0, sumXY=0;
+	for(i = 0; i < n; i++){
+		sumX += x[i];
+		sumY += y[i];
+		sumXY += x[i] * y[i];
+	}
+	sumXY = sumXY * n - sumX * sumY;
+	phaseEnd(PHASE_SIGN, t, n);
+	return sumXY;
+}
+
+/* Missing values: a NaN sample gets zero weight, and MI of two vectors only
+ * uses the samples observed in both (pairwise complete). Validity is a
+ * bitmask, bit s % 64 of word s / 64 set when sample s is observed. Vectors
+ * without NaNs never reach the masked kernels. */
+#define MASK_WORDS(n) (((n) + 63) / 64)
+
+/* sets mask and returns the number of observed samples */
+int validMask(const double *x, int n, unsigned long long *mask){
+  int s, valid = 0;
+
+  memset(mask, 0, MASK_WORDS(n) * sizeof(unsigned long long));
+  for(s = 0; s < n; s++){
+    if(x[s] == x[s]){
+      mask[s / 64] |= 1ULL << (s % 64);
+      valid++;
+    }
+  }
+  return valid;
+}
+
+/* 1 when some of x[0 .. num) is NaN */
+int hasMissing(const double *x, size_t num){
+  size_t i;
+  for(i = 0; i < num; i++){
+    if(x[i] != x[i]) return 1;
+  }
+  return 0;
+}
+
+int hasMissingF(const float *x, size_t num){
+  size_t i;
+  for(i = 0; i < num; i++){
+    if(x[i] != x[i]) return 1;
+  }
+  return 0;
+}
+
+/* findWeightsSparse that gives NaN samples zero weight; returns the number
+ * of observed samples, as validMask */
+int findWeightsMasked(const double *x, const double *knots, int *bins, double *weights, unsigned long long *mask, int numSamples, int splineOrder, int numBins){
+  int s, k, valid = validMask(x, numSamples, mask);
+
+  findWeightsSparse(x, knots, bins, weights, numSamples, splineOrder, numBins, -1, -1);
+  if(valid == numSamples) return valid;
+  for(s = 0; s < numSamples; s++){
+    if(mask[s / 64] & (1ULL << (s % 64))) continue;
+    bins[s] = 0;
+    for(k = 0; k < splineOrder; k++) weights[s * splineOrder + k] = 0;
+  }
+  return valid;
+}
+
+/* MI of x and y over the samples idx[0 .. cnt), from compact weights.
+ * Observed samples' weights sum to 1, so the marginals over those samples
+ * are the row and column sums of the joint histogram. hist is scratch of
+ * 3 x bin x bin + 2 x bin; the self terms are only summed with norm. */
+double sampleSetMI(const int *bx, const double *wx, const int *by, const double *wy, const double *x, const double *y,
+                   const int *idx, int cnt, int bin, int so, int norm, int negateMI, double *hist){
+  int c, s, i, j, kx, ky;
+  double *hxy = hist, *hxx = hxy + bin * bin, *hyy = hxx + bin * bin, *hx = hyy + bin * bin, *hy = hx + bin;
+  double e1x, e1y, mix, miy, largerMI, mi;
+  double sumX = 0, sumY = 0, sumXY = 0;
+
+  if(cnt == 0) return 0;
+  memset(hist, 0, (3 * bin * bin + 2 * bin) * sizeof(double));
+  for(c = 0; c < cnt; c++){
+    s = idx[c];
+    for(kx = 0; kx < so; kx++){
+      for(ky = 0; ky < so; ky++)
+        hxy[(bx[s] + kx) * bin + by[s] + ky] += wx[s * so + kx] * wy[s * so + ky];
+    }
+    if(norm == 1){
+      for(kx = 0; kx < so; kx++){
+        for(ky = 0; ky < so; ky++){
+          hxx[(bx[s] + kx) * bin + bx[s] + ky] += wx[s * so + kx] * wx[s * so + ky];
+          hyy[(by[s] + kx) * bin + by[s] + ky] += wy[s * so + kx] * wy[s * so + ky];
+        }
+      }
+    }
+    sumX += x[s];
+    sumY += y[s];
+    sumXY += x[s] * y[s];
+  }
+  for(i = 0; i < bin; i++){
+    for(j = 0; j < bin; j++){
+      hx[i] += hxy[i * bin + j];
+      hy[j] += hxy[i * bin + j];
+    }
+  }
+  e1x = entropyFromHist(hx, bin, cnt);
+  e1y = entropyFromHist(hy, bin, cnt);
+  mi = e1x + e1y - entropyFromHist(hxy, bin * bin, cnt);
+  if(norm == 1){
+    mix = 2*e1x - entropyFromHist(hxx, bin * bin, cnt);
+    miy = 2*e1y - entropyFromHist(hyy, bin * bin, cnt);
+    largerMI = mix > miy ? mix:miy;
+    if(largerMI == 0) largerMI = 1;
+    mi /= largerMI;
+  }
+  if(negateMI == 1 && sumXY * cnt - sumX * sumY < 0) mi = -mi;
+  return mi;
+}
+
+/* the samples of idx[0 .. cnt) set in both masks go to out; returns how many */
+int maskedSamples(const unsigned long long *maskx, const unsigned long long *masky, const int *idx, int cnt, int *out){
+  int c, s, num = 0;
+  for(c = 0; c < cnt; c++){
+    s = idx[c];
+    if(maskx[s / 64] & masky[s / 64] & (1ULL << (s % 64))) out[num++] = s;
+  }
+  return num;
+}
+
+/* MI of x and y over the samples set in both masks, see sampleSetMI; a
+ * NULL mask stands for a vector without NaNs */
+double maskedPairMI(const int *bx, const double *wx, const int *by, const double *wy, const double *x, const double *y,
+                    const unsigned long long *maskx, const unsigned long long *masky, int n, int bin, int so, int norm, int negateMI){
+  int s, w, cnt = 0, words = MASK_WORDS(n);
+  unsigned long long both;
+  int *idx = (int*) calloc(n, sizeof(int));
+  double *hist = (double*) calloc(3 * bin * bin + 2 * bin, sizeof(double));
+  double mi;
+
+  for(w = 0; w < words; w++){
+    both = (maskx != NULL ? maskx[w] : ~0ULL) & (masky != NULL ? masky[w] : ~0ULL);
+    for(s = w * 64; both != 0 && s < n; s++, both >>= 1){
+      if(both & 1) idx[cnt++] = s;
+    }
+  }
+  mi = sampleSetMI(bx, wx, by, wy, x, y, idx, cnt, bin, so, norm, negateMI, hist);
+  free(idx);
+  free(hist);
+  return mi;
+}
+
+/* Runs fn over [0, numItems) in chunks of chunkSize, which numThreads workers
+ * pull from a shared counter. fn must only write results owned by its chunk,
+ * so the output does not depend on the number of threads. */
+typedef void (*rangeWorker)(void *ctx, int begin, int end);
+
+typedef struct {
+  rangeWorker fn;
+  void *ctx;
+  int numItems, chunkSize;
+  volatile int next;
+} parallelJob;
+
+static void *parallelLoop(void *arg){
+  parallelJob *job = (parallelJob*) arg;
+  int begin, end;
+
+  while((begin = __sync_fetch_and_add(&job->next, job->chunkSize)) < job->numItems){
+    end = begin + job->chunkSize < job->numItems ? begin + job->chunkSize : job->numItems;
+    job->fn(job->ctx, begin, end);
+  }
+  return NULL;
+}
+
+void parallelFor(rangeWorker fn, void *ctx, int numItems, int chunkSize, int numThreads){
+  parallelJob job;
+  pthread_t *threads;
+  int t, started = 0;
+
+  if(chunkSize < 1) chunkSize = 1;
+  if(numThreads > (numItems + chunkSize - 1) / chunkSize) numThreads = (numItems + chunkSize - 1) / chunkSize;
+  if(numThreads <= 1){
+    if(numItems > 0) fn(ctx, 0, numItems);
+    return;
+  }
+  job.fn = fn;
+  job.ctx = ctx;
+  job.numItems = numItems;
+  job.chunkSize = chunkSize;
+  job.next = 0;
+  threads = (pthread_t*) calloc(numThreads - 1, sizeof(pthread_t));
+  for(t = 0; t < numThreads - 1; t++){
+    if(pthread_create(&threads[t], NULL, parallelLoop, &job) != 0) break;
+    started++;
+  }
+  parallelLoop(&job); /* the calling thread works too */
+  for(t = 0; t < started; t++) pthread_join(threads[t], NULL);
+  free(threads);
+}
+
+//========================= export python function ===================================
+
+double mi2(const double *x, const double *y, int n, int bin, int so, int norm, int negateMI){
+  double *u = (double*) calloc(bin + so, sizeof(double));
+  int *bx = (int*) calloc(n, sizeof(int));
+  int *by = (int*) calloc(n, sizeof(int));
+  double *wx = (double*) calloc(so * n, sizeof(double));
+  double *wy = (double*) calloc(so * n, sizeof(double));
+  unsigned long long *maskx = (unsigned long long*) calloc(MASK_WORDS(n), sizeof(unsigned long long));
+  unsigned long long *masky = (unsigned long long*) calloc(MASK_WORDS(n), sizeof(unsigned long long));
+  double e1x, e1y, mix, miy, largerMI, mi;
+  int validx, validy;
+
+  knotVector(u, bin, so);
+  validx = findWeightsMasked(x, u, bx, wx, maskx, n, so, bin);
+  validy = findWeightsMasked(y, u, by, wy, masky, n, so, bin);
+  if(validx < n || validy < n){
+    mi = maskedPairMI(bx, wx, by, wy, x, y, maskx, masky, n, bin, so, norm, negateMI);
+  }else{
+    e1x = entropy1(bx, wx, n, bin, so);
+    e1y = entropy1(by, wy, n, bin, so);
+    mi = (e1x + e1y - entropy2(bx, wx, by, wy, n, bin, so));
+
+    if(norm == 1){
+      mix = 2*e1x - selfEntropy2(bx, wx, n, bin, so);
+      miy = 2*e1y - selfEntropy2(by, wy, n, bin, so);
+      largerMI = mix > miy ? mix:miy;
+      if(largerMI == 0) largerMI = 1;
+      mi /= largerMI;
+    }
+    if(negateMI == 1 && productMoment(x, y, n) < 0) mi = -mi;
+  }
+  free(bx);
+  free(by);
+  free(wx);
+  free(wy);
+  free(maskx);
+  free(masky);
+  free(u);
+  return mi;
+}
+
+double mi2DiffBins(const double *x, const double *y, int n, int binx, int biny, int sox, int soy, int norm, int negateMI){
+  double *ux = (double*) calloc(binx + sox, sizeof(double));
+  double *uy = (double*) calloc(biny + soy, sizeof(double));
+  int *bx = (int*) calloc(n, sizeof(int));
+  int *by = (int*) calloc(n, sizeof(int));
+  double *wx = (double*) calloc(sox * n, sizeof(double));
+  double *wy = (double*) calloc(soy * n, sizeof(double));
+  double e1x, e1y, mix, miy, largerMI, mi;
+
+  knotVector(ux, binx, sox);
+  knotVector(uy, biny, soy);
+  findWeightsSparse(x, ux, bx, wx, n, sox, binx, -1, -1);
+  findWeightsSparse(y, uy, by, wy, n, soy, biny, -1, -1);
+  e1x = entropy1(bx, wx, n, binx, sox);
+  e1y = entropy1(by, wy, n, biny, soy);
+  mi = (e1x + e1y - entropy2DiffBins(bx, wx, by, wy, n, binx, biny, sox, soy));
+
+  if(norm == 1){
+    mix = 2*e1x - selfEntropy2(bx, wx, n, binx, sox);
+    miy = 2*e1y - selfEntropy2(by, wy, n, biny, soy);
+    largerMI = mix > miy ? mix : miy;
+    if(largerMI == 0) largerMI = 1;
+    mi /= largerMI;
+  }
+  if(negateMI == 1 && productMoment(x, y, n) < 0) mi = -mi;
+  free(bx);
+  free(by);
+  free(wx);
+  free(wy);
+  free(ux);
+  free(uy);
+  return mi;
+}
+
+/* Selection of the best scoring rows: the topK highest scores with
+ * |score| >= minAbs, or every such score when topK is 0. Ties are broken by
+ * row index so the selected set does not depend on the order of pushes. */
+typedef struct {
+  double score;
+  int idx;
+} miHit;
+
+typedef struct {
+  miHit *hits;     /* min-heap on (score, -idx) while bounded */
+  int size, cap, topK;
+  double minAbs;
+  pthread_mutex_t lock;
+} miSelection;
+
+static int betterHit(const miHit *a, const miHit *b){
+  return a->score > b->score || (a->score == b->score && a->idx < b->idx);
+}
+
+void selectionInit(miSelection *sel, int topK, double minAbs){
+  sel->topK = topK > 0 ? topK : 0;
+  sel->cap = sel->topK > 0 ? sel->topK : 64;
+  sel->hits = (miHit*) calloc(sel->cap, sizeof(miHit));
+  sel->size = 0;
+  sel->minAbs = minAbs;
+  pthread_mutex_init(&sel->lock, NULL);
+}
+
+void selectionFree(miSelection *sel){
+  free(sel->hits);
+  pthread_mutex_destroy(&sel->lock);
+}
+
+/* not locked, see selectionPushAll */
+void selectionPush(miSelection *sel, int idx, double score){
+  miHit hit, tmp;
+  int i, c;
+
+  if(!(fabs(score) >= sel->minAbs)) return; /* also drops NaN */
+  hit.score = score;
+  hit.idx = idx;
+  if(sel->topK == 0){
+    if(sel->size == sel->cap){
+      sel->cap *= 2;
+      sel->hits = (miHit*) realloc(sel->hits, sel->cap * sizeof(miHit));
+    }
+    sel->hits[sel->size++] = hit;
+    return;
+  }
+  if(sel->size < sel->topK){
+    /* sift up */
+    i = sel->size++;
+    sel->hits[i] = hit;
+    while(i > 0 && betterHit(&sel->hits[(i - 1) / 2], &sel->hits[i])){
+      tmp = sel->hits[i];
+      sel->hits[i] = sel->hits[(i - 1) / 2];
+      sel->hits[(i - 1) / 2] = tmp;
+      i = (i - 1) / 2;
+    }
+    return;
+  }
+  if(!betterHit(&hit, &sel->hits[0])) return;
+  /* replace the worst kept hit and sift down */
+  sel->hits[0] = hit;
+  i = 0;
+  while((c = 2 * i + 1) < sel->size){
+    if(c + 1 < sel->size && betterHit(&sel->hits[c], &sel->hits[c + 1])) c++;
+    if(!betterHit(&sel->hits[i], &sel->hits[c])) break;
+    tmp = sel->hits[i];
+    sel->hits[i] = sel->hits[c];
+    sel->hits[c] = tmp;
+    i = c;
+  }
+}
+
+void selectionPushAll(miSelection *sel, const int *idx, const double *score, int num){
+  int i;
+
+  pthread_mutex_lock(&sel->lock);
+  for(i = 0; i < num; i++) selectionPush(sel, idx[i], score[i]);
+  pthread_mutex_unlock(&sel->lock);
+}
+
+static int compareHits(const void *a, const void *b){
+  if(betterHit((const miHit*) a, (const miHit*) b)) return -1;
+  if(betterHit((const miHit*) b, (const miHit*) a)) return 1;
+  return 0;
+}
+
+/* best first */
+void selectionSort(miSelection *sel){
+  qsort(sel->hits, sel->size, sizeof(miHit), compareHits);
+}
+
+/* state shared by the getAllMIWz workers; everything but mi/sel is read-only */
+typedef struct {
+  const double *data, *vec, *u, *wx;
+  const float *dataF, *wxF; /* float32 mode when dataF is not NULL */
+  const int *bx;
+  const unsigned long long *vecMask; /* observed samples of vec, vecValid of them */
+  int vecValid;
+  int missing;                       /* 0 when neither data nor vec has NaNs: rows skip the masks */
+  double *mi;
+  miSelection *sel;
+  int n, bin, so, norm, negateMI;
+  double e1x, mix;
+} allMIJob;
+
+/* rows handed to a getAllMIWz worker at a time */
+#define ALL_MI_CHUNK 16
+
+static void allMIRows(void *ctx, int begin, int end){
+  allMIJob *job = (allMIJob*) ctx;
+  int n = job->n, bin = job->bin, so = job->so;
+  int *by = (int*) calloc(n, sizeof(int));
+  double *wy = (double*) calloc(so * n, sizeof(double));
+  double *yd = NULL;
+  float *wyF = NULL;
+  const double *y = NULL;
+  const float *yF = NULL;
+  unsigned long long *yMask = (unsigned long long*) calloc(MASK_WORDS(n), sizeof(unsigned long long));
+  int i, masked, pending = 0, pendingIdx[ALL_MI_CHUNK];
+  double mi, e1y, miy, largerMI, pendingMI[ALL_MI_CHUNK];
+
+  if(job->dataF != NULL){
+    yd = (double*) calloc(n, sizeof(double));
+    wyF = (float*) calloc(so * n, sizeof(float));
+  }
+  for(i = begin; i < end; i++){
+    masked = 0;
+    if(job->dataF != NULL){
+      yF = job->dataF + (size_t) i * n;
+      findWeightsSparseF(yF, job->u, by, wyF, yd, wy, n, so, bin);
+      e1y = entropy1F(by, wyF, n, bin, so);
+      mi = (job->e1x + e1y - entropy2F(job->bx, job->wxF, by, wyF, n, bin, so));
+    }else{
+      y = job->data + (size_t) i * n;
+      if(job->missing && (findWeightsMasked(y, job->u, by, wy, yMask, n, so, bin) < n || job->vecValid < n)){
+        mi = maskedPairMI(job->bx, job->wx, by, wy, job->vec, y, job->vecMask, yMask, n, bin, so, job->norm, job->negateMI);
+        masked = 1;
+      }else{
+        if(!job->missing) findWeightsSparse(y, job->u, by, wy, n, so, bin, -1, -1);
+        e1y = entropy1(by, wy, n, bin, so);
+        mi = (job->e1x + e1y - entropy2(job->bx, job->wx, by, wy, n, bin, so));
+      }
+    }
+    if(job->norm == 1 && !masked){
+      largerMI = job->mix;
+      if(job->dataF != NULL) miy = 2*e1y - selfEntropy2F(by, wyF, n, bin, so);
+      else miy = 2*e1y - selfEntropy2(by, wy, n, bin, so);
+      if(miy > job->mix) largerMI = miy;
+      if(largerMI == 0) largerMI = 1;
+      mi /= largerMI;
+    }
+    if(job->negateMI==1 && !masked){
+      if(job->dataF != NULL){
+        if(productMomentF(yF, job->vec, n) < 0) mi = -mi;
+      }else if(productMoment(y, job->vec, n) < 0) mi = -mi;
+    }
+    if(job->mi != NULL) job->mi[i] = mi;
+    if(job->sel != NULL){
+      /* hand hits over a chunk at a time to keep the lock cold */
+      pendingIdx[pending] = i;
+      pendingMI[pending++] = mi;
+      if(pending == ALL_MI_CHUNK){
+        selectionPushAll(job->sel, pendingIdx, pendingMI, pending);
+        pending = 0;
+      }
+    }
+  }
+  if(pending > 0) selectionPushAll(job->sel, pendingIdx, pendingMI, pending);
+
+  free(by);
+  free(wy);
+  free(yd);
+  free(wyF);
+  free(yMask);
+}
+
+/* scores go to mi when it is not NULL, and to sel when that is not NULL */
+static void runAllMI(const double *data, const float *dataF, const double* vec, double *mi, miSelection *sel, int m, int n, int bin, int so, int norm, int negateMI, int nthreads){
+  double *u = (double*) calloc(bin + so, sizeof(double));
+  int *bx = (int*) calloc(n, sizeof(int));
+  double *wx = (double*) calloc(so * n, sizeof(double));
+  float *wxF = NULL;
+  unsigned long long *vecMask = (unsigned long long*) calloc(MASK_WORDS(n), sizeof(unsigned long long));
+  allMIJob job;
+
+  knotVector(u, bin, so);
+  job.vecValid = findWeightsMasked(vec, u, bx, wx, vecMask, n, so, bin);
+  job.vecMask = vecMask;
+  /* one scan of the matrix, as in prepareRows; the float32 rows are never masked */
+  job.missing = dataF == NULL && (job.vecValid < n || hasMissing(data, (size_t) m * n));
+  job.data = data;
+  job.dataF = dataF;
+  job.vec = vec;
+  job.u = u;
+  job.bx = bx;
+  job.wx = wx;
+  job.wxF = NULL;
+  job.mi = mi;
+  job.sel = sel;
+  job.n = n;
+  job.bin = bin;
+  job.so = so;
+  job.norm = norm;
+  job.negateMI = negateMI;
+  if(dataF != NULL){
+    /* vec is rounded like the rows so that the self terms stay consistent */
+    wxF = (float*) calloc(so * n, sizeof(float));
+    narrowWeights(wx, wxF, (size_t) so * n);
+    job.wxF = wxF;
+    job.e1x = entropy1F(bx, wxF, n, bin, so);
+    job.mix = 2*job.e1x - selfEntropy2F(bx, wxF, n, bin, so);
+  }else{
+    job.e1x = entropy1(bx, wx, n, bin, so);
+    job.mix = 2*job.e1x - selfEntropy2(bx, wx, n, bin, so);
+  }
+
+  parallelFor(allMIRows, &job, m, ALL_MI_CHUNK, nthreads);
+  if(sel != NULL) selectionSort(sel);
+
+  free(bx);
+  free(wx);
+  free(wxF);
+  free(vecMask);
+  free(u);
+}
+
+void getAllMIWz(double *data, const double* vec, double *mi, miSelection *sel, int m, int n, int bin, int so, int norm, int negateMI, int nthreads){
+  runAllMI(data, NULL, vec, mi, sel, m, n, bin, so, norm, negateMI, nthreads);
+}
+
+/* getAllMIWz over a float32 matrix with float32 weights, see narrowWeights */
+void getAllMIWzF(const float *data, const double* vec, double *mi, miSelection *sel, int m, int n, int bin, int so, int norm, int negateMI, int nthreads){
+  runAllMI(NULL, data, vec, mi, sel, m, n, bin, so, norm, negateMI, nthreads);
+}
+
+/* Weights and marginal terms of every row of a matrix, computed once and
+ * reused by every query against it. data is borrowed, not copied. */
+typedef struct {
+  int m, n, bin, so;
+  double *knots;
+  int *bins;       /* m x n first nonzero bins, see findWeightsSparse */
+  double *weights; /* m x n x so compact weights */
+  double *e1;      /* marginal entropy of each row */
+  double *selfMI;  /* 2*e1 - H(row, row), used to normalize */
+  const double *data;
+  float *weightsF;    /* float32 mode (prepareRowsF): these replace weights */
+  const float *dataF; /* and data, which are then NULL */
+  int borrowed;       /* bins, weights, e1 and selfMI belong to the caller, see preparedFromArrays */
+  unsigned long long *masks; /* m x MASK_WORDS(n) observed samples, NULL when no row has NaNs */
+  int *valid;                /* observed samples of each row, with masks */
+} preparedRows;
+
+/* Rows with NaNs keep findWeightsMasked weights; their e1 and selfMI only
+ * count the observed samples against n, so any pair involving one of them
+ * is scored by maskedPairMI, as getAllMIWz does. */
+static const unsigned long long *rowMask(const preparedRows *p, int i){
+  if(p->masks == NULL || p->valid[i] == p->n) return NULL;
+  return p->masks + (size_t) i * MASK_WORDS(p->n);
+}
+
+/* MI of row i of p and row j of q over their common samples */
+static double preparedPairMI(const preparedRows *p, int i, const preparedRows *q, int j, int norm, int negateMI){
+  int n = p->n, so = p->so;
+
+  return maskedPairMI(p->bins + (size_t) i * n, p->weights + (size_t) i * so * n, q->bins + (size_t) j * n, q->weights + (size_t) j * so * n,
+                      p->data + (size_t) i * n, q->data + (size_t) j * n, rowMask(p, i), rowMask(q, j), n, p->bin, so, norm, negateMI);
+}
+
+static void prepareRowRange(void *ctx, int begin, int end){
+  preparedRows *p = (preparedRows*) ctx;
+  int *b;
+  double *w;
+  int *bf;
+  float *wf;
+  double *xd, *wd;
+  int i;
+
+  if(p->weightsF != NULL){
+    xd = (double*) calloc(p->n, sizeof(double));
+    wd = (double*) calloc((size_t) p->so * p->n, sizeof(double));
+    for(i = begin; i < end; i++){
+      bf = p->bins + (size_t) i * p->n;
+      wf = p->weightsF + (size_t) i * p->so * p->n;
+      findWeightsSparseF(p->dataF + (size_t) i * p->n, p->knots, bf, wf, xd, wd, p->n, p->so, p->bin);
+      p->e1[i] = entropy1F(bf, wf, p->n, p->bin, p->so);
+      p->selfMI[i] = 2*p->e1[i] - selfEntropy2F(bf, wf, p->n, p->bin, p->so);
+    }
+    free(xd);
+    free(wd);
+    return;
+  }
+  for(i = begin; i < end; i++){
+    b = p->bins + (size_t) i * p->n;
+    w = p->weights + (size_t) i * p->so * p->n;
+    if(p->masks != NULL)
+      p->valid[i] = findWeightsMasked(p->data + (size_t) i * p->n, p->knots, b, w, p->masks + (size_t) i * MASK_WORDS(p->n), p->n, p->so, p->bin);
+    else
+      findWeightsSparse(p->data + (size_t) i * p->n, p->knots, b, w, p->n, p->so, p->bin, -1, -1);
+    p->e1[i] = entropy1(b, w, p->n, p->bin, p->so);
+    p->selfMI[i] = 2*p->e1[i] - selfEntropy2(b, w, p->n, p->bin, p->so);
+  }
+}
+
+preparedRows *prepareRows(const double *data, int m, int n, int bin, int so, int nthreads){
+  preparedRows *p = (preparedRows*) calloc(1, sizeof(preparedRows));
+
+  p->m = m;
+  p->n = n;
+  p->bin = bin;
+  p->so = so;
+  p->data = data;
+  p->knots = (double*) calloc(bin + so, sizeof(double));
+  p->bins = (int*) calloc((size_t) m * n, sizeof(int));
+  p->weights = (double*) calloc((size_t) m * so * n, sizeof(double));
+  p->e1 = (double*) calloc(m, sizeof(double));
+  p->selfMI = (double*) calloc(m, sizeof(double));
+  if(hasMissing(data, (size_t) m * n)){
+    p->masks = (unsigned long long*) calloc((size_t) m * MASK_WORDS(n), sizeof(unsigned long long));
+    p->valid = (int*) calloc(m, sizeof(int));
+  }
+  knotVector(p->knots, bin, so);
+  parallelFor(prepareRowRange, p, m, ALL_MI_CHUNK, nthreads);
+  return p;
+}
+
+/* prepareRows of a float32 matrix, keeping float32 weights; only
+ * preparedAllMI reads these */
+preparedRows *prepareRowsF(const float *data, int m, int n, int bin, int so, int nthreads){
+  preparedRows *p = (preparedRows*) calloc(1, sizeof(preparedRows));
+
+  p->m = m;
+  p->n = n;
+  p->bin = bin;
+  p->so = so;
+  p->dataF = data;
+  p->knots = (double*) calloc(bin + so, sizeof(double));
+  p->bins = (int*) calloc((size_t) m * n, sizeof(int));
+  p->weightsF = (float*) calloc((size_t) m * so * n, sizeof(float));
+  p->e1 = (double*) calloc(m, sizeof(double));
+  p->selfMI = (double*) calloc(m, sizeof(double));
+  knotVector(p->knots, bin, so);
+  parallelFor(prepareRowRange, p, m, ALL_MI_CHUNK, nthreads);
+  return p;
+}
+
+/* preparedRows over weights and marginal terms computed earlier, e.g.
+ * memory-mapped from a cache file; nothing is computed but the knots and
+ * the masks of rows with NaNs, and bins, weights (or weightsF), e1 and
+ * selfMI are borrowed, not freed */
+preparedRows *preparedFromArrays(const double *data, const float *dataF, int m, int n, int bin, int so,
+                                 int *bins, double *weights, float *weightsF, double *e1, double *selfMI){
+  preparedRows *p = (preparedRows*) calloc(1, sizeof(preparedRows));
+  int i;
+
+  p->m = m;
+  p->n = n;
+  p->bin = bin;
+  p->so = so;
+  p->data = data;
+  p->dataF = dataF;
+  p->knots = (double*) calloc(bin + so, sizeof(double));
+  p->bins = bins;
+  p->weights = weights;
+  p->weightsF = weightsF;
+  p->e1 = e1;
+  p->selfMI = selfMI;
+  p->borrowed = 1;
+  if(data != NULL && hasMissing(data, (size_t) m * n)){
+    p->masks = (unsigned long long*) calloc((size_t) m * MASK_WORDS(n), sizeof(unsigned long long));
+    p->valid = (int*) calloc(m, sizeof(int));
+    for(i = 0; i < m; i++) p->valid[i] = validMask(data + (size_t) i * n, n, p->masks + (size_t) i * MASK_WORDS(n));
+  }
+  knotVector(p->knots, bin, so);
+  return p;
+}
+
+void freePreparedRows(preparedRows *p){
+  if(p == NULL) return;
+  free(p->knots);
+  free(p->masks);
+  free(p->valid);
+  if(p->borrowed){
+    free(p);
+    return;
+  }
+  free(p->bins);
+  free(p->weights);
+  free(p->weightsF);
+  free(p->e1);
+  free(p->selfMI);
+  free(p);
+}
+
+/* state shared by the preparedAllMI workers */
+typedef struct {
+  const preparedRows *p;
+  const double *vec, *wx;
+  const float *wxF;
+  const int *bx;
+  const unsigned long long *vecMask; /* NULL when vec has no NaNs */
+  double *mi;
+  miSelection *sel;                  /* scores also go here when not NULL */
+  int norm, negateMI;
+  double e1x, mix;
+} preparedMIJob;
+
+static void preparedMIRows(void *ctx, int begin, int end){
+  preparedMIJob *job = (preparedMIJob*) ctx;
+  const preparedRows *p = job->p;
+  int i, n = p->n, pending = 0, pendingIdx[ALL_MI_CHUNK];
+  double mi, largerMI, pendingMI[ALL_MI_CHUNK];
+
+  for(i = begin; i < end; i++){
+    if(job->vecMask != NULL || rowMask(p, i) != NULL){
+      mi = maskedPairMI(job->bx, job->wx, p->bins + (size_t) i * n, p->weights + (size_t) i * p->so * n, job->vec, p->data + (size_t) i * n,
+                        job->vecMask, rowMask(p, i), n, p->bin, p->so, job->norm, job->negateMI);
+    }else{
+      if(p->weightsF != NULL)
+        mi = job->e1x + p->e1[i] - entropy2F(job->bx, job->wxF, p->bins + (size_t) i * n, p->weightsF + (size_t) i * p->so * n, n, p->bin, p->so);
+      else
+        mi = job->e1x + p->e1[i] - entropy2(job->bx, job->wx, p->bins + (size_t) i * n, p->weights + (size_t) i * p->so * n, n, p->bin, p->so);
+      if(job->norm == 1){
+        largerMI = p->selfMI[i] > job->mix ? p->selfMI[i] : job->mix;
+        if(largerMI == 0) largerMI = 1;
+        mi /= largerMI;
+      }
+      if(job->negateMI == 1){
+        if(p->dataF != NULL){
+          if(productMomentF(p->dataF + (size_t) i * n, job->vec, n) < 0) mi = -mi;
+        }else if(productMoment(p->data + (size_t) i * n, job->vec, n) < 0) mi = -mi;
+      }
+    }
+    if(job->mi != NULL) job->mi[i] = mi;
+    if(job->sel != NULL){
+      /* a chunk at a time, as in allMIRows */
+      pendingIdx[pending] = i;
+      pendingMI[pending++] = mi;
+      if(pending == ALL_MI_CHUNK){
+        selectionPushAll(job->sel, pendingIdx, pendingMI, pending);
+        pending = 0;
+      }
+    }
+  }
+  if(pending > 0) selectionPushAll(job->sel, pendingIdx, pendingMI, pending);
+}
+
+/* sets job up to score vec against the rows of p, release with preparedJobFree */
+static void preparedJobInit(preparedMIJob *job, const preparedRows *p, const double *vec, double *mi, int norm, int negateMI){
+  int *bx = (int*) calloc(p->n, sizeof(int));
+  double *wx = (double*) calloc(p->so * p->n, sizeof(double));
+  float *wxF = NULL;
+  unsigned long long *vecMask = NULL;
+
+  /* float32 rows have no masked path, their callers refuse NaNs */
+  if(p->weightsF == NULL && hasMissing(vec, p->n)){
+    vecMask = (unsigned long long*) calloc(MASK_WORDS(p->n), sizeof(unsigned long long));
+    findWeightsMasked(vec, p->knots, bx, wx, vecMask, p->n, p->so, p->bin);
+  }else
+    findWeightsSparse(vec, p->knots, bx, wx, p->n, p->so, p->bin, -1, -1);
+  job->p = p;
+  job->vecMask = vecMask;
+  job->sel = NULL;
+  job->vec = vec;
+  job->bx = bx;
+  job->wx = wx;
+  job->wxF = NULL;
+  job->mi = mi;
+  job->norm = norm;
+  job->negateMI = negateMI;
+  if(p->weightsF != NULL){
+    wxF = (float*) calloc(p->so * p->n, sizeof(float));
+    narrowWeights(wx, wxF, (size_t) p->so * p->n);
+    job->wxF = wxF;
+    job->e1x = entropy1F(bx, wxF, p->n, p->bin, p->so);
+    job->mix = 2*job->e1x - selfEntropy2F(bx, wxF, p->n, p->bin, p->so);
+  }else{
+    job->e1x = entropy1(bx, wx, p->n, p->bin, p->so);
+    job->mix = 2*job->e1x - selfEntropy2(bx, wx, p->n, p->bin, p->so);
+  }
+}
+
+static void preparedJobFree(preparedMIJob *job){
+  free((int*) job->bx);
+  free((double*) job->wx);
+  free((float*) job->wxF);
+  free((unsigned long long*) job->vecMask);
+}
+
+/* getAllMIWz against prepared rows: only the joint entropy is left per row.
+ * Scores go to mi when it is not NULL, and to sel when that is not NULL. */
+void preparedAllMI(const preparedRows *p, const double *vec, double *mi, miSelection *sel, int norm, int negateMI, int nthreads){
+  preparedMIJob job;
+
+  preparedJobInit(&job, p, vec, mi, norm, negateMI);
+  job.sel = sel;
+  parallelFor(preparedMIRows, &job, p->m, ALL_MI_CHUNK, nthreads);
+  if(sel != NULL) selectionSort(sel);
+  preparedJobFree(&job);
+}
+
+/* Attractor search: score every row against a metagene, replace the
+ * metagene by the average of the topK rows weighted by MI^exponent, and
+ * repeat until it moves by less than tol (relative, in the 2-norm). Rows
+ * stay prepared across iterations. Once an iteration keeps the top set,
+ * the next one only rescores rows within pruneMargin of the topK-th score.
+ * This is a heuristic, not a bound: a skipped row keeps its old score and
+ * could have moved into the top set. Convergence is only accepted on an
+ * iteration that scored every row, which catches such a row before the
+ * result is returned; pruning can cost extra iterations, or end at
+ * maxIter unconverged. */
+typedef struct {
+  preparedMIJob *job;
+  const int *rows;
+} candidateJob;
+
+static void candidateRows(void *ctx, int begin, int end){
+  candidateJob *cj = (candidateJob*) ctx;
+  int c;
+  for(c = begin; c < end; c++) preparedMIRows(cj->job, cj->rows[c], cj->rows[c] + 1);
+}
+
+static int compareInts(const void *a, const void *b){
+  return *(const int*) a - *(const int*) b;
+}
+
+/* metagene (n) starts from seed; mi (m) gets the last scores, and top /
+ * topMI (topK) the last top rows and their scores, best first, with -1 / 0
+ * past the rows that scored above 0. Returns 1 when converged; *iterations
+ * counts the scans. */
+int findAttractor(const preparedRows *p, const double *seed, double *metagene, double *mi, int *top, double *topMI, int topK, double exponent,
+                  double tol, int maxIter, double pruneMargin, int norm, int negateMI, int nthreads, int *iterations){
+  int m = p->m, n = p->n, i, k, s, it, numTop = 0, numCand = m, full = 1, same, converged = 0;
+  int *rows = (int*) calloc(m, sizeof(int));
+  int *prevTop = (int*) calloc(topK, sizeof(int));
+  double *next = (double*) calloc(n, sizeof(double));
+  double w, sumW, diff, norm2, cutoff;
+  miSelection sel;
+  preparedMIJob job;
+  candidateJob cj;
+
+  memcpy(metagene, seed, n * sizeof(double));
+  for(i = 0; i < m; i++) rows[i] = i;
+  for(k = 0; k < topK; k++) top[k] = -1;
+  for(it = 0; it < maxIter; it++){
+    preparedJobInit(&job, p, metagene, mi, norm, negateMI);
+    cj.job = &job;
+    cj.rows = rows;
+    parallelFor(candidateRows, &cj, numCand, ALL_MI_CHUNK, nthreads);
+    preparedJobFree(&job);
+
+    /* rows not rescored keep their last score */
+    selectionInit(&sel, topK, 0);
+    for(i = 0; i < m; i++){
+      if(mi[i] > 0) selectionPush(&sel, i, mi[i]);
+    }
+    selectionSort(&sel);
+    numTop = sel.size;
+    memcpy(prevTop, top, topK * sizeof(int));
+    for(k = 0; k < topK; k++){
+      top[k] = k < numTop ? sel.hits[k].idx : -1;
+      topMI[k] = k < numTop ? sel.hits[k].score : 0;
+    }
+    if(numTop == 0){
+      selectionFree(&sel);
+      it++;
+      break;
+    }
+
+    for(s = 0; s < n; s++) next[s] = 0;
+    sumW = 0;
+    for(k = 0; k < numTop; k++){
+      i = sel.hits[k].idx;
+      w = pow(sel.hits[k].score, exponent);
+      sumW += w;
+      if(p->dataF != NULL){
+        for(s = 0; s < n; s++) next[s] += w * p->dataF[(size_t) i * n + s];
+      }else{
+        for(s = 0; s < n; s++) next[s] += w * p->data[(size_t) i * n + s];
+      }
+    }
+    cutoff = sel.hits[numTop - 1].score;
+    selectionFree(&sel);
+    diff = 0;
+    norm2 = 0;
+    for(s = 0; s < n; s++){
+      next[s] /= sumW;
+      diff += (next[s] - metagene[s]) * (next[s] - metagene[s]);
+      norm2 += metagene[s] * metagene[s];
+    }
+    memcpy(metagene, next, n * sizeof(double));
+    if(diff <= tol * tol * norm2){
+      if(full){
+        converged = 1;
+        it++;
+        break;
+      }
+      /* confirm on every row */
+      full = 1;
+    }else{
+      qsort(prevTop, topK, sizeof(int), compareInts);
+      memcpy(rows, top, topK * sizeof(int));
+      qsort(rows, topK, sizeof(int), compareInts);
+      same = memcmp(rows, prevTop, topK * sizeof(int)) == 0;
+      full = !(same && pruneMargin > 0 && numTop == topK);
+    }
+
+    numCand = 0;
+    for(i = 0; i < m; i++){
+      if(full || mi[i] >= cutoff - pruneMargin) rows[numCand++] = i;
+    }
+  }
+  *iterations = it;
+
+  free(rows);
+  free(prevTop);
+  free(next);
+  return converged;
+}
+
+/* state shared by the findAttractors workers, one seed each */
+typedef struct {
+  const preparedRows *p;
+  const double *seeds;
+  double *metagenes, *topMI;
+  int *top, *converged, *iterations;
+  int topK, maxIter, norm, negateMI;
+  double exponent, tol, pruneMargin;
+} attractorJob;
+
+static void attractorSeeds(void *ctx, int begin, int end){
+  attractorJob *job = (attractorJob*) ctx;
+  const preparedRows *p = job->p;
+  double *mi = (double*) calloc(p->m, sizeof(double));
+  int i;
+
+  for(i = begin; i < end; i++){
+    job->converged[i] = findAttractor(p, job->seeds + (size_t) i * p->n, job->metagenes + (size_t) i * p->n, mi,
+                                      job->top + (size_t) i * job->topK, job->topMI + (size_t) i * job->topK, job->topK,
+                                      job->exponent, job->tol, job->maxIter, job->pruneMargin, job->norm, job->negateMI, 1,
+                                      job->iterations + i);
+  }
+  free(mi);
+}
+
+/* findAttractor from each of numSeeds seeds (numSeeds x n), seeds run in
+ * parallel; metagenes, top and topMI get one row per seed */
+void findAttractors(const preparedRows *p, const double *seeds, int numSeeds, double *metagenes, int *top, double *topMI, int *converged,
+                    int *iterations, int topK, double exponent, double tol, int maxIter, double pruneMargin, int norm, int negateMI, int nthreads){
+  attractorJob job;
+
+  job.p = p;
+  job.seeds = seeds;
+  job.metagenes = metagenes;
+  job.topMI = topMI;
+  job.top = top;
+  job.converged = converged;
+  job.iterations = iterations;
+  job.topK = topK;
+  job.maxIter = maxIter;
+  job.norm = norm;
+  job.negateMI = negateMI;
+  job.exponent = exponent;
+  job.tol = tol;
+  job.pruneMargin = pruneMargin;
+  parallelFor(attractorSeeds, &job, numSeeds, 1, nthreads);
+}
+
+/* MI of vec and every row within several sample subsets in one pass: a
+ * row's weights are found (or taken from prepared rows) once and only the
+ * histograms are summed per subset. Subset g is idx[offsets[g] .. offsets[g+1]),
+ * rows keep the scaling of all their samples, and NaNs are handled as in
+ * maskedPairMI. */
+typedef struct {
+  const preparedRows *p;  /* weights come from here when not NULL, else from data */
+  const double *data, *vec, *knots, *wx;
+  const int *bx;
+  const unsigned long long *vecMask;
+  const int *idx, *offsets;
+  double *mi;             /* m x groups */
+  int n, bin, so, groups, vecValid, norm, negateMI;
+} subsetJob;
+
+static void subsetRows(void *ctx, int begin, int end){
+  subsetJob *job = (subsetJob*) ctx;
+  int n = job->n, bin = job->bin, so = job->so;
+  int *by = NULL, *sel = (int*) calloc(n, sizeof(int));
+  double *wy = NULL, *hist = (double*) calloc(3 * bin * bin + 2 * bin, sizeof(double));
+  unsigned long long *yMask = (unsigned long long*) calloc(MASK_WORDS(n), sizeof(unsigned long long));
+  const unsigned long long *rowObserved = yMask;
+  const int *b, *idx;
+  const double *w, *y;
+  int i, g, cnt, full;
+
+  if(job->p == NULL){
+    by = (int*) calloc(n, sizeof(int));
+    wy = (double*) calloc(so * n, sizeof(double));
+  }else{
+    /* for prepared rows without NaNs */
+    memset(yMask, 0xff, MASK_WORDS(n) * sizeof(unsigned long long));
+  }
+  for(i = begin; i < end; i++){
+    if(job->p != NULL){
+      y = job->p->data + (size_t) i * n;
+      b = job->p->bins + (size_t) i * n;
+      w = job->p->weights + (size_t) i * so * n;
+      rowObserved = rowMask(job->p, i) != NULL ? rowMask(job->p, i) : yMask;
+      full = job->vecValid == n && rowMask(job->p, i) == NULL;
+    }else{
+      y = job->data + (size_t) i * n;
+      full = findWeightsMasked(y, job->knots, by, wy, yMask, n, so, bin) == n && job->vecValid == n;
+      b = by;
+      w = wy;
+    }
+    for(g = 0; g < job->groups; g++){
+      idx = job->idx + job->offsets[g];
+      cnt = job->offsets[g + 1] - job->offsets[g];
+      if(!full){
+        cnt = maskedSamples(job->vecMask, rowObserved, idx, cnt, sel);
+        idx = sel;
+      }
+      job->mi[(size_t) i * job->groups + g] = sampleSetMI(job->bx, job->wx, b, w, job->vec, y, idx, cnt, bin, so, job->norm, job->negateMI, hist);
+    }
+  }
+  free(by);
+  free(wy);
+  free(sel);
+  free(hist);
+  free(yMask);
+}
+
+/* with p, data / m / n / bin / so are taken from it */
+void subsetAllMI(const preparedRows *p, const double *data, const double *vec, const int *idx, const int *offsets, int groups,
+                 double *mi, int m, int n, int bin, int so, int norm, int negateMI, int nthreads){
+  double *u = NULL;
+  int *bx;
+  double *wx;
+  unsigned long long *vecMask;
+  subsetJob job;
+
+  if(p != NULL){
+    m = p->m;
+    n = p->n;
+    bin = p->bin;
+    so = p->so;
+    job.knots = p->knots;
+  }else{
+    u = (double*) calloc(bin + so, sizeof(double));
+    knotVector(u, bin, so);
+    job.knots = u;
+  }
+  bx = (int*) calloc(n, sizeof(int));
+  wx = (double*) calloc(so * n, sizeof(double));
+  vecMask = (unsigned long long*) calloc(MASK_WORDS(n), sizeof(unsigned long long));
+  job.vecValid = findWeightsMasked(vec, job.knots, bx, wx, vecMask, n, so, bin);
+  job.p = p;
+  job.data = data;
+  job.vec = vec;
+  job.bx = bx;
+  job.wx = wx;
+  job.vecMask = vecMask;
+  job.idx = idx;
+  job.offsets = offsets;
+  job.mi = mi;
+  job.n = n;
+  job.bin = bin;
+  job.so = so;
+  job.groups = groups;
+  job.norm = norm;
+  job.negateMI = negateMI;
+
+  parallelFor(subsetRows, &job, m, ALL_MI_CHUNK, nthreads);
+
+  free(bx);
+  free(wx);
+  free(vecMask);
+  free(u);
+}
+
+/* Scoring k queries against m rows: each (query, row) histogram is the
+ * product Wq . Wr' over samples. A query is scored against a tile of
+ * BATCH_ROW_TILE rows at once, so each sample's query weights are loaded
+ * into registers once and reused for every row of the tile, and the tile's
+ * row weights stay in cache while all k queries stream past them. */
+#define BATCH_ROW_TILE 4
+
+/* hist[rr] += outer products of the query's and row rr's weights, for samples [0, n) */
+#define BATCH_KERNEL(SO) \
+static void batchKernel##SO(const int *bq, const double *wq, const int **br, const double **wr, double **hist, int nr, int n, int bin){ \
+  int s, rr, kx, ky; \
+  double a[SO], *row[SO]; \
+  const double *b; \
+  for(s = 0; s < n; s++){ \
+    for(kx = 0; kx < SO; kx++) a[kx] = wq[s * SO + kx]; \
+    for(rr = 0; rr < nr; rr++){ \
+      /* separate row pointers let the compiler see the updates are independent */ \
+      row[0] = hist[rr] + bq[s] * bin + br[rr][s]; \
+      for(kx = 1; kx < SO; kx++) row[kx] = row[kx - 1] + bin; \
+      b = wr[rr] + s * SO; \
+      for(kx = 0; kx < SO; kx++){ \
+        for(ky = 0; ky < SO; ky++) row[kx][ky] += a[kx] * b[ky]; \
+      } \
+    } \
+  } \
+}
+BATCH_KERNEL(2)
+BATCH_KERNEL(3)
+BATCH_KERNEL(4)
+
+static void batchKernel(const int *bq, const double *wq, const int **br, const double **wr, double **hist, int nr, int n, int bin, int so){
+  int rr;
+
+  switch(so){
+    case 2: batchKernel2(bq, wq, br, wr, hist, nr, n, bin); return;
+    case 3: batchKernel3(bq, wq, br, wr, hist, nr, n, bin); return;
+    case 4: batchKernel4(bq, wq, br, wr, hist, nr, n, bin); return;
+  }
+  for(rr = 0; rr < nr; rr++) jointHist(bq, wq, br[rr], wr[rr], hist[rr], n, bin, so);
+}
+
+typedef struct {
+  const preparedRows *p, *q;
+  double *mi;
+  int norm, negateMI;
+} batchMIJob;
+
+static void batchMIRows(void *ctx, int begin, int end){
+  batchMIJob *job = (batchMIJob*) ctx;
+  const preparedRows *p = job->p, *q = job->q;
+  int n = p->n, so = p->so, bin = p->bin, cells = bin * bin;
+  int k = q->m, m = p->m;
+  double *hists = (double*) calloc(BATCH_ROW_TILE * cells, sizeof(double));
+  double *hist[BATCH_ROW_TILE];
+  const int *br[BATCH_ROW_TILE];
+  const double *wr[BATCH_ROW_TILE];
+  double v, largerMI;
+  int r0, nr, rr, r, qi, c;
+
+  for(rr = 0; rr < BATCH_ROW_TILE; rr++) hist[rr] = hists + rr * cells;
+
+  for(r0 = begin; r0 < end; r0 += BATCH_ROW_TILE){
+    nr = end - r0 < BATCH_ROW_TILE ? end - r0 : BATCH_ROW_TILE;
+    for(rr = 0; rr < nr; rr++){
+      br[rr] = p->bins + (size_t) (r0 + rr) * n;
+      wr[rr] = p->weights + (size_t) (r0 + rr) * n * so;
+    }
+    for(qi = 0; qi < k; qi++){
+      for(c = 0; c < nr * cells; c++) hists[c] = 0;
+      batchKernel(q->bins + (size_t) qi * n, q->weights + (size_t) qi * n * so, br, wr, hist, nr, n, bin, so);
+
+      for(rr = 0; rr < nr; rr++){
+        r = r0 + rr;
+        if(rowMask(q, qi) != NULL || rowMask(p, r) != NULL){
+          job->mi[(size_t) qi * m + r] = preparedPairMI(q, qi, p, r, job->norm, job->negateMI);
+          continue;
+        }
+        v = q->e1[qi] + p->e1[r] - entropyFromHist(hist[rr], cells, n);
+        if(job->norm == 1){
+          largerMI = p->selfMI[r] > q->selfMI[qi] ? p->selfMI[r] : q->selfMI[qi];
+          if(largerMI == 0) largerMI = 1;
+          v /= largerMI;
+        }
+        if(job->negateMI == 1 && productMoment(p->data + (size_t) r * n, q->data + (size_t) qi * n, n) < 0) v = -v;
+        job->mi[(size_t) qi * m + r] = v;
+      }
+    }
+  }
+  free(hists);
+}
+
+/* mi is k x m, row qi holding the scores of query qi against every row of p */
+void preparedAllMIBatch(const preparedRows *p, const preparedRows *q, double *mi, int norm, int negateMI, int nthreads){
+  batchMIJob job;
+
+  job.p = p;
+  job.q = q;
+  job.mi = mi;
+  job.norm = norm;
+  job.negateMI = negateMI;
+
+  parallelFor(batchMIRows, &job, p->m, BATCH_ROW_TILE * ALL_MI_CHUNK, nthreads);
+}
+
+/* rows of weights processed together in getAllPairsMI; two tiles should sit in L2 */
+#define PAIR_TILE_BYTES (1 << 18)
+
+/* state shared by the getAllPairsMI workers, which take a tile of rows each */
+typedef struct {
+  const preparedRows *p;
+  double *mi;
+  int tile, norm, negateMI;
+} pairsJob;
+
+static void pairTiles(void *ctx, int begin, int end){
+  pairsJob *job = (pairsJob*) ctx;
+  const preparedRows *p = job->p;
+  int m = p->m, n = p->n, so = p->so, tile = job->tile;
+  const int *bx, *by;
+  const double *wx, *wy;
+  int i, j, t, ti, tj, iEnd, jEnd;
+  double v, largerMI, *mi = job->mi;
+
+  /* tile ti against every tile from ti on, upper triangle only, mirrored;
+   * each pair is written by exactly one tile */
+  for(t = begin; t < end; t++){
+    ti = t * tile;
+    iEnd = ti + tile < m ? ti + tile : m;
+    for(tj = ti; tj < m; tj += tile){
+      jEnd = tj + tile < m ? tj + tile : m;
+      for(i = ti; i < iEnd; i++){
+        bx = p->bins + (size_t) i * n;
+        wx = p->weights + (size_t) i * so * n;
+        for(j = (tj > i ? tj : i); j < jEnd; j++){
+          by = p->bins + (size_t) j * n;
+          wy = p->weights + (size_t) j * so * n;
+          if(rowMask(p, i) != NULL || rowMask(p, j) != NULL){
+            v = preparedPairMI(p, i, p, j, job->norm, job->negateMI);
+            mi[(size_t) i * m + j] = v;
+            mi[(size_t) j * m + i] = v;
+            continue;
+          }
+          v = p->e1[i] + p->e1[j] - entropy2(bx, wx, by, wy, n, p->bin, so);
+          if(job->norm == 1){
+            largerMI = p->selfMI[i] > p->selfMI[j] ? p->selfMI[i] : p->selfMI[j];
+            if(largerMI == 0) largerMI = 1;
+            v /= largerMI;
+          }
+          if(job->negateMI == 1 && productMoment(p->data + (size_t) i * n, p->data + (size_t) j * n, n) < 0) v = -v;
+          mi[(size_t) i * m + j] = v;
+          mi[(size_t) j * m + i] = v;
+        }
+      }
+    }
+  }
+}
+
+void getAllPairsMI(const preparedRows *p, double *mi, int norm, int negateMI, int nthreads){
+  pairsJob job;
+
+  job.p = p;
+  job.mi = mi;
+  job.norm = norm;
+  job.negateMI = negateMI;
+  job.tile = PAIR_TILE_BYTES / (2 * p->n * (p->so * (int) sizeof(double) + (int) sizeof(int)));
+  if(job.tile < 1) job.tile = 1;
+  /* early tiles carry the most pairs, so they are handed out one at a time */
+  parallelFor(pairTiles, &job, (p->m + job.tile - 1) / job.tile, 1, nthreads);
+}
+
+/* Sparse MI network, ARACNE style: every pair of prepared rows is scored as
+ * in getAllPairsMI, but only edges with |MI| >= threshold are kept, so memory
+ * grows with the number of edges rather than m^2. The edges are then pruned
+ * by the data processing inequality: edge (i, j) goes when some k linked to
+ * both has |MI(i, j)| < (1 - tolerance) min(|MI(i, k)|, |MI(j, k)|). Every
+ * decision reads the unpruned network, so the result does not depend on the
+ * order edges are visited in, nor on the number of threads. */
+typedef struct {
+  int *nbr;    /* j > i, ascending */
+  double *mi;
+  int size, cap;
+} netRow;
+
+typedef struct {
+  const preparedRows *p;
+  netRow *rows;
+  double threshold;
+  int norm, negateMI;
+} netJob;
+
+static void netScoreRows(void *ctx, int begin, int end){
+  netJob *job = (netJob*) ctx;
+  const preparedRows *p = job->p;
+  int i, j, m = p->m, n = p->n, so = p->so;
+  double v, largerMI;
+  netRow *r;
+
+  for(i = begin; i < end; i++){
+    r = job->rows + i;
+    for(j = i + 1; j < m; j++){
+      if(rowMask(p, i) != NULL || rowMask(p, j) != NULL){
+        /* signed already, the threshold is on |MI| either way */
+        v = preparedPairMI(p, i, p, j, job->norm, job->negateMI);
+        if(!(fabs(v) >= job->threshold)) continue;
+      }else{
+        v = p->e1[i] + p->e1[j] - entropy2(p->bins + (size_t) i * n, p->weights + (size_t) i * so * n,
+                                           p->bins + (size_t) j * n, p->weights + (size_t) j * so * n, n, p->bin, so);
+        if(job->norm == 1){
+          largerMI = p->selfMI[i] > p->selfMI[j] ? p->selfMI[i] : p->selfMI[j];
+          if(largerMI == 0) largerMI = 1;
+          v /= largerMI;
+        }
+        if(!(fabs(v) >= job->threshold)) continue;
+        if(job->negateMI == 1 && productMoment(p->data + (size_t) i * n, p->data + (size_t) j * n, n) < 0) v = -v;
+      }
+      if(r->size == r->cap){
+        r->cap = r->cap ? 2 * r->cap : 16;
+        r->nbr = (int*) realloc(r->nbr, r->cap * sizeof(int));
+        r->mi = (double*) realloc(r->mi, r->cap * sizeof(double));
+      }
+      r->nbr[r->size] = j;
+      r->mi[r->size++] = v;
+    }
+  }
+}
+
+/* the network as symmetric CSR: neighbors of i are nbr[offsets[i] .. offsets[i+1]), ascending */
+typedef struct {
+  int m;
+  long long *offsets;
+  int *nbr;
+  double *mi;
+  char *keep; /* DPI verdict, set on the j > i entries */
+} miNetwork;
+
+typedef struct {
+  miNetwork *net;
+  double tolerance;
+} dpiJob;
+
+static void dpiRows(void *ctx, int begin, int end){
+  dpiJob *job = (dpiJob*) ctx;
+  miNetwork *net = job->net;
+  long long e, a, b, aEnd, bEnd;
+  int i, j;
+  double mij;
+
+  for(i = begin; i < end; i++){
+    for(e = net->offsets[i]; e < net->offsets[i + 1]; e++){
+      j = net->nbr[e];
+      if(j < i) continue;
+      mij = fabs(net->mi[e]);
+      /* walk the common neighbors k of i and j */
+      a = net->offsets[i];
+      aEnd = net->offsets[i + 1];
+      b = net->offsets[j];
+      bEnd = net->offsets[j + 1];
+      while(a < aEnd && b < bEnd){
+        if(net->nbr[a] < net->nbr[b]) a++;
+        else if(net->nbr[a] > net->nbr[b]) b++;
+        else{
+          if(mij < (1 - job->tolerance) * fabs(net->mi[a]) && mij < (1 - job->tolerance) * fabs(net->mi[b])){
+            net->keep[e] = 0;
+            break;
+          }
+          a++;
+          b++;
+        }
+      }
+    }
+  }
+}
+
+/* Builds the network of p's rows; with dpi the weaker edge of each
+ * triangle is pruned, see above. Release with freeMINetwork; the kept
+ * edges are read a block of rows at a time with networkEdges. */
+miNetwork *buildMINetwork(const preparedRows *p, double threshold, int dpi, double tolerance, int norm, int negateMI, int nthreads){
+  int m = p->m, i, k;
+  long long e, numEdges = 0, *fill;
+  netRow *rows = (netRow*) calloc(m, sizeof(netRow));
+  netJob job;
+  dpiJob dj;
+  miNetwork *net = (miNetwork*) calloc(1, sizeof(miNetwork));
+
+  job.p = p;
+  job.rows = rows;
+  job.threshold = threshold;
+  job.norm = norm;
+  job.negateMI = negateMI;
+  parallelFor(netScoreRows, &job, m, 1, nthreads);
+
+  /* symmetric CSR: lower neighbors arrive in ascending order, then the upper ones */
+  net->m = m;
+  net->offsets = (long long*) calloc(m + 1, sizeof(long long));
+  for(i = 0; i < m; i++){
+    numEdges += rows[i].size;
+    net->offsets[i + 1] += rows[i].size;
+    for(k = 0; k < rows[i].size; k++) net->offsets[rows[i].nbr[k] + 1]++;
+  }
+  for(i = 0; i < m; i++) net->offsets[i + 1] += net->offsets[i];
+  net->nbr = (int*) malloc(2 * numEdges * sizeof(int) + 1);
+  net->mi = (double*) malloc(2 * numEdges * sizeof(double) + 1);
+  net->keep = (char*) malloc(2 * numEdges + 1);
+  memset(net->keep, 1, 2 * numEdges + 1);
+  fill = (long long*) malloc(m * sizeof(long long) + 1);
+  for(i = 0; i < m; i++) fill[i] = net->offsets[i];
+  /* rows before i have placed all of i's lower neighbors, so its own list
+   * goes right after them and can be freed at once */
+  for(i = 0; i < m; i++){
+    for(k = 0; k < rows[i].size; k++){
+      e = fill[rows[i].nbr[k]]++;
+      net->nbr[e] = i;
+      net->mi[e] = rows[i].mi[k];
+    }
+    memcpy(net->nbr + fill[i], rows[i].nbr, rows[i].size * sizeof(int));
+    memcpy(net->mi + fill[i], rows[i].mi, rows[i].size * sizeof(double));
+    free(rows[i].nbr);
+    free(rows[i].mi);
+  }
+  free(rows);
+  free(fill);
+
+  if(dpi){
+    dj.net = net;
+    dj.tolerance = tolerance;
+    parallelFor(dpiRows, &dj, m, 1, nthreads);
+  }
+  return net;
+}
+
+/* kept edges (i, j), i < j, of rows begin <= i < end, ordered by i then j,
+ * go to src, dst and mi when not NULL; returns their number */
+long long networkEdges(const miNetwork *net, int begin, int end, int *src, int *dst, double *mi){
+  long long e, kept = 0;
+  int i;
+
+  for(i = begin; i < end; i++){
+    for(e = net->offsets[i]; e < net->offsets[i + 1]; e++){
+      if(net->nbr[e] < i || !net->keep[e]) continue;
+      if(src != NULL){
+        src[kept] = i;
+        dst[kept] = net->nbr[e];
+        mi[kept] = net->mi[e];
+      }
+      kept++;
+    }
+  }
+  return kept;
+}
+
+void freeMINetwork(miNetwork *net){
+  if(net == NULL) return;
+  free(net->offsets);
+  free(net->nbr);
+  free(net->mi);
+  free(net->keep);
+  free(net);
+}
+
+/* Permutation tests. Shuffling the samples of one vector only reorders its
+ * weights, so the marginal entropies and the normalizer stay those of the
+ * observed pair and MI_perm >= MI_obs reduces to H2_perm <= H2_obs: only the
+ * joint entropy is recomputed. Permutation k is drawn from its own splitmix64
+ * stream of (seed, k), and permutations run in rounds of PERM_ROUND; after a
+ * round a test stops once its p-value can no longer come out at or below
+ * alpha. Results therefore do not depend on the number of threads. */
+#define PERM_ROUND 64
+#define PERM_EPS 1e-10
+
+static unsigned long long splitmix64(unsigned long long *state){
+  unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/* bp, wp = b, w with the samples in the order of permutation k (Fisher-Yates) */
+void permutedWeights(const int *b, const double *w, int *bp, double *wp, int *perm, int n, int so, unsigned long long seed, int k){
+  unsigned long long state = seed * 0xD1B54A32D192ED03ULL + (unsigned long long) k;
+  int i, j, t;
+
+  for(i = 0; i < n; i++) perm[i] = i;
+  for(i = n - 1; i > 0; i--){
+    j = (int) (splitmix64(&state) % (unsigned long long) (i + 1));
+    t = perm[i];
+    perm[i] = perm[j];
+    perm[j] = t;
+  }
+  for(i = 0; i < n; i++){
+    bp[i] = b[perm[i]];
+    for(j = 0; j < so; j++) wp[i * so + j] = w[perm[i] * so + j];
+  }
+}
+
+/* state shared by the miPermutationTest workers, one round at a time */
+typedef struct {
+  const int *bx, *by;
+  const double *wx, *wy;
+  int n, bin, so, first;
+  unsigned long long seed;
+  double h2;
+  int *hit;   /* hit[k] = 1 if permutation first + k is at least as extreme */
+} permJob;
+
+static void permRange(void *ctx, int begin, int end){
+  permJob *job = (permJob*) ctx;
+  int n = job->n, so = job->so, k;
+  int *perm = (int*) calloc(n, sizeof(int));
+  int *bp = (int*) calloc(n, sizeof(int));
+  double *wp = (double*) calloc(so * n, sizeof(double));
+
+  for(k = begin; k < end; k++){
+    permutedWeights(job->by, job->wy, bp, wp, perm, n, so, job->seed, job->first + k);
+    job->hit[k] = entropy2(job->bx, job->wx, bp, wp, n, job->bin, so) <= job->h2 + PERM_EPS;
+  }
+  free(perm);
+  free(bp);
+  free(wp);
+}
+
+/* moves the weights of the samples set in both masks to the front, in
+ * order; returns how many there are */
+static int commonSamples(int *bx, double *wx, int *by, double *wy, const unsigned long long *maskx, const unsigned long long *masky,
+                         int n, int so){
+  int s, k, cnt = 0;
+
+  for(s = 0; s < n; s++){
+    if(!(maskx[s / 64] & masky[s / 64] & (1ULL << (s % 64)))) continue;
+    bx[cnt] = bx[s];
+    by[cnt] = by[s];
+    for(k = 0; k < so; k++){
+      wx[cnt * so + k] = wx[s * so + k];
+      wy[cnt * so + k] = wy[s * so + k];
+    }
+    cnt++;
+  }
+  return cnt;
+}
+
+/* mi2 of x and y, and in *pOut the permutation p-value (1 + hits) / (1 + permutations).
+ * With NaNs only the samples observed in both are permuted, with the weights
+ * mi2 scores them with. Returns the number of permutations run, less than
+ * nperm when stopped early. */
+int miPermutationTest(const double *x, const double *y, int n, int bin, int so, int norm, int negateMI,
+                      int nperm, unsigned long long seed, double alpha, int nthreads, double *miOut, double *pOut){
+  double *u = (double*) calloc(bin + so, sizeof(double));
+  int *bx = (int*) calloc(n, sizeof(int));
+  int *by = (int*) calloc(n, sizeof(int));
+  double *wx = (double*) calloc(so * n, sizeof(double));
+  double *wy = (double*) calloc(so * n, sizeof(double));
+  unsigned long long *maskx = (unsigned long long*) calloc(MASK_WORDS(n), sizeof(unsigned long long));
+  unsigned long long *masky = (unsigned long long*) calloc(MASK_WORDS(n), sizeof(unsigned long long));
+  int hit[PERM_ROUND];
+  int k, r, validx, validy, done = 0, count = 0;
+  permJob job;
+
+  *miOut = mi2(x, y, n, bin, so, norm, negateMI);
+  knotVector(u, bin, so);
+  validx = findWeightsMasked(x, u, bx, wx, maskx, n, so, bin);
+  validy = findWeightsMasked(y, u, by, wy, masky, n, so, bin);
+  if(validx < n || validy < n) n = commonSamples(bx, wx, by, wy, maskx, masky, n, so);
+  if(n == 0) nperm = 0;
+  job.bx = bx;
+  job.by = by;
+  job.wx = wx;
+  job.wy = wy;
+  job.n = n;
+  job.bin = bin;
+  job.so = so;
+  job.seed = seed;
+  job.h2 = entropy2(bx, wx, by, wy, n, bin, so);
+  job.hit = hit;
+
+  while(done < nperm){
+    r = nperm - done < PERM_ROUND ? nperm - done : PERM_ROUND;
+    job.first = done;
+    parallelFor(permRange, &job, r, 1, nthreads);
+    for(k = 0; k < r; k++) count += hit[k];
+    done += r;
+    if(alpha > 0 && count + 1 > alpha * (nperm + 1)) break;
+  }
+  *pOut = (count + 1.0) / (done + 1.0);
+
+  free(bx);
+  free(by);
+  free(wx);
+  free(wy);
+  free(maskx);
+  free(masky);
+  free(u);
+  return done;
+}
+
+/* state shared by the preparedAllMIPermutation workers */
+typedef struct {
+  const preparedRows *p;
+  const int *bq;      /* nq permuted query weights, or the observed query when computing h2 */
+  const double *wq;
+  int nq;
+  double *h2;         /* observed joint entropy of each row */
+  int *count;
+  char *active;
+} permRowsJob;
+
+static void permObservedRows(void *ctx, int begin, int end){
+  permRowsJob *job = (permRowsJob*) ctx;
+  const preparedRows *p = job->p;
+  int i;
+
+  for(i = begin; i < end; i++)
+    job->h2[i] = entropy2(job->bq, job->wq, p->bins + (size_t) i * p->n, p->weights + (size_t) i * p->so * p->n, p->n, p->bin, p->so);
+}
+
+static void permRows(void *ctx, int begin, int end){
+  permRowsJob *job = (permRowsJob*) ctx;
+  const preparedRows *p = job->p;
+  int i, k, n = p->n, so = p->so;
+
+  for(i = begin; i < end; i++){
+    if(!job->active[i]) continue;
+    for(k = 0; k < job->nq; k++){
+      if(entropy2(job->bq + (size_t) k * n, job->wq + (size_t) k * so * n, p->bins + (size_t) i * n, p->weights + (size_t) i * so * n,
+                  n, p->bin, so) <= job->h2[i] + PERM_EPS)
+        job->count[i]++;
+    }
+  }
+}
+
+/* preparedAllMI plus a permutation p-value for every row. The query is
+ * permuted, with the same permutations for every row, so each round's
+ * permuted weights are computed once; rows stop independently as in
+ * miPermutationTest, and nperms[i] is the number run for row i. */
+void preparedAllMIPermutation(const preparedRows *p, const double *vec, double *mi, double *pval, int *nperms,
+                              int nperm, unsigned long long seed, double alpha, int norm, int negateMI, int nthreads){
+  int m = p->m, n = p->n, so = p->so;
+  int *bx = (int*) calloc(n, sizeof(int));
+  double *wx = (double*) calloc(so * n, sizeof(double));
+  int *perm = (int*) calloc(n, sizeof(int));
+  int *bq = (int*) calloc((size_t) PERM_ROUND * n, sizeof(int));
+  double *wq = (double*) calloc((size_t) PERM_ROUND * so * n, sizeof(double));
+  double *h2 = (double*) calloc(m, sizeof(double));
+  int *count = (int*) calloc(m, sizeof(int));
+  char *active = (char*) calloc(m, sizeof(char));
+  int i, k, r, done = 0, left = m;
+  permRowsJob job;
+
+  preparedAllMI(p, vec, mi, NULL, norm, negateMI, nthreads);
+  findWeightsSparse(vec, p->knots, bx, wx, n, so, p->bin, -1, -1);
+  job.p = p;
+  job.bq = bx;
+  job.wq = wx;
+  job.h2 = h2;
+  job.count = count;
+  job.active = active;
+  parallelFor(permObservedRows, &job, m, ALL_MI_CHUNK, nthreads);
+
+  for(i = 0; i < m; i++){
+    active[i] = 1;
+    nperms[i] = 0;
+  }
+  job.bq = bq;
+  job.wq = wq;
+  while(done < nperm && left > 0){
+    r = nperm - done < PERM_ROUND ? nperm - done : PERM_ROUND;
+    for(k = 0; k < r; k++)
+      permutedWeights(bx, wx, bq + (size_t) k * n, wq + (size_t) k * so * n, perm, n, so, seed, done + k);
+    job.nq = r;
+    parallelFor(permRows, &job, m, ALL_MI_CHUNK, nthreads);
+    done += r;
+    for(i = 0; i < m; i++){
+      if(!active[i]) continue;
+      nperms[i] = done;
+      if(alpha > 0 && count[i] + 1 > alpha * (nperm + 1)){
+        active[i] = 0;
+        left--;
+      }
+    }
+  }
+  for(i = 0; i < m; i++) pval[i] = (count[i] + 1.0) / (nperms[i] + 1.0);
+
+  free(bx);
+  free(wx);
+  free(perm);
+  free(bq);
+  free(wq);
+  free(h2);
+  free(count);
+  free(active);
+}
+
+/* Three-way terms. mi3 is the interaction information
+ *   I(x;y;z) = H(x,y,z) - H(x,y) - H(x,z) - H(y,z) + H(x) + H(y) + H(z)
+ * and mi2vs1 the MI between the pair (x, y) and z,
+ *   I(x,y;z) = H(x,y) + H(z) - H(x,y,z),
+ * normalized like mi2 by the larger self-MI of (x, y) and z. Both are read
+ * off one sparse three-way histogram, the pairwise terms with z being its
+ * marginals, so no combined bin^2 x n weight tensor is built. */
+typedef struct {
+  int n, bin, so;
+  const int *bx, *by;
+  const double *wx, *wy;
+  double e1x, e1y, e2xy, mixy;   /* terms of the fixed pair */
+} tripletPair;
+
+static void tripletPairInit(tripletPair *t, const double *x, const double *y, const double *knots, int n, int bin, int so, int norm){
+  int *bx = (int*) calloc(n, sizeof(int));
+  int *by = (int*) calloc(n, sizeof(int));
+  double *wx = (double*) calloc(so * n, sizeof(double));
+  double *wy = (double*) calloc(so * n, sizeof(double));
+
+  findWeightsSparse(x, knots, bx, wx, n, so, bin, -1, -1);
+  findWeightsSparse(y, knots, by, wy, n, so, bin, -1, -1);
+  t->n = n;
+  t->bin = bin;
+  t->so = so;
+  t->bx = bx;
+  t->by = by;
+  t->wx = wx;
+  t->wy = wy;
+  t->e1x = entropy1(bx, wx, n, bin, so);
+  t->e1y = entropy1(by, wy, n, bin, so);
+  t->e2xy = entropy2(bx, wx, by, wy, n, bin, so);
+  t->mixy = norm == 1 ? 2*t->e2xy - pairSelfEntropy(bx, wx, by, wy, n, bin, so) : 0;
+}
+
+static void tripletPairFree(tripletPair *t){
+  free((int*) t->bx);
+  free((int*) t->by);
+  free((double*) t->wx);
+  free((double*) t->wy);
+}
+
+/* interaction information and I(x,y;z) of the pair with one z, given H(z) and its self-MI */
+static void tripletScore(const tripletPair *t, const int *bz, const double *wz, double e1z, double miz, int norm,
+                         double *hist3, double *hist2, double *ii, double *mi){
+  double h3, hxz, hyz, largerMI;
+
+  tripleEntropies(t->bx, t->wx, t->by, t->wy, bz, wz, t->n, t->bin, t->so, hist3, hist2, &h3, &hxz, &hyz);
+  *ii = h3 - t->e2xy - hxz - hyz + t->e1x + t->e1y + e1z;
+  *mi = t->e2xy + e1z - h3;
+  if(norm == 1){
+    largerMI = t->mixy > miz ? t->mixy : miz;
+    if(largerMI == 0) largerMI = 1;
+    *mi /= largerMI;
+  }
+}
+
+/* ii = I(x;y;z) and mi = I(x,y;z) (normalized when norm is 1) */
+void mi3(const double *x, const double *y, const double *z, int n, int bin, int so, int norm, double *ii, double *mi){
+  double *u = (double*) calloc(bin + so, sizeof(double));
+  int *bz = (int*) calloc(n, sizeof(int));
+  double *wz = (double*) calloc(so * n, sizeof(double));
+  double *hist3 = (double*) calloc(bin * bin * bin, sizeof(double));
+  double *hist2 = (double*) calloc(bin * bin, sizeof(double));
+  double e1z;
+  tripletPair t;
+
+  knotVector(u, bin, so);
+  tripletPairInit(&t, x, y, u, n, bin, so, norm);
+  findWeightsSparse(z, u, bz, wz, n, so, bin, -1, -1);
+  e1z = entropy1(bz, wz, n, bin, so);
+  tripletScore(&t, bz, wz, e1z, norm == 1 ? 2*e1z - selfEntropy2(bz, wz, n, bin, so) : 0, norm, hist3, hist2, ii, mi);
+
+  tripletPairFree(&t);
+  free(bz);
+  free(wz);
+  free(hist3);
+  free(hist2);
+  free(u);
+}
+
+double mi2vs1(const double *x, const double *y, const double *z, int n, int bin, int so, int norm){
+  double ii, mi;
+
+  mi3(x, y, z, n, bin, so, norm, &ii, &mi);
+  return mi;
+}
+
+/* state shared by the allTriplets workers */
+typedef struct {
+  const preparedRows *p;
+  const tripletPair *t;
+  double *ii, *mi;
+  int norm;
+} tripletJob;
+
+static void tripletRows(void *ctx, int begin, int end){
+  tripletJob *job = (tripletJob*) ctx;
+  const preparedRows *p = job->p;
+  int i, bin = p->bin;
+  double *hist3 = (double*) calloc(bin * bin * bin, sizeof(double));
+  double *hist2 = (double*) calloc(bin * bin, sizeof(double));
+
+  for(i = begin; i < end; i++)
+    tripletScore(job->t, p->bins + (size_t) i * p->n, p->weights + (size_t) i * p->so * p->n, p->e1[i], p->selfMI[i], job->norm,
+                 hist3, hist2, job->ii + i, job->mi + i);
+  free(hist3);
+  free(hist2);
+}
+
+/* mi3 of the fixed pair (x, y) with every prepared row as z. The pair's
+ * weights and entropies are computed once, the rows' come from p. */
+void allTriplets(const preparedRows *p, const double *x, const double *y, double *ii, double *mi, int norm, int nthreads){
+  tripletPair t;
+  tripletJob job;
+
+  tripletPairInit(&t, x, y, p->knots, p->n, p->bin, p->so, norm);
+  job.p = p;
+  job.t = &t;
+  job.ii = ii;
+  job.mi = mi;
+  job.norm = norm;
+  parallelFor(tripletRows, &job, p->m, ALL_MI_CHUNK, nthreads);
+  tripletPairFree(&t);
+}
+
+/* Conditional MI I(x;y|z) = H(x,z) + H(y,z) - H(x,y,z) - H(z). With the
+ * pair set to (x, z), the terms of x and z and their joint histogram are
+ * fixed, and each y costs one three-way histogram whose (z, y) marginal
+ * gives H(y,z). */
+static double tripletCMI(const tripletPair *t, const int *by, const double *wy, double *hist3, double *hist2){
+  double h3, hzy;
+
+  tripleEntropies(t->bx, t->wx, t->by, t->wy, by, wy, t->n, t->bin, t->so, hist3, hist2, &h3, NULL, &hzy);
+  return t->e2xy + hzy - h3 - t->e1y;
+}
+
+double cmi(const double *x, const double *y, const double *z, int n, int bin, int so){
+  double *u = (double*) calloc(bin + so, sizeof(double));
+  int *by = (int*) calloc(n, sizeof(int));
+  double *wy = (double*) calloc(so * n, sizeof(double));
+  double *hist3 = (double*) calloc(bin * bin * bin, sizeof(double));
+  double *hist2 = (double*) calloc(bin * bin, sizeof(double));
+  double c;
+  tripletPair t;
+
+  knotVector(u, bin, so);
+  tripletPairInit(&t, x, z, u, n, bin, so, 0);
+  findWeightsSparse(y, u, by, wy, n, so, bin, -1, -1);
+  c = tripletCMI(&t, by, wy, hist3, hist2);
+
+  tripletPairFree(&t);
+  free(by);
+  free(wy);
+  free(hist3);
+  free(hist2);
+  free(u);
+  return c;
+}
+
+static void cmiRows(void *ctx, int begin, int end){
+  tripletJob *job = (tripletJob*) ctx;
+  const preparedRows *p = job->p;
+  int i, bin = p->bin;
+  double *hist3 = (double*) calloc(bin * bin * bin, sizeof(double));
+  double *hist2 = (double*) calloc(bin * bin, sizeof(double));
+
+  for(i = begin; i < end; i++)
+    job->mi[i] = tripletCMI(job->t, p->bins + (size_t) i * p->n, p->weights + (size_t) i * p->so * p->n, hist3, hist2);
+  free(hist3);
+  free(hist2);
+}
+
+/* cmi of vec with every prepared row given z */
+void allCMI(const preparedRows *p, const double *vec, const double *z, double *mi, int nthreads){
+  tripletPair t;
+  tripletJob job;
+
+  tripletPairInit(&t, vec, z, p->knots, p->n, p->bin, p->so, 0);
+  job.p = p;
+  job.t = &t;
+  job.ii = NULL;
+  job.mi = mi;
+  job.norm = 0;
+  parallelFor(cmiRows, &job, p->m, ALL_MI_CHUNK, nthreads);
+  tripletPairFree(&t);
+}
+
+/* Rows with their own bin count and spline order. Rows sharing a (bins, so)
+ * configuration share one knot vector and are kept next to each other in
+ * order, so a worker walks runs of identically shaped histograms; small-bin
+ * rows only pay for their own bins and spline order. */
+typedef struct {
+  int m, n, numConfigs;
+  int *cfgBin, *cfgSo;   /* distinct configurations */
+  double **cfgKnots;
+  int *cfg;              /* configuration of each row */
+  int *order;            /* rows grouped by configuration */
+  size_t *wOffset;       /* start of each row's compact weights */
+  int *bins;             /* m x n first nonzero bins */
+  double *weights;       /* row i has n x so[cfg[i]] weights at wOffset[i] */
+  double *e1, *selfMI;
+  const double *data;
+} mixedRows;
+
+static void prepareMixedRange(void *ctx, int begin, int end){
+  mixedRows *p = (mixedRows*) ctx;
+  int *b;
+  double *w;
+  int k, i, c, n = p->n;
+
+  for(k = begin; k < end; k++){
+    i = p->order[k];
+    c = p->cfg[i];
+    b = p->bins + (size_t) i * n;
+    w = p->weights + p->wOffset[i];
+    findWeightsSparse(p->data + (size_t) i * n, p->cfgKnots[c], b, w, n, p->cfgSo[c], p->cfgBin[c], -1, -1);
+    p->e1[i] = entropy1(b, w, n, p->cfgBin[c], p->cfgSo[c]);
+    p->selfMI[i] = 2*p->e1[i] - selfEntropy2(b, w, n, p->cfgBin[c], p->cfgSo[c]);
+  }
+}
+
+mixedRows *prepareMixedRows(const double *data, int m, int n, const int *rowBin, const int *rowSo, int nthreads){
+  mixedRows *p = (mixedRows*) calloc(1, sizeof(mixedRows));
+  int i, c, *start;
+  size_t offset = 0;
+
+  p->m = m;
+  p->n = n;
+  p->data = data;
+  p->cfg = (int*) calloc(m, sizeof(int));
+  p->cfgBin = (int*) calloc(m > 0 ? m : 1, sizeof(int));
+  p->cfgSo = (int*) calloc(m > 0 ? m : 1, sizeof(int));
+  for(i = 0; i < m; i++){
+    for(c = 0; c < p->numConfigs; c++)
+      if(p->cfgBin[c] == rowBin[i] && p->cfgSo[c] == rowSo[i]) break;
+    if(c == p->numConfigs){
+      p->cfgBin[c] = rowBin[i];
+      p->cfgSo[c] = rowSo[i];
+      p->numConfigs++;
+    }
+    p->cfg[i] = c;
+  }
+  p->cfgKnots = (double**) calloc(p->numConfigs > 0 ? p->numConfigs : 1, sizeof(double*));
+  for(c = 0; c < p->numConfigs; c++){
+    p->cfgKnots[c] = (double*) calloc(p->cfgBin[c] + p->cfgSo[c], sizeof(double));
+    knotVector(p->cfgKnots[c], p->cfgBin[c], p->cfgSo[c]);
+  }
+
+  /* counting sort of the rows by configuration, stable in row index */
+  start = (int*) calloc(p->numConfigs + 1, sizeof(int));
+  for(i = 0; i < m; i++) start[p->cfg[i] + 1]++;
+  for(c = 0; c < p->numConfigs; c++) start[c + 1] += start[c];
+  p->order = (int*) calloc(m > 0 ? m : 1, sizeof(int));
+  for(i = 0; i < m; i++) p->order[start[p->cfg[i]]++] = i;
+  free(start);
+
+  p->wOffset = (size_t*) calloc(m > 0 ? m : 1, sizeof(size_t));
+  for(i = 0; i < m; i++){
+    p->wOffset[i] = offset;
+    offset += (size_t) n * p->cfgSo[p->cfg[i]];
+  }
+  p->bins = (int*) calloc((size_t) m * n, sizeof(int));
+  p->weights = (double*) calloc(offset > 0 ? offset : 1, sizeof(double));
+  p->e1 = (double*) calloc(m > 0 ? m : 1, sizeof(double));
+  p->selfMI = (double*) calloc(m > 0 ? m : 1, sizeof(double));
+  parallelFor(prepareMixedRange, p, m, ALL_MI_CHUNK, nthreads);
+  return p;
+}
+
+void freeMixedRows(mixedRows *p){
+  int c;
+
+  if(p == NULL) return;
+  for(c = 0; c < p->numConfigs; c++) free(p->cfgKnots[c]);
+  free(p->cfgKnots);
+  free(p->cfgBin);
+  free(p->cfgSo);
+  free(p->cfg);
+  free(p->order);
+  free(p->wOffset);
+  free(p->bins);
+  free(p->weights);
+  free(p->e1);
+  free(p->selfMI);
+  free(p);
+}
+
+/* state shared by the mixedAllMI / mixedAllPairsMI workers */
+typedef struct {
+  const mixedRows *p;
+  const double *vec, *wx;
+  const int *bx;
+  int bin, so;          /* configuration of the query */
+  double e1x, mix;
+  double *mi;
+  int norm, negateMI;
+} mixedMIJob;
+
+static void mixedMIRows(void *ctx, int begin, int end){
+  mixedMIJob *job = (mixedMIJob*) ctx;
+  const mixedRows *p = job->p;
+  int k, i, c, n = p->n;
+  double v, largerMI;
+
+  for(k = begin; k < end; k++){
+    i = p->order[k];
+    c = p->cfg[i];
+    v = job->e1x + p->e1[i] - entropy2DiffBins(job->bx, job->wx, p->bins + (size_t) i * n, p->weights + p->wOffset[i], n,
+                                               job->bin, p->cfgBin[c], job->so, p->cfgSo[c]);
+    if(job->norm == 1){
+      largerMI = job->mix;
+      if(p->selfMI[i] > job->mix) largerMI = p->selfMI[i];
+      if(largerMI == 0) largerMI = 1;
+      v /= largerMI;
+    }
+    if(job->negateMI == 1 && productMoment(p->data + (size_t) i * n, job->vec, n) < 0) v = -v;
+    job->mi[i] = v;
+  }
+}
+
+/* getAllMIWz against rows with their own configurations; vec uses bin / so */
+void mixedAllMI(const mixedRows *p, const double *vec, int bin, int so, double *mi, int norm, int negateMI, int nthreads){
+  double *u = (double*) calloc(bin + so, sizeof(double));
+  int *bx = (int*) calloc(p->n, sizeof(int));
+  double *wx = (double*) calloc(so * p->n, sizeof(double));
+  mixedMIJob job;
+
+  knotVector(u, bin, so);
+  findWeightsSparse(vec, u, bx, wx, p->n, so, bin, -1, -1);
+  job.p = p;
+  job.vec = vec;
+  job.bx = bx;
+  job.wx = wx;
+  job.bin = bin;
+  job.so = so;
+  job.e1x = entropy1(bx, wx, p->n, bin, so);
+  job.mix = 2*job.e1x - selfEntropy2(bx, wx, p->n, bin, so);
+  job.mi = mi;
+  job.norm = norm;
+  job.negateMI = negateMI;
+  parallelFor(mixedMIRows, &job, p->m, ALL_MI_CHUNK, nthreads);
+
+  free(u);
+  free(bx);
+  free(wx);
+}
+
+/* pairs (order[k], order[kk]) for kk >= k, mirrored; each pair is owned by one k */
+static void mixedPairRows(void *ctx, int begin, int end){
+  mixedMIJob *job = (mixedMIJob*) ctx;
+  const mixedRows *p = job->p;
+  int k, kk, i, j, ci, cj, m = p->m, n = p->n;
+  double v, largerMI;
+
+  for(k = begin; k < end; k++){
+    i = p->order[k];
+    ci = p->cfg[i];
+    for(kk = k; kk < m; kk++){
+      j = p->order[kk];
+      cj = p->cfg[j];
+      v = p->e1[i] + p->e1[j] - entropy2DiffBins(p->bins + (size_t) i * n, p->weights + p->wOffset[i], p->bins + (size_t) j * n, p->weights + p->wOffset[j],
+                                                 n, p->cfgBin[ci], p->cfgBin[cj], p->cfgSo[ci], p->cfgSo[cj]);
+      if(job->norm == 1){
+        largerMI = p->selfMI[i] > p->selfMI[j] ? p->selfMI[i] : p->selfMI[j];
+        if(largerMI == 0) largerMI = 1;
+        v /= largerMI;
+      }
+      if(job->negateMI == 1 && productMoment(p->data + (size_t) i * n, p->data + (size_t) j * n, n) < 0) v = -v;
+      job->mi[(size_t) i * m + j] = v;
+      job->mi[(size_t) j * m + i] = v;
+    }
+  }
+}
+
+void mixedAllPairsMI(const mixedRows *p, double *mi, int norm, int negateMI, int nthreads){
+  mixedMIJob job;
+
+  job.p = p;
+  job.mi = mi;
+  job.norm = norm;
+  job.negateMI = negateMI;
+  parallelFor(mixedPairRows, &job, p->m, 1, nthreads);
+}
+
+/* Histogram sums of every row of a matrix and one query vector over a
+ * growing set of samples. With ranges fixed up front a sample's weights do
+ * not depend on the others, so appending k samples costs O(k) per row and
+ * scores are read off the sums. */
+typedef struct {
+  int m, bin, so, n;  /* n samples so far */
+  double *knots;
+  double *lo, *hi;    /* m fixed row ranges */
+  double vecLo, vecHi;
+  double *vecHist;    /* bin marginal sums of the query */
+  double *vecSelf;    /* bin x bin self-joint sums of the query */
+  double *hist;       /* m x bin marginal sums */
+  double *joint;      /* m x bin x bin joint sums with the query, query bins first */
+  double *self;       /* m x bin x bin self-joint sums, used to normalize */
+  double *sumRow, *sumRowVec, sumVec; /* for the sign of the correlation */
+} incrementalRows;
+
+incrementalRows *newIncrementalRows(int m, int bin, int so, const double *lo, const double *hi, double vecLo, double vecHi){
+  incrementalRows *p = (incrementalRows*) calloc(1, sizeof(incrementalRows));
+  size_t cells = (size_t) m * bin * bin;
+
+  p->m = m;
+  p->bin = bin;
+  p->so = so;
+  p->vecLo = vecLo;
+  p->vecHi = vecHi;
+  p->knots = (double*) calloc(bin + so, sizeof(double));
+  p->lo = (double*) calloc(m, sizeof(double));
+  p->hi = (double*) calloc(m, sizeof(double));
+  memcpy(p->lo, lo, m * sizeof(double));
+  memcpy(p->hi, hi, m * sizeof(double));
+  p->vecHist = (double*) calloc(bin, sizeof(double));
+  p->vecSelf = (double*) calloc(bin * bin, sizeof(double));
+  p->hist = (double*) calloc((size_t) m * bin, sizeof(double));
+  p->joint = (double*) calloc(cells, sizeof(double));
+  p->self = (double*) calloc(cells, sizeof(double));
+  p->sumRow = (double*) calloc(m, sizeof(double));
+  p->sumRowVec = (double*) calloc(m, sizeof(double));
+  knotVector(p->knots, bin, so);
+  return p;
+}
+
+void freeIncrementalRows(incrementalRows *p){
+  if(p == NULL) return;
+  free(p->knots);
+  free(p->lo);
+  free(p->hi);
+  free(p->vecHist);
+  free(p->vecSelf);
+  free(p->hist);
+  free(p->joint);
+  free(p->self);
+  free(p->sumRow);
+  free(p->sumRowVec);
+  free(p);
+}
+
+/* adds the compact weights of k samples to a marginal histogram */
+static void addMarginal(const int *b, const double *w, double *hist, int k, int so){
+  int s, kk;
+  for(s = 0; s < k; s++){
+    for(kk = 0; kk < so; kk++) hist[b[s] + kk] += w[s * so + kk];
+  }
+}
+
+/* state shared by the incrementalAppend workers */
+typedef struct {
+  incrementalRows *p;
+  const double *data, *vec, *wx;
+  const int *bx;
+  int k;
+} incrementalJob;
+
+static void incrementalRange(void *ctx, int begin, int end){
+  incrementalJob *job = (incrementalJob*) ctx;
+  incrementalRows *p = job->p;
+  int i, s, k = job->k, bin = p->bin, so = p->so;
+  int *by = (int*) calloc(k, sizeof(int));
+  double *wy = (double*) calloc((size_t) so * k, sizeof(double));
+  const double *y;
+
+  for(i = begin; i < end; i++){
+    y = job->data + (size_t) i * k;
+    findWeightsSparse(y, p->knots, by, wy, k, so, bin, p->lo[i], p->hi[i]);
+    addMarginal(by, wy, p->hist + (size_t) i * bin, k, so);
+    jointHist(job->bx, job->wx, by, wy, p->joint + (size_t) i * bin * bin, k, bin, so);
+    jointHist(by, wy, by, wy, p->self + (size_t) i * bin * bin, k, bin, so);
+    for(s = 0; s < k; s++){
+      p->sumRow[i] += y[s];
+      p->sumRowVec[i] += y[s] * job->vec[s];
+    }
+  }
+  free(by);
+  free(wy);
+}
+
+/* adds k samples: data is m x k, vec has the query's k new values */
+void incrementalAppend(incrementalRows *p, const double *data, const double *vec, int k, int nthreads){
+  int *bx = (int*) calloc(k, sizeof(int));
+  double *wx = (double*) calloc((size_t) p->so * k, sizeof(double));
+  incrementalJob job;
+  int s;
+
+  findWeightsSparse(vec, p->knots, bx, wx, k, p->so, p->bin, p->vecLo, p->vecHi);
+  addMarginal(bx, wx, p->vecHist, k, p->so);
+  jointHist(bx, wx, bx, wx, p->vecSelf, k, p->bin, p->so);
+  for(s = 0; s < k; s++) p->sumVec += vec[s];
+
+  job.p = p;
+  job.data = data;
+  job.vec = vec;
+  job.bx = bx;
+  job.wx = wx;
+  job.k = k;
+  parallelFor(incrementalRange, &job, p->m, ALL_MI_CHUNK, nthreads);
+  p->n += k;
+
+  free(bx);
+  free(wx);
+}
+
+/* getAllMIWz over every sample appended so far */
+void incrementalAllMI(const incrementalRows *p, double *mi, int norm, int negateMI){
+  int i, n = p->n, bin = p->bin;
+  double e1x, mix, e1y, miy, largerMI;
+
+  e1x = entropyFromHist(p->vecHist, bin, n);
+  mix = 2*e1x - entropyFromHist(p->vecSelf, bin * bin, n);
+  for(i = 0; i < p->m; i++){
+    e1y = entropyFromHist(p->hist + (size_t) i * bin, bin, n);
+    mi[i] = e1x + e1y - entropyFromHist(p->joint + (size_t) i * bin * bin, bin * bin, n);
+    if(norm == 1){
+      largerMI = mix;
+      miy = 2*e1y - entropyFromHist(p->self + (size_t) i * bin * bin, bin * bin, n);
+      if(miy > mix) largerMI = miy;
+      if(largerMI == 0) largerMI = 1;
+      mi[i] /= largerMI;
+    }
+    if(negateMI == 1 && p->sumRowVec[i] * n - p->sumRow[i] * p->sumVec < 0) mi[i] = -mi[i];
+  }
+}
+
+
+/* =========== python interface ============== */
+
+int not_doublematrix(PyArrayObject *mat){
+    if(!PyArray_Check(mat) || mat->descr->type_num != NPY_DOUBLE || mat->nd != 2){
+        PyErr_SetString(PyExc_ValueError,
+                "In not_doublematrix: array must be of type Float and 2 dimensional (n x m).");
+        return 1;}
+    if(!PyArray_ISCARRAY_RO(mat)){
+        PyErr_SetString(PyExc_ValueError,
+                "In not_doublematrix: array must be C-contiguous and in native byte order.");
+        return 1;}
+    return 0;
+}
+
+/* not_doublematrix, also accepting float32 (NPY_FLOAT) matrices */
+int not_realmatrix(PyArrayObject *mat){
+    if(!PyArray_Check(mat) || (mat->descr->type_num != NPY_DOUBLE && mat->descr->type_num != NPY_FLOAT) || mat->nd != 2){
+        PyErr_SetString(PyExc_ValueError,
+                "In not_realmatrix: array must be of type Float or Float32 and 2 dimensional (n x m).");
+        return 1;}
+    if(!PyArray_ISCARRAY_RO(mat)){
+        PyErr_SetString(PyExc_ValueError,
+                "In not_realmatrix: array must be C-contiguous and in native byte order.");
+        return 1;}
+    return 0;
+}
+
+/* read-only double view of an input vector */
+typedef struct {
+    const double *data;
+    double *copy;       // owned conversion, NULL when data points into the buffer
+    Py_buffer view;
+    int hasView;
+    int n;
+} doubleVec;
+
+#define CONVERT_BUFFER(T) \
+    for(i = 0; i < n; i++) \
+        copy[i] = (double) *(const T*)(base + i * stride)
+
+/* 1-d buffers: contiguous float64 is used in place, any other numeric
+ * item type or stride is converted in one pass. Returns 0 if the object
+ * is not such a buffer, the caller then falls back to the sequence path. */
+static int
+buffer_as_doubles(PyObject *obj, doubleVec *v){
+    Py_buffer *view = &v->view;
+    const char *fmt, *base;
+    Py_ssize_t stride;
+    double *copy;
+    int i, n;
+
+    if(PyObject_GetBuffer(obj, view, PyBUF_STRIDED_RO | PyBUF_FORMAT) < 0){
+        PyErr_Clear();
+        return 0;
+    }
+    fmt = view->format ? view->format : "B";
+    if(*fmt == '@' || *fmt == '=') fmt++;
+#if NPY_BYTE_ORDER == NPY_LITTLE_ENDIAN
+    else if(*fmt == '<') fmt++;
+#else
+    else if(*fmt == '>' || *fmt == '!') fmt++;
+#endif
+    if(view->ndim != 1 || fmt[0] == '\0' || fmt[1] != '\0'){
+        PyBuffer_Release(view);
+        return 0;
+    }
+
+    n = v->n = view->shape[0];
+    stride = view->strides[0];
+    base = (const char*) view->buf;
+    if(fmt[0] == 'd' && stride == sizeof(double)){
+        v->data = (const double*) base;
+        v->hasView = 1;
+        return 1;
+    }
+
+    copy = (double*) malloc((n > 0 ? n : 1) * sizeof(double));
+    switch(fmt[0]){
+        case 'd': CONVERT_BUFFER(double); break;
+        case 'f': CONVERT_BUFFER(float); break;
+        case 'b': CONVERT_BUFFER(signed char); break;
+        case 'B': CONVERT_BUFFER(unsigned char); break;
+        case 'h': CONVERT_BUFFER(short); break;
+        case 'H': CONVERT_BUFFER(unsigned short); break;
+        case 'i': CONVERT_BUFFER(int); break;
+        case 'I': CONVERT_BUFFER(unsigned int); break;
+        case 'l': CONVERT_BUFFER(long); break;
+        case 'L': CONVERT_BUFFER(unsigned long); break;
+        case 'q': CONVERT_BUFFER(long long); break;
+        case 'Q': CONVERT_BUFFER(unsigned long long); break;
+        default:
+            free(copy);
+            PyBuffer_Release(view);
+            return 0;
+    }
+    PyBuffer_Release(view);
+    v->data = v->copy = copy;
+    return 1;
+}
+
+/* Fill v from a numpy array, buffer or any sequence of numbers.
+ * Returns -1 with a Python exception set on failure. */
+static int
+get_double_vector(PyObject *obj, doubleVec *v){
+    PyObject *seq;
+    double *copy;
+    int i, n;
+
+    v->data = v->copy = NULL;
+    v->hasView = 0;
+    v->n = 0;
+    if(PyObject_CheckBuffer(obj) && !PyBytes_Check(obj) && buffer_as_doubles(obj, v)) return 0;
+
+    if((seq = PySequence_Fast(obj, "Expected a sequence")) == NULL) return -1;
+    n = v->n = PySequence_Fast_GET_SIZE(seq);
+    copy = (double*) malloc((n > 0 ? n : 1) * sizeof(double));
+    for(i = 0; i < n; i++)
+        copy[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+    Py_DECREF(seq);
+    if(PyErr_Occurred()){
+        free(copy);
+        return -1;
+    }
+    v->data = v->copy = copy;
+    return 0;
+}
+
+static void
+release_double_vector(doubleVec *v){
+    if(v->hasView) PyBuffer_Release(&v->view);
+    free(v->copy);
+    v->hasView = 0;
+    v->copy = NULL;
+}
+
+/* both vectors, of the same length */
+static int
+get_double_pair(PyObject *xObj, PyObject *yObj, doubleVec *x, doubleVec *y, const char *fname){
+    if(get_double_vector(xObj, x) < 0) return -1;
+    if(get_double_vector(yObj, y) < 0){
+        release_double_vector(x);
+        return -1;
+    }
+    if(x->n != y->n){
+        PyErr_Format(PyExc_ValueError, "In %s: vectors must have the same length.", fname);
+        release_double_vector(x);
+        release_double_vector(y);
+        return -1;
+    }
+    return 0;
+}
+
+/* the kernels index knots and histograms by bin - so + 1 .. bin - 1, unchecked */
+static int
+not_config(int bins, int so, const char *fname){
+    if(so >= 1 && bins >= so) return 0;
+    PyErr_Format(PyExc_ValueError, "In %s: need 1 <= spline order <= bins, got bins %d and spline order %d.", fname, bins, so);
+    return 1;
+}
+
+/* entry points without a masked path (see maskedPairMI) refuse NaNs
+ * rather than score them differently from all_mi */
+static int
+not_observed(const double *x, size_t num, const char *fname){
+    if(!hasMissing(x, num)) return 0;
+    PyErr_Format(PyExc_ValueError, "In %s: missing values (NaN) are not supported.", fname);
+    return 1;
+}
+
+
+static PyObject *
+basis_function(PyObject *self, PyObject* args){
+    int i,p,numBins, listSize, j;
+    double t;
+    double *kVec;
+
+    PyObject *listObj, *seq, *out;
+
+    if(! PyArg_ParseTuple( args, "iidOi", &i, &p, &t, &listObj, &numBins )) return NULL;
+    
+    seq = PySequence_Fast(listObj, "Expected a sequence");
+    listSize = PySequence_Size(listObj);
+    kVec = (double*) calloc(listSize, sizeof(double));
+    
+    for(j = 0; j < listSize; j++)
+        kVec[j] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, j));
+    
+    Py_DECREF(seq);
+    out = Py_BuildValue("d", basisFunction(i, p, t, kVec, numBins));
+    free(kVec);
+    return out;
+}
+  
+static PyObject*
+find_weights(PyObject *self, PyObject* args){
+    double *knots, *weights;
+    int numSamples, splineOrder=3, numBins=6;
+    npy_intp w_dim[1] = {0};
+    PyObject *xObj;
+    PyArrayObject *wObj;
+    doubleVec x;
+
+    if(! PyArg_ParseTuple( args, "O|ii", &xObj, &numBins, &splineOrder )) return NULL;
+    if(not_config(numBins, splineOrder, "find_weights")) return NULL;
+    if(get_double_vector(xObj, &x) < 0) return NULL;
+    
+    numSamples = x.n;
+    knots = (double*) calloc(numBins + splineOrder, sizeof(double));
+    //weights = (double*) calloc(numBins * numSamples, sizeof(double));
+
+    knotVector(knots, numBins, splineOrder);
+    
+    w_dim[0] = numSamples * numBins;
+    wObj = (PyArrayObject *)PyArray_SimpleNew(1, w_dim, PyArray_DOUBLE);
+    weights = (double*) wObj->data;
+    findWeights(x.data, knots, weights, numSamples, splineOrder, numBins, -1, -1);
+      
+    free(knots);
+    release_double_vector(&x);
+    
+    return PyArray_Return(wObj);   
+}
+
+static PyObject*
+entropy(PyObject *self, PyObject *args){
+    double *knots, *weights, H;
+    int bins=6, so=3, n, *b;
+    PyObject *xObj, *out;
+    doubleVec x;
+
+    if(! PyArg_ParseTuple( args, "O|ii", &xObj, &bins, &so )) return NULL;
+    if(not_config(bins, so, "entropy")) return NULL;
+    if(get_double_vector(xObj, &x) < 0) return NULL;
+    n = x.n;
+    knots = (double*) calloc(bins + so, sizeof(double));
+    b = (int*) calloc(n, sizeof(int));
+    weights = (double*) calloc(so * n, sizeof(double));
+
+    knotVector(knots, bins, so);
+    findWeightsSparse(x.data, knots, b, weights, n, so, bins, -1, -1);
+    H = entropy1(b, weights, n, bins, so);
+
+    release_double_vector(&x);
+    free(knots);
+    free(b);
+    free(weights);
+    out = Py_BuildValue("d", H);
+    return out;
+}
+
+static PyObject*
+joint_entropy(PyObject *self, PyObject *args){
+    double *knots, *wx, *wy, H;
+    int bins=6, so=3, n, *bx, *by;
+    PyObject *xObj, *yObj, *out;
+    doubleVec x, y;
+
+    if(! PyArg_ParseTuple( args, "OO|ii", &xObj, &yObj, &bins, &so )) return NULL;
+    if(not_config(bins, so, "joint_entropy")) return NULL;
+    if(get_double_pair(xObj, yObj, &x, &y, "joint_entropy") < 0) return NULL;
+
+    n = x.n;
+    knots = (double*) calloc(bins + so, sizeof(double));
+    bx = (int*) calloc(n, sizeof(int));
+    by = (int*) calloc(n, sizeof(int));
+    wx = (double*) calloc(so * n, sizeof(double));
+    wy = (double*) calloc(so * n, sizeof(double));
+
+    knotVector(knots, bins, so);
+    findWeightsSparse(x.data, knots, bx, wx, n, so, bins, -1, -1);
+    findWeightsSparse(y.data, knots, by, wy, n, so, bins, -1, -1);
+    H = entropy2(bx, wx, by, wy, n, bins, so);
+
+    release_double_vector(&x);
+    release_double_vector(&y);
+    free(knots);
+    free(bx);
+    free(by);
+    free(wx);
+    free(wy);
+    out = Py_BuildValue("d", H);
+    return out;
+}
+
+static PyObject*
+mi(PyObject *self, PyObject *args){
+    double MI;
+    int bins=6, so=3, norm=1, negateMI=0;
+    PyObject *xObj, *yObj, *out;
+    doubleVec x, y;
+    
+    if(! PyArg_ParseTuple( args, "OO|iiii", &xObj, &yObj, &bins, &so, &norm, &negateMI )) return NULL;
+    if(not_config(bins, so, "mi")) return NULL;
+    if(get_double_pair(xObj, yObj, &x, &y, "mi") < 0) return NULL;
+
+    MI = mi2(x.data, y.data, x.n, bins, so, norm, negateMI);
+
+    release_double_vector(&x);
+    release_double_vector(&y);
+
+    out = Py_BuildValue("d", MI);
+    return out;
+}
+
+/* (indices, scores) arrays of a sorted selection */
+static PyObject*
+selection_tuple(miSelection *sel){
+    npy_intp dim[1] = {0};
+    PyArrayObject *idx, *scores;
+    int i;
+
+    dim[0] = sel->size;
+    idx = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_INT);
+    scores = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    for(i = 0; i < sel->size; i++){
+        ((int*) idx->data)[i] = sel->hits[i].idx;
+        ((double*) scores->data)[i] = sel->hits[i].score;
+    }
+    return Py_BuildValue("NN", idx, scores);
+}
+
+static PyObject*
+all_mi(PyObject *self, PyObject *args){
+    double *data, *MI, minAbs = 0;
+    int m, n, bins = 6, so = 3, norm = 1, negateMI = 1, nthreads = 1, topK = 0, single;
+    npy_intp dim[1] = {0};
+    PyArrayObject *dObj, *out;
+    PyObject *vObj, *ret;
+    miSelection sel;
+    doubleVec vec;
+
+    if(! PyArg_ParseTuple( args, "OO|iiiiiid", &dObj, &vObj, &bins, &so, &norm, &negateMI, &nthreads, &topK, &minAbs )) return NULL;
+    if(not_config(bins, so, "all_mi")) return NULL;
+    
+    if(not_realmatrix(dObj)) return NULL;
+    single = dObj->descr->type_num == NPY_FLOAT;
+
+    m = dim[0] = dObj->dimensions[0];
+    n = dObj->dimensions[1];
+
+    if(get_double_vector(vObj, &vec) < 0) return NULL;
+    if(n != vec.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In all_mi: vector length must match the number of columns.");
+        release_double_vector(&vec);
+        return NULL;
+    }
+    /* the float32 kernels have no masked path */
+    if(single && (hasMissing(vec.data, n) || hasMissingF((float*) dObj->data, (size_t) m * n))){
+        PyErr_SetString(PyExc_ValueError, "In all_mi: missing values (NaN) are not supported with float32.");
+        release_double_vector(&vec);
+        return NULL;
+    }
+    
+    data = (double*) dObj->data;
+
+    if(topK > 0 || minAbs > 0){
+        /* only the selected (index, score) pairs, best first */
+        selectionInit(&sel, topK, minAbs);
+        Py_BEGIN_ALLOW_THREADS
+        if(single) getAllMIWzF((float*) dObj->data, vec.data, NULL, &sel, m, n, bins, so, norm, negateMI, nthreads);
+        else getAllMIWz(data, vec.data, NULL, &sel, m, n, bins, so, norm, negateMI, nthreads);
+        Py_END_ALLOW_THREADS
+        ret = selection_tuple(&sel);
+        selectionFree(&sel);
+        release_double_vector(&vec);
+        return ret;
+    }
+
+    out = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    MI = (double*) out->data;
+    
+    Py_BEGIN_ALLOW_THREADS
+    if(single) getAllMIWzF((float*) dObj->data, vec.data, MI, NULL, m, n, bins, so, norm, negateMI, nthreads);
+    else getAllMIWz(data, vec.data, MI, NULL, m, n, bins, so, norm, negateMI, nthreads);
+    Py_END_ALLOW_THREADS
+ 
+    release_double_vector(&vec);
+    return PyArray_Return(out);
+
+
+    /*  
+    numSamples = PySequence_Size(xObj);
+    x = (double*) calloc(numSamples, sizeof(double));
     knots = (double*) calloc(numBins + splineOrder, sizeof(double));
     //weights = (double*) calloc(numBins * numSamples, sizeof(double));
 
-    seq = PySequence_Fast(xObj, "Expected a sequence");
-    for(i = 0; i < numSamples; i++)
-        x[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
-    Py_DECREF(seq);
+    seq = PySequence_Fast(xObj, "Expected a sequence");
+    for(i = 0; i < numSamples; i++)
+        x[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+    Py_DECREF(seq);
+
+    knotVector(knots, numBins, splineOrder);
+    
+    w_dim[0] = numSamples * numBins;
+    wObj = (PyArrayObject *)PyArray_SimpleNew(1, w_dim, PyArray_DOUBLE);
+    weights = (double*) wObj->data;
+    findWeights(x, knots, weights, numSamples, splineOrder, numBins, -1, -1);
+      
+    free(knots);
+    free(x);
+    
+    return PyArray_Return(wObj);   
+    */
+}
+
+static PyObject*
+all_pairs_mi(PyObject *self, PyObject *args){
+    int m, n, bins = 6, so = 3, norm = 1, negateMI = 1, nthreads = 1;
+    npy_intp dim[2] = {0, 0};
+    PyArrayObject *dObj, *out;
+    preparedRows *prep;
+
+    if(! PyArg_ParseTuple( args, "O|iiiii", &dObj, &bins, &so, &norm, &negateMI, &nthreads )) return NULL;
+    if(not_config(bins, so, "all_pairs_mi")) return NULL;
+
+    if(not_doublematrix(dObj)) return NULL;
+
+    m = dim[0] = dim[1] = dObj->dimensions[0];
+    n = dObj->dimensions[1];
+
+    out = (PyArrayObject*) PyArray_SimpleNew(2, dim, PyArray_DOUBLE);
+    Py_BEGIN_ALLOW_THREADS
+    prep = prepareRows((double*) dObj->data, m, n, bins, so, nthreads);
+    getAllPairsMI(prep, (double*) out->data, norm, negateMI, nthreads);
+    freePreparedRows(prep);
+    Py_END_ALLOW_THREADS
+
+    return PyArray_Return(out);
+}
+
+static void
+prepared_destructor(PyObject *capsule){
+    freePreparedRows((preparedRows*) PyCapsule_GetPointer(capsule, "pymi.preparedRows"));
+    Py_XDECREF((PyObject*) PyCapsule_GetContext(capsule));
+}
+
+static preparedRows*
+get_prepared(PyObject *capsule){
+    return (preparedRows*) PyCapsule_GetPointer(capsule, "pymi.preparedRows");
+}
+
+static PyObject*
+prepare(PyObject *self, PyObject *args){
+    int bins = 6, so = 3, nthreads = 1;
+    PyArrayObject *dObj;
+    PyObject *capsule;
+    preparedRows *prep;
+
+    if(! PyArg_ParseTuple( args, "O|iii", &dObj, &bins, &so, &nthreads )) return NULL;
+    if(not_config(bins, so, "prepare")) return NULL;
+
+    if(not_realmatrix(dObj)) return NULL;
+    if(dObj->descr->type_num == NPY_FLOAT && hasMissingF((float*) dObj->data, (size_t) dObj->dimensions[0] * dObj->dimensions[1])){
+        PyErr_SetString(PyExc_ValueError, "In prepare: missing values (NaN) are not supported with float32.");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if(dObj->descr->type_num == NPY_FLOAT)
+        prep = prepareRowsF((float*) dObj->data, dObj->dimensions[0], dObj->dimensions[1], bins, so, nthreads);
+    else
+        prep = prepareRows((double*) dObj->data, dObj->dimensions[0], dObj->dimensions[1], bins, so, nthreads);
+    Py_END_ALLOW_THREADS
+
+    /* the capsule keeps the matrix alive, the prepared rows read it in place */
+    capsule = PyCapsule_New(prep, "pymi.preparedRows", prepared_destructor);
+    Py_INCREF(dObj);
+    PyCapsule_SetContext(capsule, dObj);
+    return capsule;
+}
+
+/* the weights and marginal terms of prepared rows, copied out as
+ * (bins, weights, e1, selfMI) for prepare_from_arrays */
+static PyObject*
+prepared_arrays(PyObject *self, PyObject *args){
+    npy_intp dim[3];
+    PyObject *capsule;
+    PyArrayObject *bObj, *wObj, *eObj, *sObj;
+    preparedRows *prep;
+    int isFloat;
+
+    if(! PyArg_ParseTuple( args, "O", &capsule )) return NULL;
+    if((prep = get_prepared(capsule)) == NULL) return NULL;
+
+    isFloat = prep->weightsF != NULL;
+    dim[0] = prep->m;
+    dim[1] = prep->n;
+    dim[2] = prep->so;
+    bObj = (PyArrayObject*) PyArray_SimpleNew(2, dim, NPY_INT);
+    wObj = (PyArrayObject*) PyArray_SimpleNew(3, dim, isFloat ? NPY_FLOAT : NPY_DOUBLE);
+    eObj = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    sObj = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    memcpy(bObj->data, prep->bins, (size_t) prep->m * prep->n * sizeof(int));
+    if(isFloat)
+        memcpy(wObj->data, prep->weightsF, (size_t) prep->m * prep->n * prep->so * sizeof(float));
+    else
+        memcpy(wObj->data, prep->weights, (size_t) prep->m * prep->n * prep->so * sizeof(double));
+    memcpy(eObj->data, prep->e1, prep->m * sizeof(double));
+    memcpy(sObj->data, prep->selfMI, prep->m * sizeof(double));
+
+    return Py_BuildValue("(NNNN)", bObj, wObj, eObj, sObj);
+}
+
+static int
+not_preparedarrays(PyArrayObject *dObj, PyArrayObject *bObj, PyArrayObject *wObj, PyArrayObject *eObj, PyArrayObject *sObj, int bins, int so){
+    npy_intp m, n, k;
+    const int *b;
+
+    if(not_realmatrix(dObj)) return 1;
+    m = dObj->dimensions[0];
+    n = dObj->dimensions[1];
+    if(!PyArray_Check(bObj) || bObj->descr->type_num != NPY_INT || bObj->nd != 2 || !PyArray_ISCARRAY_RO(bObj) ||
+       bObj->dimensions[0] != m || bObj->dimensions[1] != n){
+        PyErr_SetString(PyExc_ValueError, "In not_preparedarrays: bins must be a contiguous int matrix shaped like the data.");
+        return 1;
+    }
+    if(!PyArray_Check(wObj) || wObj->descr->type_num != dObj->descr->type_num || wObj->nd != 3 || !PyArray_ISCARRAY_RO(wObj) ||
+       wObj->dimensions[0] != m || wObj->dimensions[1] != n || wObj->dimensions[2] != so){
+        PyErr_SetString(PyExc_ValueError, "In not_preparedarrays: weights must be contiguous, of the data type, and m x n x so.");
+        return 1;
+    }
+    if(!PyArray_Check(eObj) || !PyArray_Check(sObj) || eObj->descr->type_num != NPY_DOUBLE || sObj->descr->type_num != NPY_DOUBLE ||
+       eObj->nd != 1 || sObj->nd != 1 || !PyArray_ISCARRAY_RO(eObj) || !PyArray_ISCARRAY_RO(sObj) ||
+       eObj->dimensions[0] != m || sObj->dimensions[0] != m){
+        PyErr_SetString(PyExc_ValueError, "In not_preparedarrays: marginal entropies must be contiguous double vectors, one per row.");
+        return 1;
+    }
+    /* the kernels index histograms with these unchecked */
+    b = (const int*) bObj->data;
+    for(k = 0; k < m * n; k++){
+        if(b[k] < 0 || b[k] > bins - so){
+            PyErr_SetString(PyExc_ValueError, "In not_preparedarrays: bin out of range.");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* prepare, taking the weights and marginal terms from prepared_arrays
+ * (or a file they were saved to) instead of computing them */
+static PyObject*
+prepare_from_arrays(PyObject *self, PyObject *args){
+    int bins = 6, so = 3, isFloat;
+    PyArrayObject *dObj, *bObj, *wObj, *eObj, *sObj;
+    PyObject *capsule, *keep;
+    preparedRows *prep;
+
+    if(! PyArg_ParseTuple( args, "OOOOO|ii", &dObj, &bObj, &wObj, &eObj, &sObj, &bins, &so )) return NULL;
+    if(not_config(bins, so, "prepare_from_arrays")) return NULL;
+
+    if(not_preparedarrays(dObj, bObj, wObj, eObj, sObj, bins, so)) return NULL;
+
+    isFloat = dObj->descr->type_num == NPY_FLOAT;
+    prep = preparedFromArrays(isFloat ? NULL : (double*) dObj->data, isFloat ? (float*) dObj->data : NULL,
+                              dObj->dimensions[0], dObj->dimensions[1], bins, so, (int*) bObj->data,
+                              isFloat ? NULL : (double*) wObj->data, isFloat ? (float*) wObj->data : NULL,
+                              (double*) eObj->data, (double*) sObj->data);
+
+    /* the capsule keeps the matrix and every borrowed array alive */
+    keep = Py_BuildValue("(OOOOO)", dObj, bObj, wObj, eObj, sObj);
+    capsule = PyCapsule_New(prep, "pymi.preparedRows", prepared_destructor);
+    PyCapsule_SetContext(capsule, keep);
+    return capsule;
+}
+
+static PyObject*
+all_mi_batch(PyObject *self, PyObject *args){
+    int bins = 6, so = 3, norm = 1, negateMI = 1, nthreads = 1;
+    npy_intp dim[2] = {0, 0};
+    PyArrayObject *dObj, *qObj, *out;
+    preparedRows *prep, *qprep;
+
+    if(! PyArg_ParseTuple( args, "OO|iiiii", &dObj, &qObj, &bins, &so, &norm, &negateMI, &nthreads )) return NULL;
+    if(not_config(bins, so, "all_mi_batch")) return NULL;
+
+    if(not_doublematrix(dObj) || not_doublematrix(qObj)) return NULL;
+    if(dObj->dimensions[1] != qObj->dimensions[1]){
+        PyErr_SetString(PyExc_ValueError, "In all_mi_batch: matrix and queries must have the same number of columns.");
+        return NULL;
+    }
+
+    dim[0] = qObj->dimensions[0];
+    dim[1] = dObj->dimensions[0];
+    out = (PyArrayObject*) PyArray_SimpleNew(2, dim, PyArray_DOUBLE);
+
+    Py_BEGIN_ALLOW_THREADS
+    prep = prepareRows((double*) dObj->data, dObj->dimensions[0], dObj->dimensions[1], bins, so, nthreads);
+    qprep = prepareRows((double*) qObj->data, qObj->dimensions[0], qObj->dimensions[1], bins, so, nthreads);
+    preparedAllMIBatch(prep, qprep, (double*) out->data, norm, negateMI, nthreads);
+    freePreparedRows(prep);
+    freePreparedRows(qprep);
+    Py_END_ALLOW_THREADS
+
+    return PyArray_Return(out);
+}
+
+static PyObject*
+prepared_all_mi(PyObject *self, PyObject *args){
+    int norm = 1, negateMI = 1, nthreads = 1, topK = 0;
+    double minAbs = 0;
+    npy_intp dim[1] = {0};
+    PyArrayObject *out;
+    PyObject *capsule, *vObj, *ret;
+    preparedRows *prep;
+    miSelection sel;
+    doubleVec vec;
+
+    if(! PyArg_ParseTuple( args, "OO|iiiid", &capsule, &vObj, &norm, &negateMI, &nthreads, &topK, &minAbs )) return NULL;
+    if((prep = get_prepared(capsule)) == NULL) return NULL;
+
+    if(get_double_vector(vObj, &vec) < 0) return NULL;
+    if(prep->n != vec.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In prepared_all_mi: vector length must match the number of columns.");
+        release_double_vector(&vec);
+        return NULL;
+    }
+    if(prep->weightsF != NULL && hasMissing(vec.data, vec.n)){
+        PyErr_SetString(PyExc_ValueError, "In prepared_all_mi: missing values (NaN) are not supported with float32.");
+        release_double_vector(&vec);
+        return NULL;
+    }
+
+    if(topK > 0 || minAbs > 0){
+        /* only the selected (index, score) pairs, best first, as in all_mi */
+        selectionInit(&sel, topK, minAbs);
+        Py_BEGIN_ALLOW_THREADS
+        preparedAllMI(prep, vec.data, NULL, &sel, norm, negateMI, nthreads);
+        Py_END_ALLOW_THREADS
+        ret = selection_tuple(&sel);
+        selectionFree(&sel);
+        release_double_vector(&vec);
+        return ret;
+    }
+
+    dim[0] = prep->m;
+    out = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+
+    Py_BEGIN_ALLOW_THREADS
+    preparedAllMI(prep, vec.data, (double*) out->data, NULL, norm, negateMI, nthreads);
+    Py_END_ALLOW_THREADS
+
+    release_double_vector(&vec);
+    return PyArray_Return(out);
+}
+
+/* sample subsets as concatenated column indices and groups + 1 offsets */
+static int
+not_subsets(PyArrayObject *iObj, PyArrayObject *oObj, int n){
+    int g, c, groups;
+    const int *idx, *off;
+
+    if(!PyArray_Check(iObj) || !PyArray_Check(oObj) || iObj->descr->type_num != NPY_INT || oObj->descr->type_num != NPY_INT ||
+       iObj->nd != 1 || oObj->nd != 1 || !PyArray_ISCARRAY_RO(iObj) || !PyArray_ISCARRAY_RO(oObj) || oObj->dimensions[0] < 1){
+        PyErr_SetString(PyExc_ValueError, "In not_subsets: indices and offsets must be contiguous int vectors.");
+        return 1;
+    }
+    idx = (const int*) iObj->data;
+    off = (const int*) oObj->data;
+    groups = oObj->dimensions[0] - 1;
+    if(off[0] != 0 || off[groups] != iObj->dimensions[0]){
+        PyErr_SetString(PyExc_ValueError, "In not_subsets: offsets must run from 0 to the number of indices.");
+        return 1;
+    }
+    for(g = 0; g < groups; g++){
+        if(off[g + 1] < off[g]){
+            PyErr_SetString(PyExc_ValueError, "In not_subsets: offsets must not decrease.");
+            return 1;
+        }
+        for(c = off[g]; c < off[g + 1]; c++){
+            if(idx[c] < 0 || idx[c] >= n){
+                PyErr_Format(PyExc_ValueError, "In not_subsets: column %d out of range.", idx[c]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static PyObject*
+all_mi_subsets(PyObject *self, PyObject *args){
+    int m, n, bins = 6, so = 3, norm = 1, negateMI = 1, nthreads = 1;
+    npy_intp dim[2] = {0, 0};
+    PyArrayObject *dObj, *iObj, *oObj, *out;
+    PyObject *vObj;
+    doubleVec vec;
+
+    if(! PyArg_ParseTuple( args, "OOOO|iiiii", &dObj, &vObj, &iObj, &oObj, &bins, &so, &norm, &negateMI, &nthreads )) return NULL;
+    if(not_config(bins, so, "all_mi_subsets")) return NULL;
+
+    if(not_doublematrix(dObj)) return NULL;
+    m = dim[0] = dObj->dimensions[0];
+    n = dObj->dimensions[1];
+    if(not_subsets(iObj, oObj, n)) return NULL;
+    dim[1] = oObj->dimensions[0] - 1;
+
+    if(get_double_vector(vObj, &vec) < 0) return NULL;
+    if(n != vec.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In all_mi_subsets: vector length must match the number of columns.");
+        release_double_vector(&vec);
+        return NULL;
+    }
+
+    out = (PyArrayObject*) PyArray_SimpleNew(2, dim, PyArray_DOUBLE);
+    Py_BEGIN_ALLOW_THREADS
+    subsetAllMI(NULL, (double*) dObj->data, vec.data, (int*) iObj->data, (int*) oObj->data, dim[1], (double*) out->data,
+                m, n, bins, so, norm, negateMI, nthreads);
+    Py_END_ALLOW_THREADS
+
+    release_double_vector(&vec);
+    return PyArray_Return(out);
+}
+
+static PyObject*
+prepared_all_mi_subsets(PyObject *self, PyObject *args){
+    int norm = 1, negateMI = 1, nthreads = 1;
+    npy_intp dim[2] = {0, 0};
+    PyArrayObject *iObj, *oObj, *out;
+    PyObject *capsule, *vObj;
+    preparedRows *prep;
+    doubleVec vec;
+
+    if(! PyArg_ParseTuple( args, "OOOO|iii", &capsule, &vObj, &iObj, &oObj, &norm, &negateMI, &nthreads )) return NULL;
+    if((prep = get_prepared(capsule)) == NULL) return NULL;
+    if(prep->weights == NULL){
+        PyErr_SetString(PyExc_ValueError, "In prepared_all_mi_subsets: float32 prepared rows are not supported.");
+        return NULL;
+    }
+    if(not_subsets(iObj, oObj, prep->n)) return NULL;
+
+    if(get_double_vector(vObj, &vec) < 0) return NULL;
+    if(prep->n != vec.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In prepared_all_mi_subsets: vector length must match the number of columns.");
+        release_double_vector(&vec);
+        return NULL;
+    }
 
-    knotVector(knots, numBins, splineOrder);
-    
-    w_dim[0] = numSamples * numBins;
-    wObj = (PyArrayObject *)PyArray_SimpleNew(1, w_dim, PyArray_DOUBLE);
-    weights = (double*) wObj->data;
-    findWeights(x, knots, weights, numSamples, splineOrder, numBins, -1, -1);
-      
-    free(knots);
-    free(x);
-    
-    return PyArray_Return(wObj);   
+    dim[0] = prep->m;
+    dim[1] = oObj->dimensions[0] - 1;
+    out = (PyArrayObject*) PyArray_SimpleNew(2, dim, PyArray_DOUBLE);
+    Py_BEGIN_ALLOW_THREADS
+    subsetAllMI(prep, NULL, vec.data, (int*) iObj->data, (int*) oObj->data, dim[1], (double*) out->data,
+                0, 0, 0, 0, norm, negateMI, nthreads);
+    Py_END_ALLOW_THREADS
+
+    release_double_vector(&vec);
+    return PyArray_Return(out);
 }
 
 static PyObject*
-entropy(PyObject *self, PyObject *args){
-    double *x, *knots, *weights, H;
-    int bins=6, so=3, i, n;
-    PyObject *xObj, *seq, *out;
+find_attractor(PyObject *self, PyObject *args){
+    int topK = 10, maxIter = 100, norm = 1, negateMI = 1, nthreads = 1, converged, iterations;
+    double exponent = 1, tol = 1e-6, pruneMargin = 0.1;
+    npy_intp dim[1] = {0};
+    PyArrayObject *meta, *mi, *top, *topMI;
+    PyObject *capsule, *sObj;
+    preparedRows *prep;
+    doubleVec seed;
 
-    if(! PyArg_ParseTuple( args, "O|ii", &xObj, &bins, &so )) return NULL;
-    n = PySequence_Size(xObj);
-    x = (double*) calloc(n, sizeof(double));
-    knots = (double*) calloc(bins + so, sizeof(double));
-    weights = (double*) calloc(bins * n, sizeof(double));
-    
-    seq = PySequence_Fast(xObj, "Expected a sequence");
-    for(i = 0; i < n; i++)
-        x[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq,i));
-    Py_DECREF(seq);
+    if(! PyArg_ParseTuple( args, "OO|iddidiii", &capsule, &sObj, &topK, &exponent, &tol, &maxIter, &pruneMargin, &norm, &negateMI, &nthreads )) return NULL;
+    if((prep = get_prepared(capsule)) == NULL) return NULL;
+    if(topK < 1){
+        PyErr_SetString(PyExc_ValueError, "In find_attractor: top_k must be at least 1.");
+        return NULL;
+    }
 
-    knotVector(knots, bins, so);
-    findWeights(x, knots, weights, n, so, bins, -1, -1);
-    H = entropy1(weights, n, bins);
+    if(get_double_vector(sObj, &seed) < 0) return NULL;
+    if(prep->n != seed.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In find_attractor: seed length must match the number of columns.");
+        release_double_vector(&seed);
+        return NULL;
+    }
+    /* metagenes average rows sample by sample */
+    if(not_observed(seed.data, seed.n, "find_attractor") || (prep->masks != NULL && not_observed(prep->data, (size_t) prep->m * prep->n, "find_attractor"))){
+        release_double_vector(&seed);
+        return NULL;
+    }
 
-    free(x);
-    free(knots);
-    free(weights);
-    out = Py_BuildValue("d", H);
-    return out;
+    dim[0] = prep->n;
+    meta = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    dim[0] = prep->m;
+    mi = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    dim[0] = topK;
+    top = (PyArrayObject*) PyArray_SimpleNew(1, dim, NPY_INT);
+    topMI = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+
+    Py_BEGIN_ALLOW_THREADS
+    converged = findAttractor(prep, seed.data, (double*) meta->data, (double*) mi->data, (int*) top->data, (double*) topMI->data,
+                              topK, exponent, tol, maxIter, pruneMargin, norm, negateMI, nthreads, &iterations);
+    Py_END_ALLOW_THREADS
+
+    release_double_vector(&seed);
+    return Py_BuildValue("NNNNii", PyArray_Return(meta), PyArray_Return(mi), PyArray_Return(top), PyArray_Return(topMI), converged, iterations);
 }
 
 static PyObject*
-joint_entropy(PyObject *self, PyObject *args){
-    double *x, *y, *knots, *wx, *wy, H;
-    int bins=6, so=3, i, n;
-    PyObject *xObj, *yObj, *seq, *seq2, *out;
+find_attractors(PyObject *self, PyObject *args){
+    int topK = 10, maxIter = 100, norm = 1, negateMI = 1, nthreads = 1, k;
+    double exponent = 1, tol = 1e-6, pruneMargin = 0.1;
+    npy_intp dim[2] = {0, 0};
+    PyArrayObject *sObj, *meta, *top, *topMI, *converged, *iterations;
+    PyObject *capsule;
+    preparedRows *prep;
 
-    if(! PyArg_ParseTuple( args, "OO|ii", &xObj, &yObj, &bins, &so )) return NULL;
+    if(! PyArg_ParseTuple( args, "OO|iddidiii", &capsule, &sObj, &topK, &exponent, &tol, &maxIter, &pruneMargin, &norm, &negateMI, &nthreads )) return NULL;
+    if((prep = get_prepared(capsule)) == NULL) return NULL;
+    if(topK < 1){
+        PyErr_SetString(PyExc_ValueError, "In find_attractors: top_k must be at least 1.");
+        return NULL;
+    }
+    if(not_doublematrix(sObj)) return NULL;
+    if(sObj->dimensions[1] != prep->n){
+        PyErr_SetString(PyExc_ValueError, "In find_attractors: seeds must have the columns of the matrix.");
+        return NULL;
+    }
+    if(not_observed((double*) sObj->data, (size_t) sObj->dimensions[0] * prep->n, "find_attractors") ||
+       (prep->masks != NULL && not_observed(prep->data, (size_t) prep->m * prep->n, "find_attractors"))) return NULL;
 
-    n = PySequence_Size(xObj);
-    if (n != PySequence_Size(yObj)){
-        // something is wrong!
+    k = dim[0] = sObj->dimensions[0];
+    dim[1] = prep->n;
+    meta = (PyArrayObject*) PyArray_SimpleNew(2, dim, PyArray_DOUBLE);
+    dim[1] = topK;
+    top = (PyArrayObject*) PyArray_SimpleNew(2, dim, NPY_INT);
+    topMI = (PyArrayObject*) PyArray_SimpleNew(2, dim, PyArray_DOUBLE);
+    converged = (PyArrayObject*) PyArray_SimpleNew(1, dim, NPY_INT);
+    iterations = (PyArrayObject*) PyArray_SimpleNew(1, dim, NPY_INT);
+
+    Py_BEGIN_ALLOW_THREADS
+    findAttractors(prep, (double*) sObj->data, k, (double*) meta->data, (int*) top->data, (double*) topMI->data,
+                   (int*) converged->data, (int*) iterations->data, topK, exponent, tol, maxIter, pruneMargin, norm, negateMI, nthreads);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("NNNNN", PyArray_Return(meta), PyArray_Return(top), PyArray_Return(topMI), PyArray_Return(converged), PyArray_Return(iterations));
+}
+
+static void
+network_destructor(PyObject *capsule){
+    freeMINetwork((miNetwork*) PyCapsule_GetPointer(capsule, "pymi.miNetwork"));
+}
+
+static PyObject*
+mi_network(PyObject *self, PyObject *args){
+    int dpi = 1, norm = 1, negateMI = 1, nthreads = 1;
+    double threshold = 0, tolerance = 0;
+    PyObject *capsule;
+    preparedRows *prep;
+    miNetwork *net;
+
+    if(! PyArg_ParseTuple( args, "Od|idiii", &capsule, &threshold, &dpi, &tolerance, &norm, &negateMI, &nthreads )) return NULL;
+    if((prep = get_prepared(capsule)) == NULL) return NULL;
+    if(prep->weights == NULL){
+        PyErr_SetString(PyExc_ValueError, "In mi_network: float32 prepared rows are not supported.");
         return NULL;
     }
-    x = (double*) calloc(n, sizeof(double));
-    y = (double*) calloc(n, sizeof(double));
-    knots = (double*) calloc(bins + so, sizeof(double));
-    wx = (double*) calloc(bins * n, sizeof(double));
-    wy = (double*) calloc(bins * n, sizeof(double));
-    
-    seq = PySequence_Fast(xObj, "Expected a sequence");
-    seq2 = PySequence_Fast(yObj, "Expected a sequence");
-    for(i = 0; i < n; i++){
-        x[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq,i));
-        y[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq2,i));
+
+    Py_BEGIN_ALLOW_THREADS
+    net = buildMINetwork(prep, threshold, dpi, tolerance, norm, negateMI, nthreads);
+    Py_END_ALLOW_THREADS
+
+    return PyCapsule_New(net, "pymi.miNetwork", network_destructor);
+}
+
+/* (src, dst, mi) arrays of the kept edges of rows [begin, end) of a network */
+static PyObject*
+network_edges(PyObject *self, PyObject *args){
+    int begin, end;
+    npy_intp dim[1] = {0};
+    PyArrayObject *srcObj, *dstObj, *miObj;
+    PyObject *capsule;
+    miNetwork *net;
+
+    if(! PyArg_ParseTuple( args, "Oii", &capsule, &begin, &end )) return NULL;
+    if((net = (miNetwork*) PyCapsule_GetPointer(capsule, "pymi.miNetwork")) == NULL) return NULL;
+    if(begin < 0) begin = 0;
+    if(end > net->m) end = net->m;
+    if(end < begin) end = begin;
+
+    dim[0] = networkEdges(net, begin, end, NULL, NULL, NULL);
+    srcObj = (PyArrayObject*) PyArray_SimpleNew(1, dim, NPY_INT);
+    dstObj = (PyArrayObject*) PyArray_SimpleNew(1, dim, NPY_INT);
+    miObj = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    networkEdges(net, begin, end, (int*) srcObj->data, (int*) dstObj->data, (double*) miObj->data);
+    return Py_BuildValue("NNN", PyArray_Return(srcObj), PyArray_Return(dstObj), PyArray_Return(miObj));
+}
+
+static PyObject*
+mi_permutation_test(PyObject *self, PyObject *args){
+    double MI, pval, alpha = 0;
+    int bins = 6, so = 3, norm = 1, negateMI = 0, nperm = 1000, nthreads = 1, done;
+    unsigned long long seed = 0;
+    PyObject *xObj, *yObj;
+    doubleVec x, y;
+
+    if(! PyArg_ParseTuple( args, "OO|iKiiiidi", &xObj, &yObj, &nperm, &seed, &bins, &so, &norm, &negateMI, &alpha, &nthreads )) return NULL;
+    if(not_config(bins, so, "mi_permutation_test")) return NULL;
+    if(get_double_pair(xObj, yObj, &x, &y, "mi_permutation_test") < 0) return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    done = miPermutationTest(x.data, y.data, x.n, bins, so, norm, negateMI, nperm, seed, alpha, nthreads, &MI, &pval);
+    Py_END_ALLOW_THREADS
+
+    release_double_vector(&x);
+    release_double_vector(&y);
+    return Py_BuildValue("ddi", MI, pval, done);
+}
+
+static PyObject*
+all_mi_permutation(PyObject *self, PyObject *args){
+    double alpha = 0;
+    int bins = 6, so = 3, norm = 1, negateMI = 1, nperm = 1000, nthreads = 1, missing;
+    unsigned long long seed = 0;
+    npy_intp dim[1] = {0};
+    PyArrayObject *dObj, *mis, *pvals, *nperms;
+    PyObject *vObj;
+    preparedRows *prep;
+    doubleVec vec;
+
+    if(! PyArg_ParseTuple( args, "OO|iKiiiidi", &dObj, &vObj, &nperm, &seed, &bins, &so, &norm, &negateMI, &alpha, &nthreads )) return NULL;
+    if(not_config(bins, so, "all_mi_permutation")) return NULL;
+
+    if(not_doublematrix(dObj)) return NULL;
+    if(get_double_vector(vObj, &vec) < 0) return NULL;
+    if(dObj->dimensions[1] != vec.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In all_mi_permutation: vector length must match the number of columns.");
+        release_double_vector(&vec);
+        return NULL;
+    }
+    /* the query's permutations are shared by all rows, which needs every sample observed */
+    Py_BEGIN_ALLOW_THREADS
+    missing = hasMissing(vec.data, vec.n) || hasMissing((double*) dObj->data, (size_t) dObj->dimensions[0] * dObj->dimensions[1]);
+    Py_END_ALLOW_THREADS
+    if(missing){
+        PyErr_SetString(PyExc_ValueError, "In all_mi_permutation: missing values (NaN) are not supported, see mi_permutation_test.");
+        release_double_vector(&vec);
+        return NULL;
     }
-    Py_DECREF(seq);
-    Py_DECREF(seq2);
 
-    knotVector(knots, bins, so);
-    findWeights(x, knots, wx, n, so, bins, -1, -1);
-    findWeights(y, knots, wy, n, so, bins, -1, -1);
-    H = entropy2(wx, wy, n, bins);
+    dim[0] = dObj->dimensions[0];
+    mis = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    pvals = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    nperms = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_INT);
 
-    free(x);
-    free(y);
-    free(knots);
-    free(wx);
-    free(wy);
-    out = Py_BuildValue("d", H);
-    return out;
+    Py_BEGIN_ALLOW_THREADS
+    prep = prepareRows((double*) dObj->data, dObj->dimensions[0], dObj->dimensions[1], bins, so, nthreads);
+    preparedAllMIPermutation(prep, vec.data, (double*) mis->data, (double*) pvals->data, (int*) nperms->data,
+                             nperm, seed, alpha, norm, negateMI, nthreads);
+    freePreparedRows(prep);
+    Py_END_ALLOW_THREADS
+
+    release_double_vector(&vec);
+    return Py_BuildValue("NNN", mis, pvals, nperms);
+}
+
+/* x, y and z, all of the same length */
+static int
+get_double_triple(PyObject *xObj, PyObject *yObj, PyObject *zObj, doubleVec *x, doubleVec *y, doubleVec *z, const char *fname){
+    if(get_double_pair(xObj, yObj, x, y, fname) < 0) return -1;
+    if(get_double_vector(zObj, z) < 0 || z->n != x->n){
+        if(!PyErr_Occurred())
+            PyErr_Format(PyExc_ValueError, "In %s: vectors must have the same length.", fname);
+        release_double_vector(x);
+        release_double_vector(y);
+        release_double_vector(z);
+        return -1;
+    }
+    return 0;
 }
 
 static PyObject*
-mi(PyObject *self, PyObject *args){
-    double *x, *y, MI;
-    int bins=6, so=3, i, n, norm=1, negateMI=0;
-    PyObject *xObj, *yObj, *seq, *seq2, *out;
-    
-    if(! PyArg_ParseTuple( args, "OO|iiii", &xObj, &yObj, &bins, &so, &norm, &negateMI )) return NULL;
+mi_3(PyObject *self, PyObject *args){
+    double ii, MI;
+    int bins = 6, so = 3;
+    PyObject *xObj, *yObj, *zObj;
+    doubleVec x, y, z;
 
-    n = PySequence_Size(xObj);
-    if (n != PySequence_Size(yObj)){
-        // something is wrong!
+    if(! PyArg_ParseTuple( args, "OOO|ii", &xObj, &yObj, &zObj, &bins, &so )) return NULL;
+    if(not_config(bins, so, "mi3")) return NULL;
+    if(get_double_triple(xObj, yObj, zObj, &x, &y, &z, "mi3") < 0) return NULL;
+    if(not_observed(x.data, x.n, "mi3") || not_observed(y.data, y.n, "mi3") || not_observed(z.data, z.n, "mi3")){
+        release_double_vector(&x);
+        release_double_vector(&y);
+        release_double_vector(&z);
         return NULL;
     }
-    x = (double*) calloc(n, sizeof(double));
-    y = (double*) calloc(n, sizeof(double));
-    
-    seq = PySequence_Fast(xObj, "Expected a sequence");
-    seq2 = PySequence_Fast(yObj, "Expected a sequence");
-    for(i = 0; i < n; i++){
-        x[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq,i));
-        y[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq2,i));
+
+    mi3(x.data, y.data, z.data, x.n, bins, so, 0, &ii, &MI);
+
+    release_double_vector(&x);
+    release_double_vector(&y);
+    release_double_vector(&z);
+    return Py_BuildValue("d", ii);
+}
+
+static PyObject*
+mi_2vs1(PyObject *self, PyObject *args){
+    double MI;
+    int bins = 6, so = 3, norm = 1;
+    PyObject *xObj, *yObj, *zObj;
+    doubleVec x, y, z;
+
+    if(! PyArg_ParseTuple( args, "OOO|iii", &xObj, &yObj, &zObj, &bins, &so, &norm )) return NULL;
+    if(not_config(bins, so, "mi2vs1")) return NULL;
+    if(get_double_triple(xObj, yObj, zObj, &x, &y, &z, "mi2vs1") < 0) return NULL;
+    if(not_observed(x.data, x.n, "mi2vs1") || not_observed(y.data, y.n, "mi2vs1") || not_observed(z.data, z.n, "mi2vs1")){
+        release_double_vector(&x);
+        release_double_vector(&y);
+        release_double_vector(&z);
+        return NULL;
     }
-    Py_DECREF(seq);
-    Py_DECREF(seq2);
 
-    MI = mi2(x, y, n, bins, so, norm, negateMI);
+    MI = mi2vs1(x.data, y.data, z.data, x.n, bins, so, norm);
 
-    free(x);
-    free(y);
+    release_double_vector(&x);
+    release_double_vector(&y);
+    release_double_vector(&z);
+    return Py_BuildValue("d", MI);
+}
 
-    out = Py_BuildValue("d", MI);
-    return out;
+static PyObject*
+all_triplets(PyObject *self, PyObject *args){
+    int bins = 6, so = 3, norm = 1, nthreads = 1;
+    npy_intp dim[1] = {0};
+    PyArrayObject *dObj, *ii, *mis;
+    PyObject *xObj, *yObj;
+    preparedRows *prep;
+    doubleVec x, y;
+
+    if(! PyArg_ParseTuple( args, "OOO|iiii", &dObj, &xObj, &yObj, &bins, &so, &norm, &nthreads )) return NULL;
+    if(not_config(bins, so, "all_triplets")) return NULL;
+
+    if(not_doublematrix(dObj)) return NULL;
+    if(get_double_pair(xObj, yObj, &x, &y, "all_triplets") < 0) return NULL;
+    if(dObj->dimensions[1] != x.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In all_triplets: vector length must match the number of columns.");
+        release_double_vector(&x);
+        release_double_vector(&y);
+        return NULL;
+    }
+    if(not_observed(x.data, x.n, "all_triplets") || not_observed(y.data, y.n, "all_triplets") ||
+       not_observed((double*) dObj->data, (size_t) dObj->dimensions[0] * dObj->dimensions[1], "all_triplets")){
+        release_double_vector(&x);
+        release_double_vector(&y);
+        return NULL;
+    }
+
+    dim[0] = dObj->dimensions[0];
+    ii = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+    mis = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+
+    Py_BEGIN_ALLOW_THREADS
+    prep = prepareRows((double*) dObj->data, dObj->dimensions[0], dObj->dimensions[1], bins, so, nthreads);
+    allTriplets(prep, x.data, y.data, (double*) ii->data, (double*) mis->data, norm, nthreads);
+    freePreparedRows(prep);
+    Py_END_ALLOW_THREADS
+
+    release_double_vector(&x);
+    release_double_vector(&y);
+    return Py_BuildValue("NN", ii, mis);
 }
 
 static PyObject*
-all_mi(PyObject *self, PyObject *args){
-    double *data, *vec, *MI;
-    int m, n, i, bins = 6, so = 3, norm = 1, negateMI = 1;
+c_mi(PyObject *self, PyObject *args){
+    double c;
+    int bins = 6, so = 3;
+    PyObject *xObj, *yObj, *zObj;
+    doubleVec x, y, z;
+
+    if(! PyArg_ParseTuple( args, "OOO|ii", &xObj, &yObj, &zObj, &bins, &so )) return NULL;
+    if(not_config(bins, so, "cmi")) return NULL;
+    if(get_double_triple(xObj, yObj, zObj, &x, &y, &z, "cmi") < 0) return NULL;
+    if(not_observed(x.data, x.n, "cmi") || not_observed(y.data, y.n, "cmi") || not_observed(z.data, z.n, "cmi")){
+        release_double_vector(&x);
+        release_double_vector(&y);
+        release_double_vector(&z);
+        return NULL;
+    }
+
+    c = cmi(x.data, y.data, z.data, x.n, bins, so);
+
+    release_double_vector(&x);
+    release_double_vector(&y);
+    release_double_vector(&z);
+    return Py_BuildValue("d", c);
+}
+
+static PyObject*
+all_cmi(PyObject *self, PyObject *args){
+    int bins = 6, so = 3, nthreads = 1;
     npy_intp dim[1] = {0};
     PyArrayObject *dObj, *out;
-    PyObject *vObj, *seq;
+    PyObject *vObj, *zObj;
+    preparedRows *prep;
+    doubleVec vec, z;
+
+    if(! PyArg_ParseTuple( args, "OOO|iii", &dObj, &vObj, &zObj, &bins, &so, &nthreads )) return NULL;
+    if(not_config(bins, so, "all_cmi")) return NULL;
 
-    if(! PyArg_ParseTuple( args, "OO|iiii", &dObj, &vObj, &bins, &so, &norm, &negateMI )) return NULL;
-    
     if(not_doublematrix(dObj)) return NULL;
+    if(get_double_pair(vObj, zObj, &vec, &z, "all_cmi") < 0) return NULL;
+    if(dObj->dimensions[1] != vec.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In all_cmi: vector length must match the number of columns.");
+        release_double_vector(&vec);
+        release_double_vector(&z);
+        return NULL;
+    }
+    if(not_observed(vec.data, vec.n, "all_cmi") || not_observed(z.data, z.n, "all_cmi") ||
+       not_observed((double*) dObj->data, (size_t) dObj->dimensions[0] * dObj->dimensions[1], "all_cmi")){
+        release_double_vector(&vec);
+        release_double_vector(&z);
+        return NULL;
+    }
+
+    dim[0] = dObj->dimensions[0];
+    out = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
+
+    Py_BEGIN_ALLOW_THREADS
+    prep = prepareRows((double*) dObj->data, dObj->dimensions[0], dObj->dimensions[1], bins, so, nthreads);
+    allCMI(prep, vec.data, z.data, (double*) out->data, nthreads);
+    freePreparedRows(prep);
+    Py_END_ALLOW_THREADS
+
+    release_double_vector(&vec);
+    release_double_vector(&z);
+    return PyArray_Return(out);
+}
+
+/* per-row bins / spline orders: contiguous int vectors of length m with 1 <= so <= bins */
+static int
+not_configvectors(PyArrayObject *bObj, PyArrayObject *sObj, int m){
+    int i;
+    const int *b, *so;
+
+    if(!PyArray_Check(bObj) || !PyArray_Check(sObj) || bObj->descr->type_num != NPY_INT || sObj->descr->type_num != NPY_INT ||
+       bObj->nd != 1 || sObj->nd != 1 || !PyArray_ISCARRAY_RO(bObj) || !PyArray_ISCARRAY_RO(sObj) ||
+       bObj->dimensions[0] != m || sObj->dimensions[0] != m){
+        PyErr_SetString(PyExc_ValueError, "In not_configvectors: bins and spline orders must be contiguous int vectors with one entry per row.");
+        return 1;
+    }
+    b = (const int*) bObj->data;
+    so = (const int*) sObj->data;
+    for(i = 0; i < m; i++){
+        if(so[i] < 1 || b[i] < so[i]){
+            PyErr_Format(PyExc_ValueError, "In not_configvectors: row %d needs 1 <= spline order <= bins.", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static PyObject*
+mi_diff_bins(PyObject *self, PyObject *args){
+    double MI;
+    int binx = 6, biny = 6, sox = 3, soy = 3, norm = 1, negateMI = 0;
+    PyObject *xObj, *yObj;
+    doubleVec x, y;
+
+    if(! PyArg_ParseTuple( args, "OO|iiiiii", &xObj, &yObj, &binx, &biny, &sox, &soy, &norm, &negateMI )) return NULL;
+    if(not_config(binx, sox, "mi_diff_bins") || not_config(biny, soy, "mi_diff_bins")) return NULL;
+    if(get_double_pair(xObj, yObj, &x, &y, "mi_diff_bins") < 0) return NULL;
+    if(not_observed(x.data, x.n, "mi_diff_bins") || not_observed(y.data, y.n, "mi_diff_bins")){
+        release_double_vector(&x);
+        release_double_vector(&y);
+        return NULL;
+    }
+
+    MI = mi2DiffBins(x.data, y.data, x.n, binx, biny, sox, soy, norm, negateMI);
+
+    release_double_vector(&x);
+    release_double_vector(&y);
+    return Py_BuildValue("d", MI);
+}
 
+static PyObject*
+all_mi_mixed(PyObject *self, PyObject *args){
+    int m, bins = 6, so = 3, norm = 1, negateMI = 1, nthreads = 1;
+    npy_intp dim[1] = {0};
+    PyArrayObject *dObj, *bObj, *sObj, *out;
+    PyObject *vObj;
+    mixedRows *prep;
+    doubleVec vec;
+
+    if(! PyArg_ParseTuple( args, "OOOO|iiiii", &dObj, &vObj, &bObj, &sObj, &bins, &so, &norm, &negateMI, &nthreads )) return NULL;
+    if(not_config(bins, so, "all_mi_mixed")) return NULL;
+
+    if(not_doublematrix(dObj)) return NULL;
     m = dim[0] = dObj->dimensions[0];
-    n = dObj->dimensions[1];
+    if(not_configvectors(bObj, sObj, m)) return NULL;
+    if(get_double_vector(vObj, &vec) < 0) return NULL;
+    if(dObj->dimensions[1] != vec.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In all_mi_mixed: vector length must match the number of columns.");
+        release_double_vector(&vec);
+        return NULL;
+    }
+    if(not_observed(vec.data, vec.n, "all_mi_mixed") || not_observed((double*) dObj->data, (size_t) m * vec.n, "all_mi_mixed")){
+        release_double_vector(&vec);
+        return NULL;
+    }
 
-    if(n != PySequence_Size(vObj)) return NULL; // make sure input has compatible dimensions
+    out = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
 
-    vec = (double*) calloc(n, sizeof(double));
-    //MI = (double*) calloc(m, sizeof(double));
+    Py_BEGIN_ALLOW_THREADS
+    prep = prepareMixedRows((double*) dObj->data, m, dObj->dimensions[1], (int*) bObj->data, (int*) sObj->data, nthreads);
+    mixedAllMI(prep, vec.data, bins, so, (double*) out->data, norm, negateMI, nthreads);
+    freeMixedRows(prep);
+    Py_END_ALLOW_THREADS
 
-    seq = PySequence_Fast(vObj, "Expected a sequence");
-    for(i = 0; i < n; i++)
-        vec[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
-    Py_DECREF(seq);
-    
-    data = (double*) dObj->data;
+    release_double_vector(&vec);
+    return PyArray_Return(out);
+}
+
+static PyObject*
+all_pairs_mi_mixed(PyObject *self, PyObject *args){
+    int m, norm = 1, negateMI = 1, nthreads = 1;
+    npy_intp dim[2] = {0, 0};
+    PyArrayObject *dObj, *bObj, *sObj, *out;
+    mixedRows *prep;
+
+    if(! PyArg_ParseTuple( args, "OOO|iii", &dObj, &bObj, &sObj, &norm, &negateMI, &nthreads )) return NULL;
+
+    if(not_doublematrix(dObj)) return NULL;
+    m = dim[0] = dim[1] = dObj->dimensions[0];
+    if(not_configvectors(bObj, sObj, m)) return NULL;
+    if(not_observed((double*) dObj->data, (size_t) m * dObj->dimensions[1], "all_pairs_mi_mixed")) return NULL;
+
+    out = (PyArrayObject*) PyArray_SimpleNew(2, dim, PyArray_DOUBLE);
+    Py_BEGIN_ALLOW_THREADS
+    prep = prepareMixedRows((double*) dObj->data, m, dObj->dimensions[1], (int*) bObj->data, (int*) sObj->data, nthreads);
+    mixedAllPairsMI(prep, (double*) out->data, norm, negateMI, nthreads);
+    freeMixedRows(prep);
+    Py_END_ALLOW_THREADS
+
+    return PyArray_Return(out);
+}
+
+static void
+incremental_destructor(PyObject *capsule){
+    freeIncrementalRows((incrementalRows*) PyCapsule_GetPointer(capsule, "pymi.incrementalRows"));
+}
+
+static PyObject*
+incremental_new(PyObject *self, PyObject *args){
+    int bins = 6, so = 3;
+    double vecLo, vecHi;
+    PyObject *loObj, *hiObj;
+    doubleVec lo, hi;
+    incrementalRows *inc;
+
+    if(! PyArg_ParseTuple( args, "OOdd|ii", &loObj, &hiObj, &vecLo, &vecHi, &bins, &so )) return NULL;
+    if(not_config(bins, so, "incremental_new")) return NULL;
+    if(get_double_pair(loObj, hiObj, &lo, &hi, "incremental_new") < 0) return NULL;
+
+    inc = newIncrementalRows(lo.n, bins, so, lo.data, hi.data, vecLo, vecHi);
+    release_double_vector(&lo);
+    release_double_vector(&hi);
+    return PyCapsule_New(inc, "pymi.incrementalRows", incremental_destructor);
+}
+
+static PyObject*
+incremental_append(PyObject *self, PyObject *args){
+    int nthreads = 1;
+    PyArrayObject *dObj;
+    PyObject *capsule, *vObj;
+    incrementalRows *inc;
+    doubleVec vec;
+
+    if(! PyArg_ParseTuple( args, "OOO|i", &capsule, &dObj, &vObj, &nthreads )) return NULL;
+    if((inc = (incrementalRows*) PyCapsule_GetPointer(capsule, "pymi.incrementalRows")) == NULL) return NULL;
+    if(not_doublematrix(dObj)) return NULL;
+    if(dObj->dimensions[0] != inc->m){
+        PyErr_SetString(PyExc_ValueError, "In incremental_append: matrix must have one row per tracked row.");
+        return NULL;
+    }
+
+    if(get_double_vector(vObj, &vec) < 0) return NULL;
+    if(dObj->dimensions[1] != vec.n){ // make sure input has compatible dimensions
+        PyErr_SetString(PyExc_ValueError, "In incremental_append: vector length must match the number of columns.");
+        release_double_vector(&vec);
+        return NULL;
+    }
+    if(not_observed(vec.data, vec.n, "incremental_append") ||
+       not_observed((double*) dObj->data, (size_t) dObj->dimensions[0] * vec.n, "incremental_append")){
+        release_double_vector(&vec);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    incrementalAppend(inc, (double*) dObj->data, vec.data, vec.n, nthreads);
+    Py_END_ALLOW_THREADS
+
+    release_double_vector(&vec);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+incremental_all_mi(PyObject *self, PyObject *args){
+    int norm = 1, negateMI = 1;
+    npy_intp dim[1] = {0};
+    PyArrayObject *out;
+    PyObject *capsule;
+    incrementalRows *inc;
+
+    if(! PyArg_ParseTuple( args, "O|ii", &capsule, &norm, &negateMI )) return NULL;
+    if((inc = (incrementalRows*) PyCapsule_GetPointer(capsule, "pymi.incrementalRows")) == NULL) return NULL;
+
+    dim[0] = inc->m;
     out = (PyArrayObject*) PyArray_SimpleNew(1, dim, PyArray_DOUBLE);
-    MI = (double*) out->data;
-    
-    getAllMIWz(data, vec, MI, m, n, bins, so, norm, negateMI);
- 
-    free(vec);
+    incrementalAllMI(inc, (double*) out->data, norm, negateMI);
     return PyArray_Return(out);
+}
 
+static PyObject*
+set_specialized(PyObject *self, PyObject *args){
+    int on;
 
-    /*  
-    numSamples = PySequence_Size(xObj);
-    x = (double*) calloc(numSamples, sizeof(double));
-    knots = (double*) calloc(numBins + splineOrder, sizeof(double));
-    //weights = (double*) calloc(numBins * numSamples, sizeof(double));
+    if(! PyArg_ParseTuple( args, "i", &on )) return NULL;
+    return Py_BuildValue("i", setSpecializedKernels(on));
+}
 
-    seq = PySequence_Fast(xObj, "Expected a sequence");
-    for(i = 0; i < numSamples; i++)
-        x[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
-    Py_DECREF(seq);
+static PyObject*
+set_profiling(PyObject *self, PyObject *args){
+    int on;
 
-    knotVector(knots, numBins, splineOrder);
-    
-    w_dim[0] = numSamples * numBins;
-    wObj = (PyArrayObject *)PyArray_SimpleNew(1, w_dim, PyArray_DOUBLE);
-    weights = (double*) wObj->data;
-    findWeights(x, knots, weights, numSamples, splineOrder, numBins, -1, -1);
-      
-    free(knots);
-    free(x);
-    
-    return PyArray_Return(wObj);   
-    */
+    if(! PyArg_ParseTuple( args, "i", &on )) return NULL;
+    return Py_BuildValue("i", setProfiling(on));
+}
+
+/* {phase: (calls, samples, seconds)} */
+static PyObject*
+profile_counters(PyObject *self, PyObject *args){
+    PyObject *out = PyDict_New(), *v;
+    int k;
+
+    for(k = 0; k < NUM_PHASES; k++){
+        v = Py_BuildValue("(LLd)", __atomic_load_n(&phaseCalls[k], __ATOMIC_RELAXED), __atomic_load_n(&phaseSamples[k], __ATOMIC_RELAXED),
+                          __atomic_load_n(&phaseNanos[k], __ATOMIC_RELAXED) * 1e-9);
+        PyDict_SetItemString(out, phaseNames[k], v);
+        Py_DECREF(v);
+    }
+    return out;
+}
+
+static PyObject*
+reset_profile(PyObject *self, PyObject *args){
+    resetProfile();
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+simd_level(PyObject *self, PyObject *args){
+    return Py_BuildValue("i", simdLevel);
+}
+
+static PyObject*
+set_simd_level(PyObject *self, PyObject *args){
+    int level;
+
+    if(! PyArg_ParseTuple( args, "i", &level )) return NULL;
+    return Py_BuildValue("i", setSimdLevel(level));
 }
 
 
@@ -721,6 +4667,37 @@ static PyMethodDef BSUtilMethods[] =
     {"joint_entropy", joint_entropy, METH_VARARGS, "calculate joint entropy or two vectors given bins and spline order"},
     {"mi", mi, METH_VARARGS, "mutual information of two vector"},
     {"all_mi", all_mi, METH_VARARGS, "calculate mutual information between a vector and every row in a matrix"},
+    {"all_pairs_mi", all_pairs_mi, METH_VARARGS, "calculate mutual information between every pair of rows in a matrix"},
+    {"all_mi_batch", all_mi_batch, METH_VARARGS, "calculate mutual information between every row of a query matrix and every row in a matrix"},
+    {"prepare", prepare, METH_VARARGS, "precompute weights and marginal entropies of every row in a matrix"},
+    {"prepared_arrays", prepared_arrays, METH_VARARGS, "copy of the weights and marginal entropies of prepared rows"},
+    {"prepare_from_arrays", prepare_from_arrays, METH_VARARGS, "prepared rows over precomputed weights and marginal entropies, borrowed in place"},
+    {"prepared_all_mi", prepared_all_mi, METH_VARARGS, "calculate mutual information between a vector and every row of a prepared matrix"},
+    {"all_mi_subsets", all_mi_subsets, METH_VARARGS, "calculate mutual information between a vector and every row in a matrix within each of several sample subsets"},
+    {"prepared_all_mi_subsets", prepared_all_mi_subsets, METH_VARARGS, "calculate mutual information between a vector and every row of a prepared matrix within each of several sample subsets"},
+    {"find_attractor", find_attractor, METH_VARARGS, "iterate a metagene to the MI-weighted average of its top rows in a prepared matrix until it converges"},
+    {"find_attractors", find_attractors, METH_VARARGS, "find_attractor from each row of a seed matrix, seeds in parallel"},
+    {"mi_network", mi_network, METH_VARARGS, "network of the rows of a prepared matrix with mutual information above a threshold, pruned by the data processing inequality"},
+    {"network_edges", network_edges, METH_VARARGS, "edges of a range of rows of a network from mi_network"},
+    {"mi_permutation_test", mi_permutation_test, METH_VARARGS, "mutual information of two vectors and its permutation p-value"},
+    {"all_mi_permutation", all_mi_permutation, METH_VARARGS, "mutual information and permutation p-value between a vector and every row in a matrix"},
+    {"mi3", mi_3, METH_VARARGS, "interaction information of three vectors"},
+    {"mi2vs1", mi_2vs1, METH_VARARGS, "mutual information between a pair of vectors and a third one"},
+    {"all_triplets", all_triplets, METH_VARARGS, "interaction information and pair-vs-row mutual information of a fixed pair with every row in a matrix"},
+    {"cmi", c_mi, METH_VARARGS, "conditional mutual information of two vectors given a third"},
+    {"all_cmi", all_cmi, METH_VARARGS, "conditional mutual information between a vector and every row in a matrix given a third vector"},
+    {"mi_diff_bins", mi_diff_bins, METH_VARARGS, "mutual information of two vectors with their own bins and spline orders"},
+    {"all_mi_mixed", all_mi_mixed, METH_VARARGS, "calculate mutual information between a vector and every row in a matrix, with per-row bins and spline orders"},
+    {"all_pairs_mi_mixed", all_pairs_mi_mixed, METH_VARARGS, "calculate mutual information between every pair of rows in a matrix, with per-row bins and spline orders"},
+    {"incremental_new", incremental_new, METH_VARARGS, "histogram sums for mutual information over a growing set of samples, with fixed ranges"},
+    {"incremental_append", incremental_append, METH_VARARGS, "add samples to incremental histogram sums"},
+    {"incremental_all_mi", incremental_all_mi, METH_VARARGS, "calculate mutual information between the query and every row from incremental histogram sums"},
+    {"set_profiling", set_profiling, METH_VARARGS, "turn the per-phase kernel timers and counters on or off, returns the previous setting"},
+    {"profile_counters", profile_counters, METH_NOARGS, "calls, samples and seconds spent in each kernel phase while profiling"},
+    {"reset_profile", reset_profile, METH_NOARGS, "zero the per-phase kernel counters"},
+    {"simd_level", simd_level, METH_NOARGS, "SIMD level in use: 0 scalar, 1 AVX2, 2 AVX-512"},
+    {"set_simd_level", set_simd_level, METH_VARARGS, "set the SIMD level, clamped to what the CPU supports, returns the previous level"},
+    {"set_specialized", set_specialized, METH_VARARGS, "turn the kernels specialized for bins 6-12 and spline orders 2-4 on or off, returns the previous setting"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -728,6 +4705,7 @@ PyMODINIT_FUNC
 init_c_bsplinemi(void)
 {
     (void) Py_InitModule("_c_bsplinemi", BSUtilMethods);
+    detectSimd();
     import_array(); // This is EXTREMELY IMPORTANT!!!!
 }
 
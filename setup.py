@@ -2,7 +2,7 @@ from distutils.core import setup
 from distutils.extension import Extension
 import numpy
 
-cmodule = Extension('_c_bsplinemi', include_dirs = ['pymi', numpy.get_include()], sources = ['pymi/utils.c'])
+cmodule = Extension('_c_bsplinemi', include_dirs = ['pymi', numpy.get_include()], sources = ['pymi/utils.c'], libraries = ['pthread'], extra_compile_args = ['-O3', '-fno-trapping-math'])
 
 setup(
     name='pymi',